@@ -2,50 +2,70 @@
 #include<stdlib.h>
 #include<stdbool.h>
 #include<stdint.h>
+#include<limits.h>
 #include<stdarg.h>
 #include<string.h>
 #include<assert.h>
 #include<ctype.h>
 #include<stdio.h>
 #include<sys/mman.h>
+#include<pthread.h>
+#include<sched.h>
+#include<dlfcn.h>
+#include<time.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/stat.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<setjmp.h>
+#include<signal.h>
+#include<errno.h>
+#include<ucontext.h>
+#include<sys/epoll.h>
+#include<sys/wait.h>
+#include<spawn.h>
 
 #include "attolisp.h"
 
 #define ATTOLISP_MAXLEN     200
 #define ATTOLISP_MEMSIZE    65536
-#define AL_ROOT_END     ((void*)-1)
+#define ATTOLISP_LOS_THRESHOLD  2048
+#define ATTOLISP_LOS_RESERVE    ((size_t)1 << 32)
+#define AL_PAGE_SIZE        4096
+#define ATTOLISP_ROOT_SLOTS ((size_t)1 << 22)
+#define ATTOLISP_FRAME_STACK    ((size_t)1 << 26)
 
-#define AL_ADD_ROOT(size)                   \
-    void *_RootBucket[(size)+2];            \
-    _RootBucket[0] = root;                  \
-    for(int i=1; i <= (size); i++){         \
-        _RootBucket[i] = NULL;              \
-    }                                       \
-    _RootBucket[(size)+1] = AL_ROOT_END;    \
-    root = _RootBucket
+// GC roots live on one contiguous shadow stack. `root` is the current top of
+// that stack: AL_DEFINEn claims n slots above it and moves the local `root`
+// past them, so the slots are released implicitly when the function returns
+// and the caller's `root` is in effect again.
+#define AL_ADD_ROOT(size)                                           \
+    al_object_t **_RootBucket = al_root_reserve(root, (size));      \
+    root = _RootBucket + (size)
 
 #define AL_DEFINE1(var1)                                        \
     AL_ADD_ROOT(1);                                             \
-    al_object_t **var1 = (al_object_t**)(_RootBucket + 1)
+    al_object_t **var1 = _RootBucket
 
 #define AL_DEFINE2(var1, var2)                                  \
     AL_ADD_ROOT(2);                                             \
-    al_object_t **var1 = (al_object_t**)(_RootBucket + 1);      \
-    al_object_t **var2 = (al_object_t**)(_RootBucket + 2)
+    al_object_t **var1 = _RootBucket;                           \
+    al_object_t **var2 = _RootBucket + 1
 
 
 #define AL_DEFINE3(var1, var2, var3)                            \
-    AL_ADD_ROOT(2);                                             \
-    al_object_t **var1 = (al_object_t**)(_RootBucket + 1);      \
-    al_object_t **var2 = (al_object_t**)(_RootBucket + 2);      \
-    al_object_t **var3 = (al_object_t**)(_RootBucket + 3)
+    AL_ADD_ROOT(3);                                             \
+    al_object_t **var1 = _RootBucket;                           \
+    al_object_t **var2 = _RootBucket + 1;                       \
+    al_object_t **var3 = _RootBucket + 2
 
 #define AL_DEFINE4(var1, var2, var3, var4)                      \
-    AL_ADD_ROOT(2);                                             \
-    al_object_t **var1 = (al_object_t**)(_RootBucket + 1);      \
-    al_object_t **var2 = (al_object_t**)(_RootBucket + 2);      \
-    al_object_t **var3 = (al_object_t**)(_RootBucket + 3);      \
-    al_object_t **var4 = (al_object_t**)(_RootBucket + 4)
+    AL_ADD_ROOT(4);                                             \
+    al_object_t **var1 = _RootBucket;                           \
+    al_object_t **var2 = _RootBucket + 1;                       \
+    al_object_t **var3 = _RootBucket + 2;                       \
+    al_object_t **var4 = _RootBucket + 3
 
 
 // constants
@@ -54,1002 +74,7712 @@ static al_object_t *al_nil = &(al_object_t){ ATTOLISP_TYPE_NIL };
 static al_object_t *al_dot = &(al_object_t){ ATTOLISP_TYPE_DOT };
 static al_object_t *al_cparen = &(al_object_t){ ATTOLISP_TYPE_CPAREN };
 
-// symbol list
+// bytes in front of the fields of an object that carries a header
+#define AL_HEADER   offsetof(al_object_t, value)
+
+// symbol list; with ATTOLISP_WEAK_SYMBOLS it does not keep symbols alive
 static al_object_t *al_symbols;
+static bool al_weak_symbols = false;
+// bumped by al_add_variable so cached global bindings can be revalidated
+static unsigned al_define_epoch = 0;
 
 // ---
 static void *al_memory;
 static void *al_from;
 static size_t al_mem_used = 0;
+static size_t al_memsize = ATTOLISP_MEMSIZE;
+// bytes of each semispace that may be backed by memory
+static size_t al_memory_touched = 0;
+static size_t al_from_touched = 0;
 // GC flags
 static bool al_gc_running = false;
 static bool al_gc_debug = false;
 static bool al_gc_always = false;
+static int al_gc_threads = 1;
 
 #define AL_ERROR_HEADER printf("\n%s:%d\n", __func__, __LINE__)
 
+// Set while the server evaluates a request: errors unwind to it instead of
+// ending the process. An error in the middle of a collection still does.
+static jmp_buf *al_error_handler;
+
 // ---
 static void al_error(const char *fmt, ...){
     va_list args;
     va_start(args, fmt);
     AL_ERROR_HEADER;
+    fflush(stdout);
     vfprintf(stderr, fmt, args);
     fprintf(stderr, "\n");
     va_end(args);
+    if(al_error_handler && !al_gc_running){
+        longjmp(*al_error_handler, 1);
+    }
     exit(EXIT_FAILURE);
 }
 
 static void attolisp_gc(void *root);
 
 // *****
-static inline size_t al_round_up(size_t var, size_t size){
-    return (var + size - 1) & ~(size - 1);
+// Limits on a single top-level evaluation: steps (calls, loop iterations
+// and interpreted forms), bytes allocated and call depth. Each counter
+// counts down from its limit while al_eval_toplevel runs and stays too high
+// to run out otherwise, so a check is a decrement and a branch that is not
+// taken.
+static int64_t al_fuel_limit = INT64_MAX;
+static int64_t al_alloc_limit = INT64_MAX;
+static int64_t al_depth_limit = INT64_MAX;
+static int64_t al_fuel = INT64_MAX;
+static int64_t al_alloc_left = INT64_MAX;
+static int64_t al_depth_left = INT64_MAX;
+
+// *****
+static void al_quota_exceeded(const char *what, int64_t limit){
+    al_error("QUOTA: %s limit of %lld exceeded", what, (long long)limit);
 }
 
+// *****
+static inline void al_quota_start(void){
+    al_fuel = al_fuel_limit;
+    al_alloc_left = al_alloc_limit;
+    al_depth_left = al_depth_limit;
+}
 
-// ******
-static al_object_t* al_alloc(void *root, int type, size_t size){
-    size = al_round_up(size, sizeof(void*));
-    size += offsetof(al_object_t, value);
-    size = al_round_up(size, sizeof(void*));
-    if(al_gc_always && !al_gc_running){
-        attolisp_gc(root);
-    }
+// Lifts the limits again, for reading the next form and the like.
+static inline void al_quota_end(void){
+    al_fuel = al_alloc_left = al_depth_left = INT64_MAX;
+}
 
-    if(!al_gc_always && ATTOLISP_MEMSIZE < al_mem_used + size){
-        attolisp_gc(root);
-    }
+// *****
+static inline void al_step(void){
+    if(--al_fuel < 0){ al_quota_exceeded("step", al_fuel_limit); }
+}
 
-    if(ATTOLISP_MEMSIZE < al_mem_used + size){
-        al_error("Memory exhausted");
+// *****
+static inline void al_charge(size_t bytes){
+    if((al_alloc_left -= (int64_t)bytes) < 0){
+        al_quota_exceeded("allocation", al_alloc_limit);
     }
+}
 
-    al_object_t *object = al_memory + al_mem_used;
-    object->type = type;
-    object->size = size;
-    al_mem_used += size;
-
-    return object;
+// Enters a call; the caller leaves it with al_depth_left++.
+static inline void al_enter(void){
+    al_step();
+    if(--al_depth_left < 0){ al_quota_exceeded("depth", al_depth_limit); }
 }
 
-// -------------------------------
-// ----- GARBAGE COLLECTOR -------
-// -------------------------------
-static al_object_t *scan1;
-static al_object_t *scan2;
+// *****
+// shadow stack of GC roots
+static al_object_t **al_root_stack;
+static al_object_t **al_root_limit;
 
 // *****
-static inline al_object_t* al_forward(al_object_t *object){
-    ptrdiff_t offset = (uint8_t*)object - (uint8_t*)al_from;
-    if(offset < 0 || ATTOLISP_MEMSIZE <= offset){
-        return object;
+static inline al_object_t** al_root_reserve(void *root, size_t size){
+    al_object_t **slots = root;
+    if(al_root_limit < slots + size){
+        al_error("Root stack overflow");
     }
+    for(size_t i=0; i < size; i++){ slots[i] = NULL; }
+    return slots;
+}
 
-    if(object->type == ATTOLISP_TYPE_MOVED){
-        return object->moved;
+// The stack is reserved up front and only backed by memory as it is used,
+// so slots never move and a slot address stays valid while it is live.
+static void* al_root_init(void){
+    void *stack = mmap(
+        NULL, ATTOLISP_ROOT_SLOTS * sizeof(al_object_t*),
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANON | MAP_NORESERVE,
+        -1, 0
+    );
+    if(stack == MAP_FAILED){
+        al_error("Cannot allocate root stack");
     }
+    al_root_stack = stack;
+    al_root_limit = al_root_stack + ATTOLISP_ROOT_SLOTS;
+    return al_root_stack;
+}
 
-    al_object_t *pointer = scan2;
-    memcpy(pointer, object, object->size);
-    scan2 = (al_object_t*)((uint8_t*)scan2 + object->size);
+// *****
+// LIFO region holding the environment frames of calls that cannot leak them.
+// Each record is a header followed by an ENV object and its binding conses,
+// laid out like heap objects so the collector can scan them in place.
+typedef struct al_frame_record_t {
+    al_object_t **owner;        // slot the frame is used through
+    size_t size;                // bytes, header included
+} al_frame_record_t;
 
-    object->type = ATTOLISP_TYPE_MOVED;
-    object->moved = pointer;
-    return pointer;
-}
+static uint8_t *al_frame_base;
+static uint8_t *al_frame_top;
+static uint8_t *al_frame_limit;
+static bool al_stack_frames = true;
+
+#define AL_FRAME_OBJECT                                             \
+    (offsetof(al_object_t, value) + 2 * sizeof(al_object_t*))
 
 // *****
-static void* al_alloc_semispace(){
-    return mmap(
-        NULL, ATTOLISP_MEMSIZE,
+static void al_frame_init(void){
+    void *stack = mmap(
+        NULL, ATTOLISP_FRAME_STACK,
         PROT_READ | PROT_WRITE,
-        MAP_PRIVATE | MAP_ANON,
+        MAP_PRIVATE | MAP_ANON | MAP_NORESERVE,
         -1, 0
     );
+    if(stack == MAP_FAILED){
+        al_error("Cannot allocate frame stack");
+    }
+    al_frame_base = al_frame_top = stack;
+    al_frame_limit = al_frame_base + ATTOLISP_FRAME_STACK;
 }
 
 // *****
-static void al_forward_root_objects(void *root){
-    al_symbols = al_forward(al_symbols);
-    for(void **frame = root; frame; frame = *(void***)frame){
-        for(int i=1; frame[i] != AL_ROOT_END; i++){
-            if(frame[i]){ frame[i] = al_forward(frame[i]); }
-        }
-    }
+// Tested on the fields, since a headerless heap object may start just
+// past the end of a neighbouring mapping.
+static inline bool al_on_frame_stack(al_object_t *object){
+    uint8_t *fields = (uint8_t*)object + AL_HEADER;
+    return fields > al_frame_base && fields < al_frame_top;
 }
 
-// ---- implemenation of al_gc
-static void attolisp_gc(void *root){
-    assert(!al_gc_running);
-    al_gc_running = true;
-
-    al_from = al_memory;
-    scan1 = scan2 = al_memory;
-    al_forward_root_objects(root);
-
-    while(scan1 < scan2){
-        switch(scan1->type){
-        case ATTOLISP_TYPE_INT:
-        case ATTOLISP_TYPE_SYMBOL:
-        case ATTOLISP_TYPE_PRIMITIVE:
-            break;
-        case ATTOLISP_TYPE_CELL:
-            scan1->car = al_forward(scan1->car);
-            scan1->cdr = al_forward(scan1->cdr);
-            break;
-        case ATTOLISP_TYPE_FUNCTION:
-        case ATTOLISP_TYPE_MACRO:
-            scan1->params = al_forward(scan1->params);
-            scan1->body = al_forward(scan1->body);
-            scan1->env = al_forward(scan1->env);
-            break;
-        case ATTOLISP_TYPE_ENV:
-            scan1->vars = al_forward(scan1->vars);
-            scan1->up = al_forward(scan1->up);
-            break;
-        default:
-            al_error("ERROR:: copy: unknown type %d", scan1->type);
-        }// end switch
-        scan1 = (al_object_t*)((uint8_t*)scan1 + scan1->type);
-    }// end while
+// *****
+static inline al_object_t* al_frame_object(uint8_t **cursor, int type){
+    al_object_t *object = (al_object_t*)*cursor;
+    object->type = type;
+    object->size = AL_FRAME_OBJECT;
+    *cursor += AL_FRAME_OBJECT;
+    return object;
+}
 
-    // Finish up garbage collection
-    munmap(al_from, ATTOLISP_MEMSIZE);
-    size_t old_mem_used = al_mem_used;
-    al_mem_used = (size_t)((uint8_t*)scan1 - (uint8_t*)al_memory);
-    if(al_gc_debug){
-        fprintf(
-            stderr, "al_gc: %zu bytes out of %zu bytes copied.\n",
-            al_mem_used, old_mem_used
-        );
+// Pushes a frame binding `params` to argv[0..argc). Does not allocate from
+// the heap, so nothing moves while it runs.
+static al_object_t* al_frame_push(
+    al_object_t **owner, al_object_t *params, al_object_t **argv, int argc,
+    al_object_t *up
+){
+    size_t size = sizeof(al_frame_record_t) +
+        AL_FRAME_OBJECT * (size_t)(1 + 2 * argc);
+    if((size_t)(al_frame_limit - al_frame_top) < size){
+        al_error("Frame stack overflow");
     }
+    al_frame_record_t *record = (al_frame_record_t*)al_frame_top;
+    record->owner = owner;
+    record->size = size;
+    uint8_t *cursor = al_frame_top + sizeof(al_frame_record_t);
+    al_frame_top += size;
 
-    al_gc_running = false;
+    al_object_t *frame = al_frame_object(&cursor, ATTOLISP_TYPE_ENV);
+    frame->vars = al_nil;
+    frame->up = up;
+    for(int i=0; i < argc; i++, params = params->cdr){
+        al_object_t *bind = al_frame_object(&cursor, ATTOLISP_TYPE_CELL);
+        bind->car = params->car;
+        bind->cdr = argv[i];
+        al_object_t *cell = al_frame_object(&cursor, ATTOLISP_TYPE_CELL);
+        cell->car = bind;
+        cell->cdr = frame->vars;
+        frame->vars = cell;
+    }
+    return frame;
 }
 
-// ***********************
-//      CONSTRUCTORS
-// ***********************
-static al_object_t* al_new_int(void *root, int value){
-    al_object_t *result = al_alloc(root, ATTOLISP_TYPE_INT, sizeof(int));
-    result->value = value;
-    return result;
-}
+// *****
+// Green threads, see the GREEN THREADS section. The running task works on
+// al_root_stack, al_frame_base and the other globals; a suspended one keeps
+// their values here, and the collector scans its roots and frames from them.
+typedef struct al_task_t {
+    ucontext_t context;
+    struct al_task_t *next;         // run queue or free list
+    struct al_task_t *before;       // ring of live tasks, main included
+    struct al_task_t *after;
+    int id;
+    int state;
+    uint8_t *mapping;               // C stack, roots and frames; NULL in main
+    al_object_t **roots;
+    al_object_t **root_top;
+    al_object_t **root_limit;
+    uint8_t *frame_base;
+    uint8_t *frame_top;
+    uint8_t *frame_limit;
+    struct al_site_t **sites;
+    size_t site_depth;
+    size_t site_capacity;
+    int64_t fuel;
+    int64_t alloc_left;
+    int64_t depth_left;
+    jmp_buf *error_handler;
+    al_object_t **channel;          // slot of the channel being received on
+    int fd;                         // descriptor being waited on, or -1
+    uint64_t wake;                  // end of a sleep, CLOCK_MONOTONIC ns
+} al_task_t;
+
+static al_task_t al_task_main = {
+    .before = &al_task_main, .after = &al_task_main
+};
+static al_task_t *al_task_current = &al_task_main;
 
 // *****
-static al_object_t* al_new_cons(
-    void *root, al_object_t **car, al_object_t **cdr
-){
-    al_object_t *cell = al_alloc(
-        root, ATTOLISP_TYPE_CELL, sizeof(al_object_t*)*2);
-    cell->car = *car;
-    cell->cdr = *cdr;
+// fixed root arrays owned by native modules
+#define AL_MAX_STATIC_ROOTS 256
+static struct {
+    al_object_t **slots;
+    size_t count;
+} al_static_roots[AL_MAX_STATIC_ROOTS];
+static int al_nstatic_roots = 0;
 
-    return cell;
+// *****
+static void al_add_static_roots(al_object_t **slots, size_t count){
+    if(al_nstatic_roots == AL_MAX_STATIC_ROOTS){
+        al_error("Too many static root arrays");
+    }
+    al_static_roots[al_nstatic_roots].slots = slots;
+    al_static_roots[al_nstatic_roots].count = count;
+    al_nstatic_roots++;
 }
 
 // *****
-static al_object_t* al_new_symbol(void *root, const char *name){
-    al_object_t *symbol = al_alloc(root, ATTOLISP_TYPE_SYMBOL, strlen(name)+1);
-    strcpy(symbol->name, name);
-    return symbol;
-}
+// Units of analyzed code, see the ANALYZER section. Their constants are GC
+// roots. The collector frees a unit once no function object refers to it
+// and it is not running.
+typedef struct al_cache_t {
+    int symbol;                 // constant index of the variable name
+    int depth;                  // static frames between the use and globals
+    unsigned epoch;             // al_define_epoch when the lookup was done
+    al_object_t *frame;         // frame the lookup started from
+    al_object_t *binding;
+} al_cache_t;
+
+typedef struct al_frame_t {
+    int params;                 // constant index of the parameter list
+    bool dynamic;               // the body may define into this frame
+} al_frame_t;
+
+typedef struct al_chunk_t {
+    struct al_chunk_t *next;
+    size_t used;
+    size_t size;
+    uint8_t data[];
+} al_chunk_t;
+
+// Result cache of a memoized function, see the MEMOIZATION section.
+#define AL_MEMO_WAYS    4
+#define AL_MEMO_ARGS    4
+
+typedef struct al_memo_entry_t {
+    uint64_t hash;
+    uint64_t stamp;             // last use, 0 while the entry is free
+    int argc;
+    al_object_t *args[AL_MEMO_ARGS];
+    al_object_t *result;
+} al_memo_entry_t;
+
+typedef struct al_memo_t {
+    size_t nsets;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    al_memo_entry_t entries[];  // nsets * AL_MEMO_WAYS
+} al_memo_t;
+
+// Weak-keyed table, see the WEAK TABLES section.
+typedef struct al_table_entry_t {
+    al_object_t *key;           // NULL while the slot is free
+    al_object_t *value;
+} al_table_entry_t;
+
+typedef struct al_table_t {
+    struct al_table_t *next;
+    unsigned mark;              // last collection that found it live
+    size_t count;
+    size_t capacity;            // a power of two
+    al_table_entry_t *entries;
+} al_table_t;
+
+typedef struct al_code_t {
+    struct al_code_t *next;
+    struct al_node_t *entry;    // NULL until the body has been analyzed
+    al_object_t **constants;
+    int nconstants, maxconstants;
+    al_cache_t *caches;
+    int ncaches, maxcaches;
+    struct al_code_t **children;    // units of the lambdas inside
+    int nchildren, maxchildren;
+    al_frame_t *frames;         // static scope, innermost frame first
+    int nframes;
+    int body;
+    int arity;                  // -1 with a rest parameter
+    bool stack_frame;           // calls get their frame on the frame stack
+    bool saw_define;
+    bool preparing;
+    // inlining: frames from `barrier` outwards are the caller's and must not
+    // be seen by the inlined body
+    int barrier;
+    int inline_depth;
+    bool inline_failed;
+    al_chunk_t *arena;          // nodes
+    unsigned mark;
+    int active;
+    al_memo_t *memo;            // set for functions made by defmemo
+} al_code_t;
+
+static al_code_t *al_codes;
+static unsigned al_gc_count = 0;
+static void al_code_mark(al_code_t *code);
+static void al_code_sweep(void);
+
+static al_object_t* al_los_alloc(void *root, int type, size_t size);
+static size_t al_los_threshold = ATTOLISP_LOS_THRESHOLD;
+static bool al_profiling = false;
+static void al_profile_alloc(int type, size_t count, size_t bytes);
+static bool al_census = false;
+static void al_census_add(al_object_t *object, int type, size_t size);
 
 // *****
-static al_object_t* al_new_primitive(void *root, al_primitive_t fn){
-    al_object_t *result = al_alloc(
-        root, ATTOLISP_TYPE_PRIMITIVE, sizeof(al_primitive_t));
-        result->fn = fn;
-        return result;
+static inline size_t al_round_up(size_t var, size_t size){
+    return (var + size - 1) & ~(size - 1);
 }
 
 
 // *****
-static al_object_t* al_new_function(
-    void *root, al_object_t **env, int type, al_object_t **params,
-    al_object_t **body
-){
-    assert(type == ATTOLISP_TYPE_FUNCTION || type == ATTOLISP_TYPE_MACRO);
-    al_object_t *result = al_alloc(root, type, sizeof(al_object_t*)*3);
-    result->params = *params;
-    result->body = *body;
-    result->env = *env;
+// The semispace is carved into pages that each hold one kind of object.
+// Integers, conses, primitives, closures and environments have a fixed size,
+// so their pages store them back to back without a header: type and size
+// come from the page. An object pointer still points one header before the
+// fields, so `->car` and the like are unchanged, but the type of an object
+// has to be read with al_type(). Symbols, buffers, weak objects and
+// channels keep their header and share the mixed pages. Kinds are numbered
+// by type, so the ones that are not heap objects are left unused.
+#define AL_KIND_MIXED   0
+#define AL_KINDS        (ATTOLISP_TYPE_CHANNEL + 1)
 
-    return result;
-}
+// field bytes of the headerless kinds, zero for the mixed ones
+static const uint8_t al_kind_size[AL_KINDS] = {
+    // an integer slot has room for the forwarding pointer
+    [ATTOLISP_TYPE_INT] = sizeof(void*),
+    [ATTOLISP_TYPE_CELL] = 2 * sizeof(void*),
+    [ATTOLISP_TYPE_PRIMITIVE] = sizeof(al_primitive_t),
+    [ATTOLISP_TYPE_FUNCTION] = 4 * sizeof(void*),
+    [ATTOLISP_TYPE_MACRO] = 4 * sizeof(void*),
+    [ATTOLISP_TYPE_ENV] = 2 * sizeof(void*),
+};
+
+// kind of each page of the current semispace and of the one being evacuated
+static uint8_t *al_kinds;
+static uint8_t *al_from_kinds;
+
+typedef struct al_bump_t {
+    uint8_t *top;
+    uint8_t *limit;
+} al_bump_t;
+
+// page each kind is currently filled from
+static al_bump_t al_bump[AL_KINDS];
 
 // *****
-static al_object_t* al_new_env(
-    void *root, al_object_t **vars, al_object_t **up
-){
-    al_object_t* result = al_alloc(
-        root, ATTOLISP_TYPE_ENV, sizeof(al_object_t*)*2);
-    result->vars = *vars;
-    result->up = *up;
-    return result;
+static inline int al_type(const al_object_t *object){
+    size_t offset = (uintptr_t)object + AL_HEADER - (uintptr_t)al_memory;
+    if(offset < al_memsize){
+        int kind = al_kinds[offset / AL_PAGE_SIZE];
+        if(kind != AL_KIND_MIXED){ return kind; }
+    }
+    return object->type;
 }
 
-static al_object_t* al_acons(
-    void *root, al_object_t **x, al_object_t **y, al_object_t **a
-){
-    AL_DEFINE1(cell);
-    *cell = al_new_cons(root, x, y);
-    return al_new_cons(root, cell, a);
+// *****
+static inline int al_kind_of(int type){
+    return type < AL_KINDS && al_kind_size[type] ? type : AL_KIND_MIXED;
 }
 
-// ---
-const char al_symbol_chars[] = "~!@#$%^*-_=+:/?<>";
-
-static al_object_t* al_read_expr(void *root);
-
 // *****
-static int al_peek(void){
-    int c = getchar();
-    ungetc(c, stdin);
-    return c;
+static inline al_object_t* al_slot_object(int kind, uint8_t *slot){
+    return (al_object_t*)(kind == AL_KIND_MIXED ? slot : slot - AL_HEADER);
 }
 
-static al_object_t* al_reverse(al_object_t *list){
-    al_object_t *result = al_nil;
-    while(list != al_nil){
-        al_object_t *head = list;
-        list = list->cdr;
-        head->cdr = result;
-        result = head;
-    }
+// *****
+static inline bool al_has_pointers(int type){
+    return type == ATTOLISP_TYPE_CELL || type == ATTOLISP_TYPE_FUNCTION ||
+        type == ATTOLISP_TYPE_MACRO || type == ATTOLISP_TYPE_ENV ||
+        type == ATTOLISP_TYPE_WEAK || type == ATTOLISP_TYPE_TABLE ||
+        type == ATTOLISP_TYPE_CHANNEL;
+}
 
-    return result;
+// Claims `pages` fresh pages of the current semispace for `kind`. Returns
+// NULL when the semispace is used up.
+static uint8_t* al_page_claim(int kind, size_t pages){
+    size_t bytes = pages * AL_PAGE_SIZE;
+    if(al_memsize < al_mem_used + bytes){ return NULL; }
+    uint8_t *page = (uint8_t*)al_memory + al_mem_used;
+    memset(al_kinds + al_mem_used / AL_PAGE_SIZE, kind, pages);
+    al_mem_used += bytes;
+    return page;
 }
 
-// *****
-static void al_skip_line(void){
-    while(1){
-        int c = getchar();
-        if(c == EOF || c == '\n'){ return; }
-        if(c == '\r'){
-            if(al_peek() == '\n'){ getchar(); }
-            return;
-        }
+static void al_gc_retire(int kind, uint8_t *top, uint8_t *page);
+
+// Bump-allocates `size` bytes from the page of `kind`, starting a new page
+// when it is full. Returns NULL when the semispace is used up.
+static uint8_t* al_bump_alloc(int kind, size_t size){
+    al_bump_t *bump = &al_bump[kind];
+    if((size_t)(bump->limit - bump->top) < size){
+        size_t pages = (size + AL_PAGE_SIZE - 1) / AL_PAGE_SIZE;
+        uint8_t *page = al_page_claim(kind, pages);
+        if(!page){ return NULL; }
+        if(al_gc_running){ al_gc_retire(kind, bump->top, page); }
+        bump->top = page;
+        bump->limit = page + pages * AL_PAGE_SIZE;
     }
+    uint8_t *pointer = bump->top;
+    bump->top += size;
+    return pointer;
 }
 
-// *****
-static al_object_t* al_read_list(void *root){
-    AL_DEFINE3(object, head, last);
-    *head = al_nil;
-    while(1){
-        *object = al_read_expr(root);
-        if(!*object){
-            al_error("Unclosed parenthesis");
-        }
-        if(*object == al_cparen){
-            return al_reverse(*head);
-        }
-        if(*object == al_dot){
-            *last = al_read_expr(root);
-            if(al_read_expr(root) != al_cparen){
-                al_error("Closed parenthesis expected after dot");
-            }
-            al_object_t *result = al_reverse(*head);
-            (*head)->cdr = *last;
-            return result;
-        }
-        *head = al_new_cons(root, object, head);
+// ******
+static al_object_t* al_alloc(void *root, int type, size_t size){
+    int kind = al_kind_of(type);
+    if(kind != AL_KIND_MIXED){
+        size = al_kind_size[kind];
+    }else{
+        size = al_round_up(size, sizeof(void*));
+        size += AL_HEADER;
+        size = al_round_up(size, sizeof(void*));
+    }
+    al_charge(size);
+    if(al_profiling){ al_profile_alloc(type, 1, size); }
+    if(kind == AL_KIND_MIXED && al_los_threshold <= size){
+        return al_los_alloc(root, type, size);
+    }
+    if(al_gc_always && !al_gc_running){
+        attolisp_gc(root);
     }
-}
 
-// *****
-static al_object_t* al_intern(void *root, char *name){
-    for(al_object_t *pointer = al_symbols;
-        pointer != al_nil; pointer=pointer->cdr
-    ){
-        if(strcmp(name, pointer->car->name) == 0){
-            return pointer->car;
-        }
+    uint8_t *pointer = al_bump_alloc(kind, size);
+    if(!pointer && !al_gc_always){
+        attolisp_gc(root);
+        pointer = al_bump_alloc(kind, size);
+    }
+    if(!pointer){
+        al_error("Memory exhausted");
     }
 
-    AL_DEFINE1(symbol);
-    *symbol = al_new_symbol(root, name);
-    al_symbols = al_new_cons(root, symbol, &al_symbols);
-    return *symbol;
+    al_object_t *object = al_slot_object(kind, pointer);
+    if(kind == AL_KIND_MIXED){
+        object->type = type;
+        object->size = size;
+    }
+    return object;
 }
 
+// -------------------------------
+// ----- LARGE OBJECT SPACE ------
+// -------------------------------
+// Objects of al_los_threshold bytes or more are never copied. They live in
+// page runs carved out of one reserved address range, so the collector can
+// tell them apart with a range check, and are marked in place. Dead runs are
+// returned to the OS with madvise() and reused for later large objects.
+typedef struct al_los_header_t {
+    struct al_los_header_t *next;
+    uint32_t pages;
+    int marked;
+} al_los_header_t;
+
+static uint8_t *al_los_base;
+static size_t al_los_npages;
+static uint8_t *al_los_map;     // one byte per page, nonzero when in use
+static size_t al_los_hint;
+static al_los_header_t *al_los_objects;
+static size_t al_los_used = 0;
+static size_t al_los_limit;
+// marked large objects whose fields still have to be scanned
+static al_object_t **al_los_gray;
+static size_t al_los_ngray;
+static size_t al_los_gray_capacity;
+
 // *****
-static al_object_t* al_read_quote(void *root){
-    AL_DEFINE2(symbol, tmp);
-    *symbol = al_intern(root, "quote");
-    *tmp = al_read_expr(root);
-    *tmp = al_new_cons(root, tmp, &al_nil);
-    *tmp = al_new_cons(root, symbol, tmp);
-    return *tmp;
+static inline bool al_is_large(al_object_t *object){
+    return (uintptr_t)object + AL_HEADER - (uintptr_t)al_los_base <
+        al_los_npages * AL_PAGE_SIZE;
 }
 
+// *****
+static inline al_los_header_t* al_los_header(al_object_t *object){
+    return (al_los_header_t*)object - 1;
+}
 
 // *****
-static int al_read_number(int value){
-    while(isdigit(al_peek())){
-        value = value * 10 + (getchar() - '0');
+static void al_los_init(void){
+    size_t reserve = ATTOLISP_LOS_RESERVE;
+    void *base = mmap(
+        NULL, reserve, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0
+    );
+    if(base == MAP_FAILED){
+        // Everything is copied as before.
+        al_los_threshold = SIZE_MAX;
+        return;
     }
-    return value;
+    al_los_base = base;
+    al_los_npages = reserve / AL_PAGE_SIZE;
+    al_los_map = calloc(al_los_npages, 1);
+    if(!al_los_map){ al_error("Memory exhausted"); }
+    al_los_limit = al_memsize;
 }
 
-// *****
-static al_object_t* al_read_symbol(void *root, char c){
-    char buffer[ATTOLISP_MAXLEN+1];
-    buffer[0] = c;
-    int len = 1;
-    while(isalnum(al_peek())|| strchr(al_symbol_chars, al_peek())){
-        if(ATTOLISP_MAXLEN <= len){
-            al_error("ERROR: Symbol name too long");
+// Next-fit search for `pages` consecutive free pages.
+static void* al_los_take(size_t pages){
+    for(size_t tries = 0; tries < 2; tries++){
+        size_t run = 0;
+        for(size_t i = al_los_hint; i < al_los_npages; i++){
+            run = al_los_map[i] ? 0 : run + 1;
+            if(run == pages){
+                size_t first = i + 1 - pages;
+                memset(al_los_map + first, 1, pages);
+                al_los_hint = i + 1;
+                return al_los_base + first * AL_PAGE_SIZE;
+            }
         }
-        buffer[len++] = getchar();
+        al_los_hint = 0;
     }
-    buffer[len] = '\0';
-    return al_intern(root, buffer);
+    return NULL;
 }
 
 // *****
-static al_object_t* al_read_expr(void *root){
-    for(;;){
-        int c = getchar();
-        if(c == ' ' || c == '\n' || c == '\r' || c == '\t'){ continue; }
-        if(c == EOF){ return NULL; }
-        if(c == ';'){
-            al_skip_line();
+static al_object_t* al_los_alloc(void *root, int type, size_t size){
+    size_t pages = (size + sizeof(al_los_header_t) + AL_PAGE_SIZE - 1) /
+        AL_PAGE_SIZE;
+    size_t bytes = pages * AL_PAGE_SIZE;
+    if(al_gc_always && !al_gc_running){
+        attolisp_gc(root);
+    }else if(al_los_limit < al_los_used + bytes){
+        attolisp_gc(root);
+    }
+
+    al_los_header_t *header = al_los_take(pages);
+    if(!header){
+        attolisp_gc(root);
+        header = al_los_take(pages);
+    }
+    if(!header){
+        al_error("Memory exhausted");
+    }
+    header->next = al_los_objects;
+    header->pages = (uint32_t)pages;
+    header->marked = 0;
+    al_los_objects = header;
+    al_los_used += bytes;
+
+    al_object_t *object = (al_object_t*)(header + 1);
+    object->type = type;
+    object->size = size;
+    return object;
+}
+
+// Called by the serial collector on a large object it reaches.
+static void al_los_mark(al_object_t *object){
+    al_los_header_t *header = al_los_header(object);
+    if(header->marked){ return; }
+    header->marked = 1;
+    if(al_census){ al_census_add(object, object->type, object->size); }
+    if(al_has_pointers(object->type)){
+        if(al_los_ngray == al_los_gray_capacity){
+            al_los_gray_capacity = al_los_gray_capacity ?
+                al_los_gray_capacity * 2 : 256;
+            al_los_gray = realloc(al_los_gray,
+                al_los_gray_capacity * sizeof(al_object_t*));
+            if(!al_los_gray){ al_error("GC: out of memory for work stack"); }
+        }
+        al_los_gray[al_los_ngray++] = object;
+    }
+}
+
+// Frees every large object the last trace did not reach.
+static void al_los_sweep(void){
+    al_los_header_t **link = &al_los_objects;
+    while(*link){
+        al_los_header_t *header = *link;
+        if(header->marked){
+            header->marked = 0;
+            link = &header->next;
             continue;
         }
-        if(c == '('){ return al_read_list(root); }
-        if(c == ')'){ return al_cparen; }
-        if(c == '.'){ return al_dot; }
-        if(c == '\''){ return al_read_quote(root); }
-        if(isdigit(c)){
-            return al_new_int(root, al_read_number(c-'0'));
+        *link = header->next;
+        size_t bytes = (size_t)header->pages * AL_PAGE_SIZE;
+        size_t first = ((uint8_t*)header - al_los_base) / AL_PAGE_SIZE;
+        madvise(header, bytes, MADV_DONTNEED);
+        memset(al_los_map + first, 0, header->pages);
+        al_los_used -= bytes;
+    }
+    al_los_limit = al_los_used * 2 < al_memsize ? al_memsize : al_los_used * 2;
+}
+
+// -------------------------------
+// ----- TRACER ------------------
+// -------------------------------
+// With ATTOLISP_TRACE=file, calls, primitives and collections are recorded
+// into a fixed ring of events and written out as Chrome trace-event JSON at
+// exit or on (trace-flush). Recording claims a slot with one atomic add and
+// copies the name into it, so it neither locks nor allocates; once the ring
+// wraps the oldest events are overwritten.
+#define ATTOLISP_TRACE_EVENTS   ((size_t)1 << 18)
+#define AL_TRACE_NAME           24
+
+typedef struct al_trace_event_t {
+    uint64_t time;              // ns since the tracer started
+    const char *key;            // name of the argument, or NULL
+    int64_t value;
+    int tid;
+    char phase;                 // 'B'egin or 'E'nd
+    char name[AL_TRACE_NAME];
+} al_trace_event_t;
+
+static bool al_tracing = false;
+static const char *al_trace_path;
+static al_trace_event_t *al_trace_ring;
+static size_t al_trace_mask;
+static uint64_t al_trace_head;
+static uint64_t al_trace_start;
+
+// *****
+static inline uint64_t al_trace_clock(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// *****
+static void al_trace(
+    int tid, char phase, const char *name, const char *key, int64_t value
+){
+    uint64_t slot = __atomic_fetch_add(&al_trace_head, 1, __ATOMIC_RELAXED);
+    al_trace_event_t *event = &al_trace_ring[slot & al_trace_mask];
+    event->time = al_trace_clock() - al_trace_start;
+    event->key = key;
+    event->value = value;
+    event->tid = tid;
+    event->phase = phase;
+    strncpy(event->name, name, AL_TRACE_NAME - 1);
+    event->name[AL_TRACE_NAME - 1] = '\0';
+}
+
+// *****
+static void al_trace_write_name(FILE *out, const char *name){
+    fputc('"', out);
+    for(; *name; name++){
+        unsigned char c = (unsigned char)*name;
+        if(c == '"' || c == '\\'){
+            fprintf(out, "\\%c", c);
+        }else if(c < 0x20){
+            fprintf(out, "\\u%04x", c);
+        }else{
+            fputc(c, out);
         }
-        if(c == '-' && isdigit(al_peek())){
-            return al_new_int(root, -al_read_number(0));
+    }
+    fputc('"', out);
+}
+
+// Rewrites the trace file from what the ring holds now. Only called while
+// no collection runs, so every claimed slot has been filled in.
+static bool al_trace_flush(void){
+    if(!al_tracing){ return false; }
+    FILE *out = fopen(al_trace_path, "w");
+    if(!out){
+        fprintf(stderr, "trace: cannot open %s\n", al_trace_path);
+        return false;
+    }
+    uint64_t head = __atomic_load_n(&al_trace_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head <= al_trace_mask ? 0 : head - al_trace_mask - 1;
+    fprintf(out, "{\"traceEvents\":[");
+    for(uint64_t i = first; i < head; i++){
+        al_trace_event_t *event = &al_trace_ring[i & al_trace_mask];
+        fprintf(out, "%s\n{\"name\":", i == first ? "" : ",");
+        al_trace_write_name(out, event->name);
+        fprintf(out,
+            ",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":1,\"tid\":%d",
+            event->phase, (unsigned long long)(event->time / 1000),
+            (unsigned long long)(event->time % 1000), event->tid);
+        if(event->key){
+            fprintf(out, ",\"args\":{\"%s\":%lld}",
+                event->key, (long long)event->value);
         }
-        if(isalpha(c) || strchr(al_symbol_chars, c)){
-            return al_read_symbol(root, c);
+        fputc('}', out);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(out);
+    return true;
+}
+
+// *****
+static void al_trace_exit(void){
+    al_trace_flush();
+}
+
+// *****
+static void al_trace_init(const char *path, size_t events){
+    size_t capacity = 1;
+    while(capacity < events){ capacity <<= 1; }
+    al_trace_ring = calloc(capacity, sizeof(al_trace_event_t));
+    if(!al_trace_ring){ al_error("Cannot allocate trace buffer"); }
+    al_trace_mask = capacity - 1;
+    al_trace_path = path;
+    al_trace_start = al_trace_clock();
+    al_tracing = true;
+    atexit(al_trace_exit);
+}
+
+// -------------------------------
+// ----- ALLOCATION PROFILER -----
+// -------------------------------
+// With ATTOLISP_ALLOC_PROFILE=file, every allocation is charged to the Lisp
+// function running at the time, by the type of the object, and the totals
+// are written to the file at exit. Functions are told apart by the name they
+// are called through; code outside any call is charged to (toplevel).
+#define AL_SITES        1024
+#define AL_SITE_NAME    32
+
+typedef struct al_site_t {
+    char name[AL_SITE_NAME];
+    uint64_t objects[AL_KINDS];
+    uint64_t bytes[AL_KINDS];
+} al_site_t;
+
+static const char *al_profile_path;
+static al_site_t *al_sites;         // open addressed by name
+static al_site_t al_site_toplevel = { .name = "(toplevel)" };
+static al_site_t al_site_other = { .name = "(other)" };
+// sites of the calls in progress, innermost last
+static al_site_t **al_site_stack;
+static size_t al_site_depth;
+static size_t al_site_capacity;
+
+static const char *al_type_names[AL_KINDS] = {
+    [ATTOLISP_TYPE_INT] = "int",
+    [ATTOLISP_TYPE_CELL] = "cell",
+    [ATTOLISP_TYPE_SYMBOL] = "symbol",
+    [ATTOLISP_TYPE_PRIMITIVE] = "primitive",
+    [ATTOLISP_TYPE_FUNCTION] = "function",
+    [ATTOLISP_TYPE_MACRO] = "macro",
+    [ATTOLISP_TYPE_ENV] = "env",
+    [ATTOLISP_TYPE_BUFFER] = "buffer",
+    [ATTOLISP_TYPE_WEAK] = "weak-ref",
+    [ATTOLISP_TYPE_TABLE] = "weak-table",
+    [ATTOLISP_TYPE_CHANNEL] = "channel",
+};
+
+// Finds or adds the site of `name`; (other) once the table is full.
+static al_site_t* al_site_of(const char *name){
+    uint32_t hash = 2166136261u;
+    for(int i=0; i < AL_SITE_NAME - 1 && name[i]; i++){
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    for(size_t probe=0; probe < AL_SITES; probe++){
+        al_site_t *site = &al_sites[(hash + probe) % AL_SITES];
+        if(!site->name[0]){
+            strncpy(site->name, name, AL_SITE_NAME - 1);
+            return site;
         }
-        al_error("ERROR:: Don't know how to handle %c", c);
+        if(strncmp(site->name, name, AL_SITE_NAME - 1) == 0){ return site; }
     }
+    return &al_site_other;
 }
 
 // *****
-static void al_print(al_object_t *object){
-    // if(object->type == ATTOLISP_TYPE_CELL){
-    //     printf("(");
-    //     for(;;){
-    //         al_print(object->car);
-    //         if(object->cdr == al_nil){ break; }
-    //         if(object->cdr->type != ATTOLISP_TYPE_CELL){
-    //             printf(" . ");
-    //             al_print(object->cdr);
-    //             break;
-    //         }
-    //         printf(" ");
-    //         object = object->cdr;
-    //     }
-    //     printf(")");
-    //     return;
-    // }
-    // else if(object->type == ATTOLISP_TYPE_INT){
-    //     printf("%d", object->value);
-    //     return;
-    // }
-    // else if(object->type == ATTOLISP_TYPE_SYMBOL){
-    //     printf("%s", object->name);
-    //     return;
-    // }
-    // else if(object->type == ATTOLISP_TYPE_PRIMITIVE){
-    //     printf("%s", "<primitive>");
-    // }
-    // else if(object->type == ATTOLISP_TYPE_FUNCTION){
-    //     printf("%s", "<function>");
-    //     return;
-    // }
-    // else if(object->type == ATTOLISP_TYPE_MACRO){
-    //     printf("%s", "<macro>");
-    //     return;
-    // }
-    // else if(object->type == ATTOLISP_TYPE_MOVED){
-    //     printf("%s", "<moved>");
-    //     return;
-    // }
-    // else if(object->type == ATTOLISP_TYPE_TRUE){
-    //     printf("%s", "t");
-    //     return;
-    // }else if(object->type == ATTOLISP_TYPE_NIL){
-    //     printf("%s", "()");
-    //     return;
-    // }else{
-    //     al_error("ERROR:: print: Unknown tag type: %d", object->type);
-    // }
+static void al_profile_enter(const char *name){
+    if(al_site_depth == al_site_capacity){
+        al_site_capacity = al_site_capacity ? al_site_capacity * 2 : 256;
+        al_site_stack = realloc(al_site_stack,
+            al_site_capacity * sizeof(al_site_t*));
+        if(!al_site_stack){ al_error("Cannot grow allocation profile"); }
+    }
+    al_site_stack[al_site_depth++] = al_site_of(name);
+}
+
+// *****
+static void al_profile_leave(void){
+    if(al_site_depth){ al_site_depth--; }
+}
+
+// *****
+static void al_profile_alloc(int type, size_t count, size_t bytes){
+    al_site_t *site = al_site_depth ?
+        al_site_stack[al_site_depth - 1] : &al_site_toplevel;
+    site->objects[type] += count;
+    site->bytes[type] += bytes;
+}
+
+// *****
+static int al_site_compare(const void *a, const void *b){
+    const al_site_t *x = *(al_site_t* const*)a, *y = *(al_site_t* const*)b;
+    uint64_t xbytes = 0, ybytes = 0;
+    for(int type=0; type < AL_KINDS; type++){
+        xbytes += x->bytes[type];
+        ybytes += y->bytes[type];
+    }
+    return xbytes < ybytes ? 1 : xbytes > ybytes ? -1 : 0;
+}
+
+// Writes the sites that allocated anything, the largest first.
+static void al_profile_exit(void){
+    FILE *out = fopen(al_profile_path, "w");
+    if(!out){
+        fprintf(stderr, "alloc profile: cannot open %s\n", al_profile_path);
+        return;
+    }
+    al_site_t *sites[AL_SITES + 2];
+    size_t count = 0;
+    sites[count++] = &al_site_toplevel;
+    sites[count++] = &al_site_other;
+    for(size_t i=0; i < AL_SITES; i++){
+        if(al_sites[i].name[0]){ sites[count++] = &al_sites[i]; }
+    }
+    qsort(sites, count, sizeof(al_site_t*), al_site_compare);
+    fprintf(out, "%-31s %-10s %12s %14s\n",
+        "function", "type", "objects", "bytes");
+    for(size_t i=0; i < count; i++){
+        for(int type=0; type < AL_KINDS; type++){
+            if(!sites[i]->objects[type]){ continue; }
+            fprintf(out, "%-31s %-10s %12llu %14llu\n",
+                sites[i]->name, al_type_names[type],
+                (unsigned long long)sites[i]->objects[type],
+                (unsigned long long)sites[i]->bytes[type]);
+        }
+    }
+    fclose(out);
+}
+
+// *****
+static void al_profile_init(const char *path){
+    al_sites = calloc(AL_SITES, sizeof(al_site_t));
+    if(!al_sites){ al_error("Cannot allocate allocation profile"); }
+    al_profile_path = path;
+    al_profiling = true;
+    atexit(al_profile_exit);
+}
+
+// (heap-dump "file") runs a serial collection that records every object it
+// copies or marks along with the object being scanned when it was reached.
+// That makes a spanning tree of the live heap: an object retains what was
+// first reached through it, so the retained bytes of a subtree point at
+// what keeps memory alive.
+#define AL_DUMP_RETAINERS   20
+
+typedef struct al_census_t {
+    al_object_t *object;        // new address
+    al_object_t *parent;        // object being scanned, NULL for roots
+    size_t size;
+    int type;
+    long long up;               // index of the parent entry, or -1
+    uint64_t retained;
+    uint64_t objects;
+} al_census_t;
+
+static al_census_t *al_census_entries;
+static size_t al_census_count;
+static size_t al_census_capacity;
+static al_object_t *al_census_parent;
+
+// *****
+static void al_census_add(al_object_t *object, int type, size_t size){
+    if(al_census_count == al_census_capacity){
+        al_census_capacity = al_census_capacity ?
+            al_census_capacity * 2 : 4096;
+        al_census_entries = realloc(al_census_entries,
+            al_census_capacity * sizeof(al_census_t));
+        if(!al_census_entries){ al_error("GC: out of memory for heap dump"); }
+    }
+    al_census_entries[al_census_count++] = (al_census_t){
+        object, al_census_parent, size, type, -1, size, 1 };
+}
 
-    switch(object->type){
+// *****
+static int al_census_by_address(const void *a, const void *b){
+    const al_census_t *x = *(al_census_t* const*)a;
+    const al_census_t *y = *(al_census_t* const*)b;
+    return x->object < y->object ? -1 : x->object > y->object;
+}
+
+// *****
+static int al_census_by_retained(const void *a, const void *b){
+    const al_census_t *x = *(al_census_t* const*)a;
+    const al_census_t *y = *(al_census_t* const*)b;
+    return x->retained < y->retained ? 1 : x->retained > y->retained ? -1 : 0;
+}
+
+// Prints a short form of `object`: lists are cut after a few elements and
+// nesting after a few levels.
+static void al_describe(FILE *out, al_object_t *object, int depth){
+    switch(al_type(object)){
+    case ATTOLISP_TYPE_INT:
+        fprintf(out, "%d", object->value);
+        return;
+    case ATTOLISP_TYPE_SYMBOL:
+        fprintf(out, "%s", object->name);
+        return;
     case ATTOLISP_TYPE_CELL:
-        printf("(");
-        for(;;){
-            al_print(object->car);
-            if(object->cdr == al_nil){ break; }
-            if(object->cdr->type != ATTOLISP_TYPE_CELL){
-                printf(" . ");
-                al_print(object->cdr);
+        if(!depth){
+            fprintf(out, "(...)");
+            return;
+        }
+        fputc('(', out);
+        for(int i=0; ; i++){
+            if(i == 6){
+                fprintf(out, " ...");
                 break;
             }
-            printf(" ");
+            if(i){ fputc(' ', out); }
+            al_describe(out, object->car, depth - 1);
             object = object->cdr;
+            if(object == al_nil){ break; }
+            if(al_type(object) != ATTOLISP_TYPE_CELL){
+                fprintf(out, " . ");
+                al_describe(out, object, depth - 1);
+                break;
+            }
         }
-        printf(")");
+        fputc(')', out);
         return;
-#define AL_CASE(type, ...)      \
-    case type:                  \
-        printf(__VA_ARGS__);    \
-        return
-
-    AL_CASE(ATTOLISP_TYPE_INT, "%d", object->value);
-    AL_CASE(ATTOLISP_TYPE_SYMBOL, "%s", object->name);
-    AL_CASE(ATTOLISP_TYPE_PRIMITIVE, "<primitive>");
-    AL_CASE(ATTOLISP_TYPE_FUNCTION, "<function>");
-    AL_CASE(ATTOLISP_TYPE_MACRO, "<macro>");
-    AL_CASE(ATTOLISP_TYPE_MOVED, "<moved>");
-    AL_CASE(ATTOLISP_TYPE_TRUE, "t");
-    AL_CASE(ATTOLISP_TYPE_NIL, "()");
-#undef AL_CASE
-        default:
-            //al_error("ERROR:: print: Unknown tag type: %d", object->type);
-            break;
-    } // end switch
+    case ATTOLISP_TYPE_FUNCTION:
+    case ATTOLISP_TYPE_MACRO:
+        fprintf(out, "<%s ", al_type(object) == ATTOLISP_TYPE_FUNCTION ?
+            "function" : "macro");
+        al_describe(out, object->params, depth);
+        fputc('>', out);
+        return;
+    case ATTOLISP_TYPE_ENV:
+        fprintf(out, "<env>");
+        return;
+    case ATTOLISP_TYPE_PRIMITIVE:
+        fprintf(out, "<primitive>");
+        return;
+    case ATTOLISP_TYPE_BUFFER:
+        fprintf(out, "<buffer %zu>", object->length);
+        return;
+    case ATTOLISP_TYPE_WEAK:
+        fprintf(out, "<weak-ref>");
+        return;
+    case ATTOLISP_TYPE_TABLE:
+        fprintf(out, "<weak-table %zu>", object->table->count);
+        return;
+    case ATTOLISP_TYPE_CHANNEL:
+        fprintf(out, "<channel>");
+        return;
+    case ATTOLISP_TYPE_TRUE:
+        fprintf(out, "t");
+        return;
+    case ATTOLISP_TYPE_NIL:
+        fprintf(out, "()");
+        return;
+    default:
+        fprintf(out, "?");
+    }
 }
 
-// *****
-static int al_length(al_object_t *list){
-    int len = 0;
-    for(; list->type == ATTOLISP_TYPE_CELL; list = list->cdr){ len++; }
-    return list == al_nil ? len : -1;
+// Links every entry to its parent's and sums up the subtrees. Parents are
+// reached before their children, so one pass from the back does it.
+static void al_census_link(void){
+    al_census_t **sorted = malloc(
+        (al_census_count + 1) * sizeof(al_census_t*));
+    if(!sorted){ al_error("Cannot allocate heap dump"); }
+    for(size_t i=0; i < al_census_count; i++){
+        sorted[i] = &al_census_entries[i];
+    }
+    qsort(sorted, al_census_count, sizeof(al_census_t*),
+        al_census_by_address);
+    for(size_t i=0; i < al_census_count; i++){
+        al_census_t *entry = &al_census_entries[i];
+        if(!entry->parent){ continue; }
+        al_census_t key = { .object = entry->parent }, *pointer = &key;
+        al_census_t **found = bsearch(&pointer, sorted, al_census_count,
+            sizeof(al_census_t*), al_census_by_address);
+        if(found){ entry->up = *found - al_census_entries; }
+    }
+    free(sorted);
+    for(size_t i=al_census_count; 0 < i--; ){
+        al_census_t *entry = &al_census_entries[i];
+        if(entry->up < 0){ continue; }
+        al_census_entries[entry->up].retained += entry->retained;
+        al_census_entries[entry->up].objects += entry->objects;
+    }
 }
 
-// -------------
-//  Evaluator
-// -------------
-static al_object_t* al_eval(
-    void *root, al_object_t **env, al_object_t **object
-);
+// A cell reached through the cdr of another is the rest of its list, which
+// is already accounted to the head.
+static bool al_census_is_tail(al_census_t *entry){
+    if(entry->up < 0){ return false; }
+    al_object_t *parent = al_census_entries[entry->up].object;
+    return al_type(parent) == ATTOLISP_TYPE_CELL &&
+        parent->cdr == entry->object;
+}
 
 // *****
-static void al_add_variable(
-    void *root,
-    al_object_t **env,
-    al_object_t **sym,
-    al_object_t **values
-){
-    AL_DEFINE2(vars, tmp);
-    *vars = (*env)->vars;
-    *tmp = al_acons(root, sym, values, vars);
-    (*env)->vars = *tmp;
+static void al_census_write(FILE *out){
+    uint64_t objects[AL_KINDS] = { 0 }, bytes[AL_KINDS] = { 0 };
+    uint64_t total = 0;
+    for(size_t i=0; i < al_census_count; i++){
+        al_census_t *entry = &al_census_entries[i];
+        objects[entry->type]++;
+        bytes[entry->type] += entry->size;
+        total += entry->size;
+    }
+    fprintf(out, "live objects after collection %u: %zu, %llu bytes\n\n",
+        al_gc_count, al_census_count, (unsigned long long)total);
+    fprintf(out, "%-10s %12s %14s\n", "type", "objects", "bytes");
+    for(int type=0; type < AL_KINDS; type++){
+        if(!objects[type]){ continue; }
+        fprintf(out, "%-10s %12llu %14llu\n", al_type_names[type],
+            (unsigned long long)objects[type],
+            (unsigned long long)bytes[type]);
+    }
+
+    al_census_link();
+    al_census_t **top = malloc(
+        (al_census_count + 1) * sizeof(al_census_t*));
+    if(!top){ al_error("Cannot allocate heap dump"); }
+    size_t count = 0;
+    for(size_t i=0; i < al_census_count; i++){
+        al_census_t *entry = &al_census_entries[i];
+        if(entry->objects > 1 && !al_census_is_tail(entry)){
+            top[count++] = entry;
+        }
+    }
+    qsort(top, count, sizeof(al_census_t*), al_census_by_retained);
+    fprintf(out, "\ntop retainers\n%14s %12s %-10s %s\n",
+        "bytes", "objects", "type", "object");
+    for(size_t i=0; i < count && i < AL_DUMP_RETAINERS; i++){
+        fprintf(out, "%14llu %12llu %-10s ",
+            (unsigned long long)top[i]->retained,
+            (unsigned long long)top[i]->objects, al_type_names[top[i]->type]);
+        al_describe(out, top[i]->object, 3);
+        fputc('\n', out);
+    }
+    free(top);
 }
 
-// *****
-static al_object_t* al_push_env(
-    void *root,
-    al_object_t **env,
-    al_object_t **vars,
-    al_object_t **values
-){
-    AL_DEFINE3(map, symbol, value);
-    *map = al_nil;
-    for(; (*vars)->type == ATTOLISP_TYPE_CELL;
-        *vars = (*vars)->cdr, *values = (*values)->cdr
+// Collects with the census on and writes it to `path`.
+static void al_heap_dump(void *root, const char *path){
+    FILE *out = fopen(path, "w");
+    if(!out){ al_error("ERROR: cannot open %s", path); }
+    al_census = true;
+    al_census_count = 0;
+    al_census_parent = NULL;
+    attolisp_gc(root);
+    al_census = false;
+    al_census_write(out);
+    fclose(out);
+    free(al_census_entries);
+    al_census_entries = NULL;
+    al_census_capacity = 0;
+}
+
+// Runs around calls while tracing or profiling. `form` is the call, named
+// after its head when that is a symbol; only calls of Lisp functions, not
+// primitives, become allocation sites.
+static bool al_hooks = false;
+
+static void al_hook_call(char phase, const al_object_t *form, bool function){
+    const char *name = form == al_nil ? "builtin" : "lambda";
+    if(al_type(form) == ATTOLISP_TYPE_CELL &&
+        al_type(form->car) == ATTOLISP_TYPE_SYMBOL
     ){
-        if((*values)->type != ATTOLISP_TYPE_CELL){
-            al_error(
-                "ERROR: Cannot apply function: number of argument does "
-                "match"
-            );
-        }
-        *symbol = (*vars)->car;
-        *value = (*values)->car;
-        *map = al_acons(root, symbol, value, map);
+        name = form->car->name;
     }
-    if(*vars != al_nil){
-        *map = al_acons(root, vars, values, map);
+    if(al_tracing){ al_trace(1, phase, name, NULL, 0); }
+    if(al_profiling && function){
+        if(phase == 'B'){
+            al_profile_enter(name);
+        }else{
+            al_profile_leave();
+        }
     }
+}
+
+// -------------------------------
+// ----- WEAK TABLES -------------
+// -------------------------------
+// A weak table maps keys to values without keeping its keys alive: an entry
+// lasts while its key is reachable from elsewhere, and only then is its value
+// traced. Keys compare with eq, except integers, which compare by value and
+// never die. Slots are open addressed by key address, so the collector
+// rehashes every table it has moved keys of.
+#define AL_TABLE_MIN    8
+
+static al_table_t *al_tables;
+
+// *****
+static inline size_t al_table_hash(al_object_t *key){
+    uint64_t bits = al_type(key) == ATTOLISP_TYPE_INT ?
+        (uint32_t)key->value : (uintptr_t)key >> 3;
+    return (size_t)((bits * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// *****
+static inline bool al_table_same(al_object_t *key, al_object_t *other){
+    return key == other || (al_type(key) == ATTOLISP_TYPE_INT &&
+        al_type(other) == ATTOLISP_TYPE_INT && key->value == other->value);
+}
+
+// Slot holding `key`, or the free slot it would go to.
+static al_table_entry_t* al_table_slot(al_table_t *table, al_object_t *key){
+    size_t mask = table->capacity - 1;
+    for(size_t i = al_table_hash(key) & mask;; i = (i + 1) & mask){
+        al_table_entry_t *entry = &table->entries[i];
+        if(!entry->key || al_table_same(entry->key, key)){ return entry; }
+    }
+}
+
+// Smallest capacity that keeps `count` entries at most half full.
+static size_t al_table_capacity(size_t count){
+    size_t capacity = AL_TABLE_MIN;
+    while(capacity < 2 * count){ capacity *= 2; }
+    return capacity;
+}
+
+// *****
+static void al_table_rehash(al_table_t *table, size_t capacity){
+    al_table_entry_t *entries = table->entries;
+    size_t old_capacity = table->capacity;
+    table->entries = calloc(capacity, sizeof(al_table_entry_t));
+    if(!table->entries){ al_error("Memory exhausted"); }
+    table->capacity = capacity;
+    for(size_t i=0; i < old_capacity; i++){
+        if(entries[i].key){
+            *al_table_slot(table, entries[i].key) = entries[i];
+        }
+    }
+    free(entries);
+}
+
+// *****
+static void al_table_put(
+    al_table_t *table, al_object_t *key, al_object_t *value
+){
+    al_table_entry_t *entry = al_table_slot(table, key);
+    if(!entry->key){
+        if(table->capacity < 2 * (table->count + 1)){
+            al_table_rehash(table, table->capacity * 2);
+            entry = al_table_slot(table, key);
+        }
+        table->count++;
+    }
+    entry->key = key;
+    entry->value = value;
+}
+
+// Removes `key`, moving back the entries after it that probed past its slot.
+static void al_table_remove(al_table_t *table, al_object_t *key){
+    al_table_entry_t *entry = al_table_slot(table, key);
+    if(!entry->key){ return; }
+    entry->key = NULL;
+    table->count--;
+    size_t mask = table->capacity - 1;
+    size_t hole = (size_t)(entry - table->entries);
+    for(size_t i = (hole + 1) & mask; table->entries[i].key;
+        i = (i + 1) & mask
+    ){
+        size_t home = al_table_hash(table->entries[i].key) & mask;
+        if(((i - hole) & mask) <= ((i - home) & mask)){
+            table->entries[hole] = table->entries[i];
+            table->entries[i].key = NULL;
+            hole = i;
+        }
+    }
+}
+
+// Frees the tables the last collection did not find.
+static void al_table_sweep(void){
+    al_table_t **link = &al_tables;
+    while(*link){
+        al_table_t *table = *link;
+        if(table->mark != al_gc_count){
+            *link = table->next;
+            free(table->entries);
+            free(table);
+            continue;
+        }
+        link = &table->next;
+    }
+}
+
+// -------------------------------
+// ----- GARBAGE COLLECTOR -------
+// -------------------------------
+// forwarding state of the headerless objects of from-space, one bit per
+// word: set in `al_gc_done` once the first word holds the new address,
+// set in `al_gc_claimed` by the parallel worker that copies the object
+static uint64_t *al_gc_done;
+static uint64_t *al_gc_claimed;
+
+// Copied objects still to be scanned by the serial collector: each kind has
+// a cursor into the page it copies into, and pages filled before the
+// cursor got to their end are queued as spans.
+typedef struct al_span_t {
+    int kind;
+    uint8_t *start;
+    uint8_t *end;
+} al_span_t;
+
+static uint8_t *al_scan_at[AL_KINDS];
+static al_span_t *al_gc_spans;
+static size_t al_gc_nspans;
+static size_t al_gc_spans_capacity;
+
+// *****
+static void al_gc_retire(int kind, uint8_t *top, uint8_t *page){
+    if(kind != AL_KIND_MIXED && !al_has_pointers(kind)){ return; }
+    if(al_scan_at[kind] < top){
+        if(al_gc_nspans == al_gc_spans_capacity){
+            al_gc_spans_capacity = al_gc_spans_capacity ?
+                al_gc_spans_capacity * 2 : 64;
+            al_gc_spans = realloc(al_gc_spans,
+                al_gc_spans_capacity * sizeof(al_span_t));
+            if(!al_gc_spans){ al_error("GC: out of memory for work stack"); }
+        }
+        al_gc_spans[al_gc_nspans++] = (al_span_t){
+            kind, al_scan_at[kind], top };
+    }
+    al_scan_at[kind] = page;
+}
+
+// *****
+static inline al_object_t* al_forward(al_object_t *object){
+    size_t offset = (uintptr_t)object + AL_HEADER - (uintptr_t)al_from;
+    if(al_memsize <= offset){
+        if(al_is_large(object)){ al_los_mark(object); }
+        return object;
+    }
+
+    int kind = al_from_kinds[offset / AL_PAGE_SIZE];
+    if(kind == AL_KIND_MIXED){
+        if(object->type == ATTOLISP_TYPE_MOVED){
+            return object->moved;
+        }
+        uint8_t *pointer = al_bump_alloc(kind, object->size);
+        if(!pointer){ al_error("GC: to-space exhausted"); }
+        memcpy(pointer, object, object->size);
+        if(al_census){
+            al_census_add((al_object_t*)pointer, object->type, object->size);
+        }
+
+        object->type = ATTOLISP_TYPE_MOVED;
+        object->moved = pointer;
+        return (al_object_t*)pointer;
+    }
+
+    void **fields = (void**)((uint8_t*)object + AL_HEADER);
+    size_t word = offset / sizeof(void*);
+    uint64_t bit = (uint64_t)1 << (word % 64);
+    if(al_gc_done[word / 64] & bit){
+        return *fields;
+    }
+    uint8_t *pointer = al_bump_alloc(kind, al_kind_size[kind]);
+    if(!pointer){ al_error("GC: to-space exhausted"); }
+    memcpy(pointer, fields, al_kind_size[kind]);
+    if(al_census){
+        al_census_add((al_object_t*)(pointer - AL_HEADER), kind,
+            al_kind_size[kind]);
+    }
+
+    *fields = pointer - AL_HEADER;
+    al_gc_done[word / 64] |= bit;
+    return *fields;
+}
+
+// -------------------------------
+// ----- SEMISPACES --------------
+// -------------------------------
+// Both semispaces are mapped once and flipped by every collection. With
+// ATTOLISP_HUGE_PAGES set they are aligned to huge pages and advised to use
+// transparent ones; "explicit" first asks for pages from the hugetlbfs pool.
+// ATTOLISP_PREFAULT touches every page up front. Otherwise the idle half is
+// handed back to the OS after a collection that leaves it mostly unused.
+// The heap size is rounded up to whole huge pages when they are asked for.
+#define AL_HUGE_PAGE_SIZE   ((size_t)2 << 20)
+
+enum{ AL_HUGE_NONE, AL_HUGE_TRANSPARENT, AL_HUGE_EXPLICIT };
+static int al_huge_pages = AL_HUGE_NONE;
+static bool al_prefault = false;
+
+// *****
+static void* al_alloc_semispace(void){
+    if(al_huge_pages == AL_HUGE_EXPLICIT){
+        void *memory = mmap(
+            NULL, al_memsize,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON | MAP_HUGETLB,
+            -1, 0
+        );
+        if(memory != MAP_FAILED){ return memory; }
+    }
+    size_t align = al_huge_pages == AL_HUGE_NONE ? 0 : AL_HUGE_PAGE_SIZE;
+    uint8_t *base = mmap(
+        NULL, al_memsize + align,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANON,
+        -1, 0
+    );
+    if(base == MAP_FAILED || !align){ return base; }
+    // Trims the mapping to a huge page boundary on both sides.
+    uint8_t *memory = (uint8_t*)al_round_up((uintptr_t)base, align);
+    if(base < memory){ munmap(base, memory - base); }
+    munmap(memory + al_memsize, base + align - memory);
+    madvise(memory, al_memsize, MADV_HUGEPAGE);
+    return memory;
+}
+
+// *****
+static void al_semispace_prefault(uint8_t *memory){
+    for(size_t offset = 0; offset < al_memsize; offset += AL_PAGE_SIZE){
+        memory[offset] = 0;
+    }
+}
+
+// Drops the pages of the idle semispace past the live data, which the next
+// collection copies into pages that are still mapped. Returns the number of
+// bytes released.
+static size_t al_semispace_trim(void){
+    if(al_prefault){ return 0; }
+    size_t grain = al_huge_pages == AL_HUGE_NONE ?
+        AL_PAGE_SIZE : AL_HUGE_PAGE_SIZE;
+    size_t keep = al_round_up(al_mem_used, grain);
+    if(al_from_touched <= keep){ return 0; }
+    size_t bytes = al_from_touched - keep;
+    if(madvise((uint8_t*)al_from + keep, bytes, MADV_DONTNEED) != 0){
+        return 0;
+    }
+    al_from_touched = keep;
+    return bytes;
+}
+
+// *****
+static void al_heap_init(void){
+    size_t pages = al_memsize / AL_PAGE_SIZE;
+    size_t words = al_memsize / sizeof(void*) / 64 + 1;
+    al_memory = al_alloc_semispace();
+    al_from = al_alloc_semispace();
+    al_kinds = calloc(pages, 1);
+    al_from_kinds = calloc(pages, 1);
+    al_gc_done = calloc(words, sizeof(uint64_t));
+    al_gc_claimed = calloc(words, sizeof(uint64_t));
+    if(al_memory == MAP_FAILED || al_from == MAP_FAILED || !al_kinds ||
+        !al_from_kinds || !al_gc_done || !al_gc_claimed
+    ){
+        al_error("Cannot allocate heap");
+    }
+    if(al_prefault){
+        al_semispace_prefault(al_memory);
+        al_semispace_prefault(al_from);
+        al_memory_touched = al_from_touched = al_memsize;
+    }
+    // Stale pointers into the idle half fault instead of reading old copies.
+    if(al_gc_always){ mprotect(al_from, al_memsize, PROT_NONE); }
+}
+
+// Memoized arguments and results are roots as long as their entry lasts.
+#define AL_SCAN_MEMO(memo, FORWARD)                                 \
+    for(size_t _i=0; _i < (memo)->nsets * AL_MEMO_WAYS; _i++){      \
+        al_memo_entry_t *_entry = &(memo)->entries[_i];             \
+        if(!_entry->stamp){ continue; }                             \
+        for(int _j=0; _j < _entry->argc; _j++){                     \
+            _entry->args[_j] = FORWARD(_entry->args[_j]);           \
+        }                                                           \
+        _entry->result = FORWARD(_entry->result);                   \
+    }
+
+// *****
+static void al_forward_root_objects(void *root){
+    if(!al_weak_symbols){ al_symbols = al_forward(al_symbols); }
+    for(int i=0; i < al_nstatic_roots; i++){
+        for(size_t j=0; j < al_static_roots[i].count; j++){
+            al_object_t **slot = &al_static_roots[i].slots[j];
+            if(*slot){ *slot = al_forward(*slot); }
+        }
+    }
+    for(al_code_t *code = al_codes; code; code = code->next){
+        for(int i=0; i < code->nconstants; i++){
+            code->constants[i] = al_forward(code->constants[i]);
+        }
+        if(code->memo){ AL_SCAN_MEMO(code->memo, al_forward); }
+    }
+    for(al_object_t **slot = al_root_stack; slot < (al_object_t**)root;
+        slot++
+    ){
+        if(*slot){ *slot = al_forward(*slot); }
+    }
+}
+
+// Weak objects reached by the trace, chained through `weak_next`. Their
+// contents are only dealt with once the strong graph has been copied.
+static al_object_t *al_gc_weaks;
+
+// May run on several GC threads at once.
+static void al_gc_weak_push(al_object_t *object){
+    al_object_t *head = __atomic_load_n(&al_gc_weaks, __ATOMIC_RELAXED);
+    do{
+        object->weak_next = head;
+    }while(!__atomic_compare_exchange_n(&al_gc_weaks, &head, object, true,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Visit every pointer field of a copied object. Shared by the serial Cheney
+// loop and the parallel workers so both agree on the object layout.
+#define AL_SCAN_OBJECT(object, FORWARD)                             \
+    switch(al_type(object)){                                        \
+    case ATTOLISP_TYPE_INT:                                         \
+    case ATTOLISP_TYPE_SYMBOL:                                      \
+    case ATTOLISP_TYPE_PRIMITIVE:                                   \
+    case ATTOLISP_TYPE_BUFFER:                                      \
+        break;                                                      \
+    case ATTOLISP_TYPE_CELL:                                        \
+    case ATTOLISP_TYPE_CHANNEL:                                     \
+        (object)->car = FORWARD((object)->car);                     \
+        (object)->cdr = FORWARD((object)->cdr);                     \
+        break;                                                      \
+    case ATTOLISP_TYPE_FUNCTION:                                    \
+    case ATTOLISP_TYPE_MACRO:                                       \
+        (object)->params = FORWARD((object)->params);               \
+        (object)->body = FORWARD((object)->body);                   \
+        (object)->env = FORWARD((object)->env);                     \
+        if((object)->code){ al_code_mark((object)->code); }         \
+        break;                                                      \
+    case ATTOLISP_TYPE_ENV:                                         \
+        (object)->vars = FORWARD((object)->vars);                   \
+        (object)->up = FORWARD((object)->up);                       \
+        break;                                                      \
+    case ATTOLISP_TYPE_WEAK:                                        \
+    case ATTOLISP_TYPE_TABLE:                                       \
+        al_gc_weak_push(object);                                    \
+        break;                                                      \
+    default:                                                        \
+        al_error("ERROR:: copy: unknown type %d", al_type(object)); \
+    }
+
+// Stack frames are never moved but point into the heap like any root.
+#define AL_SCAN_FRAMES(base, top, FORWARD)                          \
+    for(uint8_t *_record = (base); _record < (top);                 \
+        _record += ((al_frame_record_t*)_record)->size              \
+    ){                                                              \
+        uint8_t *_end = _record + ((al_frame_record_t*)_record)->size; \
+        for(uint8_t *_object = _record + sizeof(al_frame_record_t); \
+            _object < _end; _object += AL_FRAME_OBJECT              \
+        ){                                                          \
+            al_object_t *_frame_object = (al_object_t*)_object;     \
+            AL_SCAN_OBJECT(_frame_object, FORWARD);                 \
+        }                                                           \
+    }
+
+// The roots and frames of the running task are the globals; those of the
+// suspended ones were saved when they switched out.
+#define AL_SCAN_TASKS(FORWARD)                                      \
+    AL_SCAN_FRAMES(al_frame_base, al_frame_top, FORWARD);           \
+    for(al_task_t *_task = al_task_main.after; ;                    \
+        _task = _task->after                                        \
+    ){                                                              \
+        if(_task != al_task_current){                               \
+            for(al_object_t **_slot = _task->roots;                 \
+                _slot < _task->root_top; _slot++                    \
+            ){                                                      \
+                if(*_slot){ *_slot = FORWARD(*_slot); }             \
+            }                                                       \
+            AL_SCAN_FRAMES(_task->frame_base, _task->frame_top, FORWARD); \
+        }                                                           \
+        if(_task == &al_task_main){ break; }                        \
+    }
+
+// -------------------------------
+// ---- PARALLEL COLLECTOR -------
+// -------------------------------
+// Each worker copies into its own pages of to-space and keeps the copied
+// objects it still has to scan on a private stack. Surplus work is published
+// on a small locked queue that idle workers steal from. A headered object is
+// claimed by CAS-ing its type to ATTOLISP_TYPE_COPYING; the winner copies it
+// and then publishes the forwarding pointer by storing ATTOLISP_TYPE_MOVED.
+// Headerless objects are claimed and published the same way through their
+// bits in al_gc_claimed and al_gc_done.
+#define AL_GC_MAX_THREADS   64
+#define AL_GC_BATCH         64
+// below this much live data the serial loop is faster than waking threads
+#define AL_GC_PARALLEL_MIN  (1024*1024)
+
+typedef struct al_gc_worker_t {
+    pthread_t thread;
+    // page each kind is copied into
+    al_bump_t bump[AL_KINDS];
+    // private gray stack
+    al_object_t **stack;
+    size_t count;
+    size_t capacity;
+    // stealable gray objects
+    pthread_mutex_t lock;
+    al_object_t **shared;
+    size_t nshared;
+    size_t shared_capacity;
+} al_gc_worker_t;
+
+static al_gc_worker_t al_gc_workers[AL_GC_MAX_THREADS];
+static int al_gc_nworkers;
+static al_object_t **al_gc_root_top;
+static int al_gc_idle;
+static size_t al_gc_top;
+
+// *****
+static void al_gc_grow(al_object_t ***stack, size_t *capacity, size_t need){
+    if(need <= *capacity){ return; }
+    size_t capacity2 = *capacity ? *capacity : 1024;
+    while(capacity2 < need){ capacity2 *= 2; }
+    *stack = realloc(*stack, capacity2 * sizeof(al_object_t*));
+    if(!*stack){ al_error("GC: out of memory for work stack"); }
+    *capacity = capacity2;
+}
+
+// *****
+static uint8_t* al_gc_worker_alloc(
+    al_gc_worker_t *worker, int kind, size_t size
+){
+    al_bump_t *bump = &worker->bump[kind];
+    if((size_t)(bump->limit - bump->top) < size){
+        size_t pages = (size + AL_PAGE_SIZE - 1) / AL_PAGE_SIZE;
+        size_t bytes = pages * AL_PAGE_SIZE;
+        size_t offset = __atomic_fetch_add(&al_gc_top, bytes, __ATOMIC_RELAXED);
+        if(al_memsize < offset + bytes){
+            al_error("GC: to-space exhausted");
+        }
+        memset(al_kinds + offset / AL_PAGE_SIZE, kind, pages);
+        bump->top = (uint8_t*)al_memory + offset;
+        bump->limit = bump->top + bytes;
+    }
+    uint8_t *pointer = bump->top;
+    bump->top += size;
+    return pointer;
+}
+
+// *****
+static void al_gc_push(al_gc_worker_t *worker, al_object_t *object){
+    al_gc_grow(&worker->stack, &worker->capacity, worker->count + 1);
+    worker->stack[worker->count++] = object;
+    // Hand half of a deep stack to the thieves when they have nothing.
+    if(worker->count >= 2 * AL_GC_BATCH &&
+        __atomic_load_n(&worker->nshared, __ATOMIC_RELAXED) == 0
+    ){
+        pthread_mutex_lock(&worker->lock);
+        size_t half = worker->count / 2;
+        al_gc_grow(&worker->shared, &worker->shared_capacity,
+            worker->nshared + half);
+        memcpy(worker->shared + worker->nshared, worker->stack,
+            half * sizeof(al_object_t*));
+        memmove(worker->stack, worker->stack + half,
+            (worker->count - half) * sizeof(al_object_t*));
+        worker->count -= half;
+        __atomic_store_n(&worker->nshared, worker->nshared + half,
+            __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+// *****
+static bool al_gc_steal(al_gc_worker_t *worker){
+    int self = (int)(worker - al_gc_workers);
+    for(int i=0; i < al_gc_nworkers; i++){
+        al_gc_worker_t *victim = &al_gc_workers[(self + i) % al_gc_nworkers];
+        if(__atomic_load_n(&victim->nshared, __ATOMIC_ACQUIRE) == 0){
+            continue;
+        }
+        pthread_mutex_lock(&victim->lock);
+        size_t take = (victim->nshared + 1) / 2;
+        if(take){
+            al_gc_grow(&worker->stack, &worker->capacity, worker->count + take);
+            size_t from = victim->nshared - take;
+            memcpy(worker->stack + worker->count, victim->shared + from,
+                take * sizeof(al_object_t*));
+            worker->count += take;
+            __atomic_store_n(&victim->nshared, from, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if(take){ return true; }
+    }
+    return false;
+}
+
+// *****
+static bool al_gc_work_available(void){
+    for(int i=0; i < al_gc_nworkers; i++){
+        if(__atomic_load_n(&al_gc_workers[i].nshared, __ATOMIC_ACQUIRE)){
+            return true;
+        }
+    }
+    return false;
+}
+
+// *****
+static al_object_t* al_gc_par_forward_fields(
+    al_gc_worker_t *worker, al_object_t *object, int kind, size_t offset
+){
+    void **fields = (void**)((uint8_t*)object + AL_HEADER);
+    size_t word = offset / sizeof(void*);
+    uint64_t bit = (uint64_t)1 << (word % 64);
+    uint64_t *done = &al_gc_done[word / 64];
+    if(__atomic_load_n(done, __ATOMIC_ACQUIRE) & bit){ return *fields; }
+    if(__atomic_fetch_or(&al_gc_claimed[word / 64], bit, __ATOMIC_ACQ_REL) &
+        bit
+    ){
+        // another worker is copying it right now
+        for(int spins = 0; !(__atomic_load_n(done, __ATOMIC_ACQUIRE) & bit); ){
+            if(++spins % 128 == 0){ sched_yield(); }
+        }
+        return *fields;
+    }
+
+    uint8_t *copy = al_gc_worker_alloc(worker, kind, al_kind_size[kind]);
+    memcpy(copy, fields, al_kind_size[kind]);
+    al_object_t *pointer = (al_object_t*)(copy - AL_HEADER);
+
+    *fields = pointer;
+    __atomic_fetch_or(done, bit, __ATOMIC_RELEASE);
+    if(al_has_pointers(kind)){ al_gc_push(worker, pointer); }
+    return pointer;
+}
+
+// *****
+static al_object_t* al_gc_par_forward(
+    al_gc_worker_t *worker, al_object_t *object
+){
+    size_t offset = (uintptr_t)object + AL_HEADER - (uintptr_t)al_from;
+    if(al_memsize <= offset){
+        if(al_is_large(object) &&
+            !__atomic_exchange_n(&al_los_header(object)->marked, 1,
+                __ATOMIC_ACQ_REL) &&
+            al_has_pointers(object->type)
+        ){
+            al_gc_push(worker, object);
+        }
+        return object;
+    }
+    int kind = al_from_kinds[offset / AL_PAGE_SIZE];
+    if(kind != AL_KIND_MIXED){
+        return al_gc_par_forward_fields(worker, object, kind, offset);
+    }
+
+    int type = __atomic_load_n(&object->type, __ATOMIC_ACQUIRE);
+    for(int spins = 0;; ){
+        if(type == ATTOLISP_TYPE_MOVED){ return object->moved; }
+        if(type == ATTOLISP_TYPE_COPYING){
+            // another worker is copying it right now
+            if(++spins % 128 == 0){ sched_yield(); }
+            type = __atomic_load_n(&object->type, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if(__atomic_compare_exchange_n(
+            &object->type, &type, ATTOLISP_TYPE_COPYING, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+        ){ break; }
+    }
+
+    // The header is not copied with the fields: other workers may still be
+    // reading the type word.
+    size_t size = object->size;
+    al_object_t *pointer = (al_object_t*)al_gc_worker_alloc(
+        worker, kind, size);
+    pointer->type = type;
+    pointer->size = (int)size;
+    memcpy((uint8_t*)pointer + AL_HEADER, (uint8_t*)object + AL_HEADER,
+        size - AL_HEADER);
+
+    object->moved = pointer;
+    __atomic_store_n(&object->type, ATTOLISP_TYPE_MOVED, __ATOMIC_RELEASE);
+    if(al_has_pointers(type)){ al_gc_push(worker, pointer); }
+    return pointer;
+}
+
+// *****
+static void al_gc_drain(al_gc_worker_t *worker){
+#define AL_PAR_FORWARD(object) al_gc_par_forward(worker, (object))
+    for(;;){
+        while(worker->count){
+            al_object_t *object = worker->stack[--worker->count];
+            AL_SCAN_OBJECT(object, AL_PAR_FORWARD);
+        }
+        if(al_gc_steal(worker)){ continue; }
+
+        // Nothing left here: wait until either new work shows up or every
+        // worker is idle, in which case the collection is complete.
+        __atomic_add_fetch(&al_gc_idle, 1, __ATOMIC_SEQ_CST);
+        for(;;){
+            if(__atomic_load_n(&al_gc_idle, __ATOMIC_SEQ_CST) ==
+                al_gc_nworkers){ return; }
+            if(al_gc_work_available()){
+                __atomic_sub_fetch(&al_gc_idle, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+#undef AL_PAR_FORWARD
+}
+
+// Each worker forwards its own slice of the root stack before draining.
+static void al_gc_forward_roots(al_gc_worker_t *worker){
+    int self = (int)(worker - al_gc_workers);
+    size_t count = (size_t)(al_gc_root_top - al_root_stack);
+    al_object_t **first = al_root_stack + count * self / al_gc_nworkers;
+    al_object_t **last = al_root_stack + count * (self + 1) / al_gc_nworkers;
+    if(self == 0){
+        if(!al_weak_symbols){
+            al_symbols = al_gc_par_forward(worker, al_symbols);
+        }
+        for(int i=0; i < al_nstatic_roots; i++){
+            for(size_t j=0; j < al_static_roots[i].count; j++){
+                al_object_t **slot = &al_static_roots[i].slots[j];
+                if(*slot){ *slot = al_gc_par_forward(worker, *slot); }
+            }
+        }
+        for(al_code_t *code = al_codes; code; code = code->next){
+            for(int i=0; i < code->nconstants; i++){
+                code->constants[i] =
+                    al_gc_par_forward(worker, code->constants[i]);
+            }
+        }
+#define AL_PAR_FORWARD(object) al_gc_par_forward(worker, (object))
+        for(al_code_t *code = al_codes; code; code = code->next){
+            if(code->memo){ AL_SCAN_MEMO(code->memo, AL_PAR_FORWARD); }
+        }
+        AL_SCAN_TASKS(AL_PAR_FORWARD);
+#undef AL_PAR_FORWARD
+    }
+    for(al_object_t **slot = first; slot < last; slot++){
+        if(*slot){ *slot = al_gc_par_forward(worker, *slot); }
+    }
+}
+
+// *****
+static void* al_gc_worker_main(void *arg){
+    int tid = (int)((al_gc_worker_t*)arg - al_gc_workers) + 1;
+    if(al_tracing){ al_trace(tid, 'B', "gc-worker", NULL, 0); }
+    al_gc_forward_roots(arg);
+    al_gc_drain(arg);
+    if(al_tracing){ al_trace(tid, 'E', "gc-worker", NULL, 0); }
+    return NULL;
+}
+
+// *****
+static void al_gc_parallel(void *root){
+    al_gc_nworkers = al_gc_threads;
+    al_gc_idle = 0;
+    al_gc_top = 0;
+    for(int i=0; i < al_gc_nworkers; i++){
+        al_gc_worker_t *worker = &al_gc_workers[i];
+        memset(worker->bump, 0, sizeof(worker->bump));
+        worker->count = 0;
+        worker->nshared = 0;
+    }
+
+    // Worker 0 is this thread.
+    al_gc_root_top = root;
+    for(int i=1; i < al_gc_nworkers; i++){
+        if(pthread_create(&al_gc_workers[i].thread, NULL,
+            al_gc_worker_main, &al_gc_workers[i]) != 0
+        ){
+            al_error("GC: cannot start worker thread");
+        }
+    }
+    al_gc_worker_main(&al_gc_workers[0]);
+    for(int i=1; i < al_gc_nworkers; i++){
+        pthread_join(al_gc_workers[i].thread, NULL);
+    }
+
+    // Unused page tails stay as holes until the next collection.
+    al_mem_used = al_gc_top < al_memsize ? al_gc_top : al_memsize;
+}
+
+// *****
+static void al_gc_init(void){
+    for(int i=0; i < AL_GC_MAX_THREADS; i++){
+        pthread_mutex_init(&al_gc_workers[i].lock, NULL);
+    }
+}
+
+// Scans the copied objects, and the large objects marked, until there are
+// no more.
+static void al_gc_scan(void){
+    for(bool progress = true; progress; ){
+        progress = false;
+        for(int kind = 0; kind < AL_KINDS; kind++){
+            if(kind != AL_KIND_MIXED && !al_has_pointers(kind)){
+                continue;
+            }
+            while(al_scan_at[kind] < al_bump[kind].top){
+                al_object_t *object = al_slot_object(kind, al_scan_at[kind]);
+                al_scan_at[kind] += kind == AL_KIND_MIXED ?
+                    (size_t)object->size : al_kind_size[kind];
+                al_census_parent = object;
+                AL_SCAN_OBJECT(object, al_forward);
+                progress = true;
+            }
+        }
+        while(al_gc_nspans){
+            al_span_t span = al_gc_spans[--al_gc_nspans];
+            while(span.start < span.end){
+                al_object_t *object = al_slot_object(span.kind, span.start);
+                span.start += span.kind == AL_KIND_MIXED ?
+                    (size_t)object->size : al_kind_size[span.kind];
+                al_census_parent = object;
+                AL_SCAN_OBJECT(object, al_forward);
+            }
+            progress = true;
+        }
+        while(al_los_ngray){
+            al_object_t *object = al_los_gray[--al_los_ngray];
+            al_census_parent = object;
+            AL_SCAN_OBJECT(object, al_forward);
+            progress = true;
+        }
+    }
+}
+
+// Whether the trace has reached `object`, which then has its copy already.
+// Objects outside the heap are always live.
+static bool al_gc_reached(al_object_t *object){
+    size_t offset = (uintptr_t)object + AL_HEADER - (uintptr_t)al_from;
+    if(al_memsize <= offset){
+        return !al_is_large(object) || al_los_header(object)->marked;
+    }
+    int kind = al_from_kinds[offset / AL_PAGE_SIZE];
+    if(kind == AL_KIND_MIXED){
+        return object->type == ATTOLISP_TYPE_MOVED;
+    }
+    size_t word = offset / sizeof(void*);
+    return al_gc_done[word / 64] >> (word % 64) & 1;
+}
+
+// *****
+static inline bool al_gc_is_int(al_object_t *object){
+    size_t offset = (uintptr_t)object + AL_HEADER - (uintptr_t)al_from;
+    return offset < al_memsize &&
+        al_from_kinds[offset / AL_PAGE_SIZE] == ATTOLISP_TYPE_INT;
+}
+
+// Runs once the strong graph has been copied. The values of table entries
+// whose key survived are traced, which may keep more keys alive, until that
+// settles; then dead entries, cleared weak references and, with
+// ATTOLISP_WEAK_SYMBOLS, unreferenced symbols are dropped.
+static void al_gc_weak(void){
+    for(bool progress = true; progress; ){
+        progress = false;
+        for(al_object_t *weak = al_gc_weaks; weak; weak = weak->weak_next){
+            if(al_type(weak) != ATTOLISP_TYPE_TABLE){ continue; }
+            al_table_t *table = weak->table;
+            for(size_t i=0; i < table->capacity; i++){
+                al_table_entry_t *entry = &table->entries[i];
+                if(!entry->key || !(al_gc_reached(entry->key) ||
+                    al_gc_is_int(entry->key))
+                ){
+                    continue;
+                }
+                progress |= !al_gc_reached(entry->value);
+                entry->key = al_forward(entry->key);
+                entry->value = al_forward(entry->value);
+            }
+        }
+        if(progress){ al_gc_scan(); }
+    }
+
+    for(al_object_t *weak = al_gc_weaks; weak; weak = weak->weak_next){
+        if(al_type(weak) == ATTOLISP_TYPE_WEAK){
+            weak->referent = al_gc_reached(weak->referent) ?
+                al_forward(weak->referent) : al_nil;
+            continue;
+        }
+        al_table_t *table = weak->table;
+        table->mark = al_gc_count;
+        table->count = 0;
+        for(size_t i=0; i < table->capacity; i++){
+            al_table_entry_t *entry = &table->entries[i];
+            if(entry->key && !al_gc_reached(entry->key)){
+                entry->key = NULL;
+            }
+            table->count += entry->key != NULL;
+        }
+        al_table_rehash(table, al_table_capacity(table->count));
+    }
+    al_gc_weaks = NULL;
+
+    if(!al_weak_symbols){ return; }
+    al_object_t *symbols = al_nil;
+    for(al_object_t *cell = al_symbols; cell != al_nil; cell = cell->cdr){
+        if(!al_gc_reached(cell->car)){ continue; }
+        uint8_t *pointer = al_bump_alloc(
+            ATTOLISP_TYPE_CELL, al_kind_size[ATTOLISP_TYPE_CELL]);
+        if(!pointer){ al_error("GC: to-space exhausted"); }
+        al_object_t *copy = al_slot_object(ATTOLISP_TYPE_CELL, pointer);
+        copy->car = al_forward(cell->car);
+        copy->cdr = symbols;
+        symbols = copy;
+    }
+    al_symbols = symbols;
+}
+
+// ---- implemenation of al_gc
+static void attolisp_gc(void *root){
+    assert(!al_gc_running);
+    al_gc_running = true;
+    al_gc_count++;
+
+    size_t old_mem_used = al_mem_used;
+    if(al_tracing){ al_trace(1, 'B', "gc", "used", (int64_t)old_mem_used); }
+    if(al_gc_always){
+        mprotect(al_from, al_memsize, PROT_READ | PROT_WRITE);
+    }
+    if(al_memory_touched < old_mem_used){ al_memory_touched = old_mem_used; }
+    void *space = al_from;
+    al_from = al_memory;
+    al_memory = space;
+    size_t touched = al_from_touched;
+    al_from_touched = al_memory_touched;
+    al_memory_touched = touched;
+    uint8_t *kinds = al_from_kinds;
+    al_from_kinds = al_kinds;
+    al_kinds = kinds;
+    memset(al_kinds, 0, al_memsize / AL_PAGE_SIZE);
+    size_t words = old_mem_used / sizeof(void*) / 64 + 1;
+    memset(al_gc_done, 0, words * sizeof(uint64_t));
+    memset(al_gc_claimed, 0, words * sizeof(uint64_t));
+    al_mem_used = 0;
+    memset(al_bump, 0, sizeof(al_bump));
+    // The serial scan also finishes off after the parallel workers.
+    memset(al_scan_at, 0, sizeof(al_scan_at));
+    al_gc_nspans = 0;
+
+    if(al_gc_threads > 1 && AL_GC_PARALLEL_MIN <= old_mem_used &&
+        !al_census
+    ){
+        al_gc_parallel(root);
+    }else{
+        al_forward_root_objects(root);
+        AL_SCAN_TASKS(al_forward);
+        al_gc_scan();
+    }
+    al_gc_weak();
+
+    // Finish up garbage collection
+    if(al_memory_touched < al_mem_used){ al_memory_touched = al_mem_used; }
+    size_t released = al_semispace_trim();
+    if(al_gc_always){ mprotect(al_from, al_memsize, PROT_NONE); }
+    al_los_sweep();
+    al_code_sweep();
+    al_table_sweep();
+    if(al_gc_debug){
+        fprintf(
+            stderr, "al_gc: %zu bytes out of %zu bytes copied, "
+            "%zu large object bytes kept, %zu idle bytes released.\n",
+            al_mem_used, old_mem_used, al_los_used, released
+        );
+    }
+    if(al_tracing){ al_trace(1, 'E', "gc", "copied", (int64_t)al_mem_used); }
+
+    al_gc_running = false;
+}
+
+// ***********************
+//      CONSTRUCTORS
+// ***********************
+static al_object_t* al_new_int(void *root, int value){
+    al_object_t *result = al_alloc(root, ATTOLISP_TYPE_INT, sizeof(int));
+    result->value = value;
+    return result;
+}
+
+// *****
+static al_object_t* al_new_cons(
+    void *root, al_object_t **car, al_object_t **cdr
+){
+    al_object_t *cell = al_alloc(
+        root, ATTOLISP_TYPE_CELL, sizeof(al_object_t*)*2);
+    cell->car = *car;
+    cell->cdr = *cdr;
+
+    return cell;
+}
+
+// Allocates a list of `count` fresh cells with nil cars in one batch: the
+// collector runs at most once, before the first cell is taken, so nothing
+// moves while the cells are carved out of the cons pages.
+static al_object_t* al_new_list(void *root, size_t count){
+    size_t size = al_kind_size[ATTOLISP_TYPE_CELL];
+    al_bump_t *bump = &al_bump[ATTOLISP_TYPE_CELL];
+    size_t room = (size_t)(bump->limit - bump->top) / size;
+    size_t bytes = count < room ? 0 :
+        al_round_up((count - room) * size, AL_PAGE_SIZE);
+    if((al_gc_always && !al_gc_running) || al_memsize < al_mem_used + bytes){
+        attolisp_gc(root);
+    }
+
+    al_charge(count * size);
+    if(al_profiling){
+        al_profile_alloc(ATTOLISP_TYPE_CELL, count, count * size);
+    }
+    al_object_t *list = al_nil;
+    for(size_t i=0; i < count; i++){
+        uint8_t *pointer = al_bump_alloc(ATTOLISP_TYPE_CELL, size);
+        if(!pointer){ al_error("Memory exhausted"); }
+        al_object_t *cell = al_slot_object(ATTOLISP_TYPE_CELL, pointer);
+        cell->car = al_nil;
+        cell->cdr = list;
+        list = cell;
+    }
+    return list;
+}
+
+// *****
+static al_object_t* al_new_symbol(void *root, const char *name){
+    al_object_t *symbol = al_alloc(root, ATTOLISP_TYPE_SYMBOL, strlen(name)+1);
+    strcpy(symbol->name, name);
+    return symbol;
+}
+
+// *****
+static al_object_t* al_new_primitive(void *root, al_primitive_t fn){
+    al_object_t *result = al_alloc(
+        root, ATTOLISP_TYPE_PRIMITIVE, sizeof(al_primitive_t));
+        result->fn = fn;
+        return result;
+}
+
+
+// *****
+static al_object_t* al_new_function(
+    void *root, al_object_t **env, int type, al_object_t **params,
+    al_object_t **body
+){
+    assert(type == ATTOLISP_TYPE_FUNCTION || type == ATTOLISP_TYPE_MACRO);
+    al_object_t *result = al_alloc(root, type, sizeof(al_object_t*)*4);
+    result->params = *params;
+    result->body = *body;
+    result->env = *env;
+    result->code = NULL;
+
+    return result;
+}
+
+// *****
+static al_object_t* al_new_env(
+    void *root, al_object_t **vars, al_object_t **up
+){
+    al_object_t* result = al_alloc(
+        root, ATTOLISP_TYPE_ENV, sizeof(al_object_t*)*2);
+    result->vars = *vars;
+    result->up = *up;
+    return result;
+}
+
+static al_object_t* al_acons(
+    void *root, al_object_t **x, al_object_t **y, al_object_t **a
+){
+    AL_DEFINE1(cell);
+    *cell = al_new_cons(root, x, y);
+    return al_new_cons(root, cell, a);
+}
+
+// ---
+const char al_symbol_chars[] = "~!@#$%^*-_=+:/?<>";
+
+static al_object_t* al_read_expr(void *root);
+
+// stream the reader takes its input from, stdin unless the server or
+// --load points it elsewhere
+static FILE *al_input;
+
+// *****
+static int al_peek(void){
+    int c = getc(al_input);
+    ungetc(c, al_input);
+    return c;
+}
+
+static al_object_t* al_reverse(al_object_t *list){
+    al_object_t *result = al_nil;
+    while(list != al_nil){
+        al_object_t *head = list;
+        list = list->cdr;
+        head->cdr = result;
+        result = head;
+    }
+
+    return result;
+}
+
+// *****
+static void al_skip_line(void){
+    while(1){
+        int c = getc(al_input);
+        if(c == EOF || c == '\n'){ return; }
+        if(c == '\r'){
+            if(al_peek() == '\n'){ getc(al_input); }
+            return;
+        }
+    }
+}
+
+// *****
+static al_object_t* al_read_list(void *root){
+    AL_DEFINE3(object, head, last);
+    *head = al_nil;
+    while(1){
+        *object = al_read_expr(root);
+        if(!*object){
+            al_error("Unclosed parenthesis");
+        }
+        if(*object == al_cparen){
+            return al_reverse(*head);
+        }
+        if(*object == al_dot){
+            *last = al_read_expr(root);
+            if(al_read_expr(root) != al_cparen){
+                al_error("Closed parenthesis expected after dot");
+            }
+            al_object_t *result = al_reverse(*head);
+            (*head)->cdr = *last;
+            return result;
+        }
+        *head = al_new_cons(root, object, head);
+    }
+}
+
+// *****
+static al_object_t* al_intern(void *root, char *name){
+    for(al_object_t *pointer = al_symbols;
+        pointer != al_nil; pointer=pointer->cdr
+    ){
+        if(strcmp(name, pointer->car->name) == 0){
+            return pointer->car;
+        }
+    }
+
+    AL_DEFINE1(symbol);
+    *symbol = al_new_symbol(root, name);
+    al_symbols = al_new_cons(root, symbol, &al_symbols);
+    return *symbol;
+}
+
+// *****
+static al_object_t* al_read_quote(void *root){
+    AL_DEFINE2(symbol, tmp);
+    *symbol = al_intern(root, "quote");
+    *tmp = al_read_expr(root);
+    *tmp = al_new_cons(root, tmp, &al_nil);
+    *tmp = al_new_cons(root, symbol, tmp);
+    return *tmp;
+}
+
+
+// *****
+static int al_read_number(int value){
+    while(isdigit(al_peek())){
+        value = value * 10 + (getc(al_input) - '0');
+    }
+    return value;
+}
+
+// Reads the rest of a symbol name into `buffer`; returns its length, or -1
+// if the name is longer than ATTOLISP_MAXLEN.
+static int al_read_name(char *buffer, char c){
+    buffer[0] = c;
+    int len = 1;
+    while(isalnum(al_peek())|| strchr(al_symbol_chars, al_peek())){
+        if(ATTOLISP_MAXLEN <= len){ return -1; }
+        buffer[len++] = getc(al_input);
+    }
+    buffer[len] = '\0';
+    return len;
+}
+
+// Reads the rest of a "string" up to its closing quote into `buffer`;
+// returns its length, -1 if it is too long and -2 if it is not closed.
+static int al_read_text(char *buffer){
+    int len = 0;
+    for(int c = getc(al_input); c != '"'; c = getc(al_input)){
+        if(c == EOF){ return -2; }
+        if(ATTOLISP_MAXLEN <= len){ return -1; }
+        buffer[len++] = c;
+    }
+    buffer[len] = '\0';
+    return len;
+}
+
+// There is no string type: "text" reads as 'text, a quoted symbol with that
+// name, which is enough for primitives that take a file name.
+static al_object_t* al_read_string(void *root){
+    char buffer[ATTOLISP_MAXLEN+1];
+    int len = al_read_text(buffer);
+    if(len == -1){ al_error("ERROR: String too long"); }
+    if(len == -2){ al_error("ERROR: Unterminated string"); }
+    AL_DEFINE2(symbol, tmp);
+    *symbol = al_intern(root, "quote");
+    *tmp = al_intern(root, buffer);
+    *tmp = al_new_cons(root, tmp, &al_nil);
+    *tmp = al_new_cons(root, symbol, tmp);
+    return *tmp;
+}
+
+// *****
+static al_object_t* al_read_symbol(void *root, char c){
+    char buffer[ATTOLISP_MAXLEN+1];
+    if(al_read_name(buffer, c) < 0){
+        al_error("ERROR: Symbol name too long");
+    }
+    return al_intern(root, buffer);
+}
+
+// *****
+static al_object_t* al_read_expr(void *root){
+    for(;;){
+        int c = getc(al_input);
+        if(c == ' ' || c == '\n' || c == '\r' || c == '\t'){ continue; }
+        if(c == EOF){ return NULL; }
+        if(c == ';'){
+            al_skip_line();
+            continue;
+        }
+        if(c == '('){ return al_read_list(root); }
+        if(c == ')'){ return al_cparen; }
+        if(c == '.'){ return al_dot; }
+        if(c == '\''){ return al_read_quote(root); }
+        if(c == '"'){ return al_read_string(root); }
+        if(isdigit(c)){
+            return al_new_int(root, al_read_number(c-'0'));
+        }
+        if(c == '-' && isdigit(al_peek())){
+            return al_new_int(root, -al_read_number(0));
+        }
+        if(isalpha(c) || strchr(al_symbol_chars, c)){
+            return al_read_symbol(root, c);
+        }
+        al_error("ERROR:: Don't know how to handle %c", c);
+    }
+}
+
+// -------------------------------
+// ----- PIPELINED READER --------
+// -------------------------------
+// With ATTOLISP_PIPELINE set, a reader thread parses upcoming top-level forms
+// into a flat byte encoding while the evaluator runs the previous ones. The
+// encoding holds no pointers, so the reader never touches the heap; the
+// evaluator rebuilds each form with the ordinary constructors.
+//
+//   'i' int32 | 's' len name NUL | '(' expr* ['.' expr] ')' | '\'' expr
+//   ')' and '.' also appear alone for stray tokens at top level,
+//   '!' message NUL reports a read error at the point it happened.
+enum{
+    AL_PRE_INT = 'i',
+    AL_PRE_SYMBOL = 's',
+    AL_PRE_OPEN = '(',
+    AL_PRE_CLOSE = ')',
+    AL_PRE_DOT = '.',
+    AL_PRE_QUOTE = '\'',
+    AL_PRE_ERROR = '!',
+    // parser results that are not tags
+    AL_PRE_EOF = -1,
+    AL_PRE_FAIL = -2
+};
+
+#define AL_PIPE_SLOTS   256
+
+typedef struct al_preform_t {
+    uint8_t *data;  // NULL marks the end of input
+    size_t len;
+    size_t capacity;
+} al_preform_t;
+
+static al_preform_t al_pipe_queue[AL_PIPE_SLOTS];
+static size_t al_pipe_head;     // next slot to evaluate
+static size_t al_pipe_tail;     // next slot to fill
+static pthread_mutex_t al_pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t al_pipe_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t al_pipe_space = PTHREAD_COND_INITIALIZER;
+static bool al_pipeline = false;
+
+// *****
+static void al_pre_emit(al_preform_t *form, const void *bytes, size_t len){
+    if(form->capacity < form->len + len){
+        size_t capacity = form->capacity ? form->capacity : 64;
+        while(capacity < form->len + len){ capacity *= 2; }
+        form->data = realloc(form->data, capacity);
+        if(!form->data){ al_error("Memory exhausted"); }
+        form->capacity = capacity;
+    }
+    memcpy(form->data + form->len, bytes, len);
+    form->len += len;
+}
+
+// *****
+static int al_pre_tag(al_preform_t *form, uint8_t tag){
+    al_pre_emit(form, &tag, 1);
+    return tag;
+}
+
+// Replaces the partial form with an error record.
+static int al_pre_fail(al_preform_t *form, const char *message){
+    form->len = 0;
+    al_pre_tag(form, AL_PRE_ERROR);
+    al_pre_emit(form, message, strlen(message) + 1);
+    return AL_PRE_FAIL;
+}
+
+static int al_preparse_expr(al_preform_t *form);
+
+// *****
+static int al_preparse_list(al_preform_t *form){
+    al_pre_tag(form, AL_PRE_OPEN);
+    for(;;){
+        int tag = al_preparse_expr(form);
+        if(tag == AL_PRE_FAIL){ return tag; }
+        if(tag == AL_PRE_EOF){
+            return al_pre_fail(form, "Unclosed parenthesis");
+        }
+        if(tag == AL_PRE_CLOSE){ return AL_PRE_OPEN; }
+        if(tag == AL_PRE_DOT){
+            tag = al_preparse_expr(form);
+            if(tag == AL_PRE_FAIL){ return tag; }
+            if(tag < 0 || al_preparse_expr(form) != AL_PRE_CLOSE){
+                return al_pre_fail(form,
+                    "Closed parenthesis expected after dot");
+            }
+            return AL_PRE_OPEN;
+        }
+    }
+}
+
+// Same lexical rules as al_read_expr; returns the tag of the parsed datum.
+static int al_preparse_expr(al_preform_t *form){
+    for(;;){
+        int c = getc(al_input);
+        if(c == ' ' || c == '\n' || c == '\r' || c == '\t'){ continue; }
+        if(c == EOF){ return AL_PRE_EOF; }
+        if(c == ';'){
+            al_skip_line();
+            continue;
+        }
+        if(c == '('){ return al_preparse_list(form); }
+        if(c == ')'){ return al_pre_tag(form, AL_PRE_CLOSE); }
+        if(c == '.'){ return al_pre_tag(form, AL_PRE_DOT); }
+        if(c == '\''){
+            al_pre_tag(form, AL_PRE_QUOTE);
+            int tag = al_preparse_expr(form);
+            if(tag == AL_PRE_EOF){
+                return al_pre_fail(form, "Unexpected end of input after quote");
+            }
+            return tag == AL_PRE_FAIL ? tag : AL_PRE_QUOTE;
+        }
+        if(c == '"'){
+            char buffer[ATTOLISP_MAXLEN+1];
+            int len = al_read_text(buffer);
+            if(len == -1){ return al_pre_fail(form, "ERROR: String too long"); }
+            if(len == -2){
+                return al_pre_fail(form, "ERROR: Unterminated string");
+            }
+            uint8_t size = (uint8_t)len;
+            al_pre_tag(form, AL_PRE_QUOTE);
+            al_pre_tag(form, AL_PRE_SYMBOL);
+            al_pre_emit(form, &size, 1);
+            al_pre_emit(form, buffer, len + 1);
+            return AL_PRE_QUOTE;
+        }
+        if(isdigit(c) || (c == '-' && isdigit(al_peek()))){
+            int32_t value = c == '-' ? -al_read_number(0) :
+                al_read_number(c-'0');
+            al_pre_tag(form, AL_PRE_INT);
+            al_pre_emit(form, &value, sizeof(value));
+            return AL_PRE_INT;
+        }
+        if(isalpha(c) || strchr(al_symbol_chars, c)){
+            char buffer[ATTOLISP_MAXLEN+1];
+            int len = al_read_name(buffer, c);
+            if(len < 0){
+                return al_pre_fail(form, "ERROR: Symbol name too long");
+            }
+            uint8_t size = (uint8_t)len;
+            al_pre_tag(form, AL_PRE_SYMBOL);
+            al_pre_emit(form, &size, 1);
+            al_pre_emit(form, buffer, len + 1);
+            return AL_PRE_SYMBOL;
+        }
+        char message[64];
+        snprintf(message, sizeof(message),
+            "ERROR:: Don't know how to handle %c", c);
+        return al_pre_fail(form, message);
+    }
+}
+
+// Encodes a datum in the pre-parsed format; false if it has no such form.
+static bool al_pre_encode(al_preform_t *form, al_object_t *object){
+    switch(al_type(object)){
+    case ATTOLISP_TYPE_INT:{
+        int32_t value = object->value;
+        al_pre_tag(form, AL_PRE_INT);
+        al_pre_emit(form, &value, sizeof(value));
+        return true;
+    }
+    case ATTOLISP_TYPE_SYMBOL:{
+        uint8_t size = (uint8_t)strlen(object->name);
+        al_pre_tag(form, AL_PRE_SYMBOL);
+        al_pre_emit(form, &size, 1);
+        al_pre_emit(form, object->name, size + 1);
+        return true;
+    }
+    case ATTOLISP_TYPE_NIL:
+        al_pre_tag(form, AL_PRE_OPEN);
+        al_pre_tag(form, AL_PRE_CLOSE);
+        return true;
+    case ATTOLISP_TYPE_CELL:
+        al_pre_tag(form, AL_PRE_OPEN);
+        for(; al_type(object) == ATTOLISP_TYPE_CELL; object = object->cdr){
+            if(!al_pre_encode(form, object->car)){ return false; }
+        }
+        if(object != al_nil){
+            al_pre_tag(form, AL_PRE_DOT);
+            if(!al_pre_encode(form, object)){ return false; }
+        }
+        al_pre_tag(form, AL_PRE_CLOSE);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// *****
+static void al_pipe_push(al_preform_t form){
+    pthread_mutex_lock(&al_pipe_lock);
+    while(al_pipe_tail - al_pipe_head == AL_PIPE_SLOTS){
+        pthread_cond_wait(&al_pipe_space, &al_pipe_lock);
+    }
+    al_pipe_queue[al_pipe_tail++ % AL_PIPE_SLOTS] = form;
+    pthread_cond_signal(&al_pipe_ready);
+    pthread_mutex_unlock(&al_pipe_lock);
+}
+
+// *****
+static void* al_pipe_reader(void *arg){
+    (void)arg;
+    for(;;){
+        al_preform_t form = { NULL, 0, 0 };
+        int tag = al_preparse_expr(&form);
+        if(tag == AL_PRE_EOF){
+            free(form.data);
+            form.data = NULL;
+        }
+        al_pipe_push(form);
+        if(tag == AL_PRE_EOF || tag == AL_PRE_FAIL){ return NULL; }
+    }
+}
+
+// *****
+static void al_pipe_start(void){
+    pthread_t reader;
+    if(pthread_create(&reader, NULL, al_pipe_reader, NULL) != 0){
+        al_error("Cannot start reader thread");
+    }
+    pthread_detach(reader);
+}
+
+// *****
+static al_object_t* al_materialize(void *root, const uint8_t **cursor){
+    const uint8_t *pointer = *cursor;
+    uint8_t tag = *pointer++;
+    switch(tag){
+    case AL_PRE_INT:{
+        int32_t value;
+        memcpy(&value, pointer, sizeof(value));
+        *cursor = pointer + sizeof(value);
+        return al_new_int(root, value);
+    }
+    case AL_PRE_SYMBOL:{
+        size_t len = *pointer++;
+        *cursor = pointer + len + 1;
+        return al_intern(root, (char*)pointer);
+    }
+    case AL_PRE_CLOSE:
+        *cursor = pointer;
+        return al_cparen;
+    case AL_PRE_DOT:
+        *cursor = pointer;
+        return al_dot;
+    case AL_PRE_QUOTE:{
+        AL_DEFINE2(symbol, tmp);
+        *cursor = pointer;
+        *symbol = al_intern(root, "quote");
+        *tmp = al_materialize(root, cursor);
+        *tmp = al_new_cons(root, tmp, &al_nil);
+        *tmp = al_new_cons(root, symbol, tmp);
+        return *tmp;
+    }
+    case AL_PRE_OPEN:{
+        AL_DEFINE3(object, head, last);
+        *head = al_nil;
+        *cursor = pointer;
+        while(**cursor != AL_PRE_CLOSE && **cursor != AL_PRE_DOT){
+            *object = al_materialize(root, cursor);
+            *head = al_new_cons(root, object, head);
+        }
+        if(**cursor == AL_PRE_DOT){
+            (*cursor)++;
+            *last = al_materialize(root, cursor);
+        }else{
+            *last = al_nil;
+        }
+        (*cursor)++;
+        if(*head == al_nil){ return *last; }
+        al_object_t *result = al_reverse(*head);
+        (*head)->cdr = *last;
+        return result;
+    }
+    case AL_PRE_ERROR:
+        al_error("%s", (const char*)pointer);
+    }
+    al_error("ERROR:: pipeline: bad tag %d", tag);
+    return NULL; // never reached
+}
+
+// Takes the next pre-parsed form off the queue; NULL at end of input.
+static al_object_t* al_pipe_read_expr(void *root){
+    pthread_mutex_lock(&al_pipe_lock);
+    while(al_pipe_head == al_pipe_tail){
+        pthread_cond_wait(&al_pipe_ready, &al_pipe_lock);
+    }
+    al_preform_t form = al_pipe_queue[al_pipe_head++ % AL_PIPE_SLOTS];
+    pthread_cond_signal(&al_pipe_space);
+    pthread_mutex_unlock(&al_pipe_lock);
+
+    if(!form.data){ return NULL; }
+    const uint8_t *cursor = form.data;
+    al_object_t *result = al_materialize(root, &cursor);
+    free(form.data);
+    return result;
+}
+
+// *****
+static void al_print(al_object_t *object){
+    // if(object->type == ATTOLISP_TYPE_CELL){
+    //     printf("(");
+    //     for(;;){
+    //         al_print(object->car);
+    //         if(object->cdr == al_nil){ break; }
+    //         if(object->cdr->type != ATTOLISP_TYPE_CELL){
+    //             printf(" . ");
+    //             al_print(object->cdr);
+    //             break;
+    //         }
+    //         printf(" ");
+    //         object = object->cdr;
+    //     }
+    //     printf(")");
+    //     return;
+    // }
+    // else if(object->type == ATTOLISP_TYPE_INT){
+    //     printf("%d", object->value);
+    //     return;
+    // }
+    // else if(object->type == ATTOLISP_TYPE_SYMBOL){
+    //     printf("%s", object->name);
+    //     return;
+    // }
+    // else if(object->type == ATTOLISP_TYPE_PRIMITIVE){
+    //     printf("%s", "<primitive>");
+    // }
+    // else if(object->type == ATTOLISP_TYPE_FUNCTION){
+    //     printf("%s", "<function>");
+    //     return;
+    // }
+    // else if(object->type == ATTOLISP_TYPE_MACRO){
+    //     printf("%s", "<macro>");
+    //     return;
+    // }
+    // else if(object->type == ATTOLISP_TYPE_MOVED){
+    //     printf("%s", "<moved>");
+    //     return;
+    // }
+    // else if(object->type == ATTOLISP_TYPE_TRUE){
+    //     printf("%s", "t");
+    //     return;
+    // }else if(object->type == ATTOLISP_TYPE_NIL){
+    //     printf("%s", "()");
+    //     return;
+    // }else{
+    //     al_error("ERROR:: print: Unknown tag type: %d", object->type);
+    // }
+
+    switch(al_type(object)){
+    case ATTOLISP_TYPE_CELL:
+        printf("(");
+        for(;;){
+            al_print(object->car);
+            if(object->cdr == al_nil){ break; }
+            if(al_type(object->cdr) != ATTOLISP_TYPE_CELL){
+                printf(" . ");
+                al_print(object->cdr);
+                break;
+            }
+            printf(" ");
+            object = object->cdr;
+        }
+        printf(")");
+        return;
+#define AL_CASE(type, ...)      \
+    case type:                  \
+        printf(__VA_ARGS__);    \
+        return
+
+    AL_CASE(ATTOLISP_TYPE_INT, "%d", object->value);
+    AL_CASE(ATTOLISP_TYPE_SYMBOL, "%s", object->name);
+    AL_CASE(ATTOLISP_TYPE_PRIMITIVE, "<primitive>");
+    AL_CASE(ATTOLISP_TYPE_FUNCTION, "<function>");
+    AL_CASE(ATTOLISP_TYPE_MACRO, "<macro>");
+    AL_CASE(ATTOLISP_TYPE_BUFFER, "<buffer %zu>", object->length);
+    AL_CASE(ATTOLISP_TYPE_WEAK, "<weak-ref>");
+    AL_CASE(ATTOLISP_TYPE_TABLE, "<weak-table %zu>", object->table->count);
+    AL_CASE(ATTOLISP_TYPE_CHANNEL, "<channel>");
+    AL_CASE(ATTOLISP_TYPE_MOVED, "<moved>");
+    AL_CASE(ATTOLISP_TYPE_TRUE, "t");
+    AL_CASE(ATTOLISP_TYPE_NIL, "()");
+#undef AL_CASE
+        default:
+            //al_error("ERROR:: print: Unknown tag type: %d", object->type);
+            break;
+    } // end switch
+}
+
+// *****
+static inline bool al_eql(al_object_t *a, al_object_t *b){
+    return a == b || (al_type(a) == ATTOLISP_TYPE_INT &&
+        al_type(b) == ATTOLISP_TYPE_INT && a->value == b->value);
+}
+
+// *****
+static int al_length(al_object_t *list){
+    int len = 0;
+    for(; al_type(list) == ATTOLISP_TYPE_CELL; list = list->cdr){ len++; }
+    return list == al_nil ? len : -1;
+}
+
+// -------------------------------
+// -------- MEMOIZATION ----------
+// -------------------------------
+// A function made by defmemo or memoize has a bounded cache from argument
+// values to results, consulted before a frame is built for the call. Only
+// calls whose arguments are all integers, symbols, t or nil are cached:
+// those compare by value and hash by content, so an entry stays valid when
+// the collector moves its objects. The cache is set associative and a full
+// set evicts its least recently used entry.
+#define ATTOLISP_MEMO_SIZE  4096
+
+static size_t al_memo_size = ATTOLISP_MEMO_SIZE;
+
+// *****
+static al_memo_t* al_memo_new(void){
+    size_t nsets = 1;
+    while(nsets * AL_MEMO_WAYS < al_memo_size){ nsets *= 2; }
+    al_memo_t *memo = calloc(1,
+        sizeof(al_memo_t) + nsets * AL_MEMO_WAYS * sizeof(al_memo_entry_t));
+    if(!memo){ al_error("Memory exhausted"); }
+    memo->nsets = nsets;
+    return memo;
+}
+
+// *****
+static inline al_memo_t* al_memo_of(al_object_t *fn){
+    al_code_t *code = fn->code;
+    return code ? code->memo : NULL;
+}
+
+// Hashes the arguments of a call, or returns false when they cannot be a key.
+static bool al_memo_hash(al_object_t **argv, int argc, uint64_t *hash){
+    if(AL_MEMO_ARGS < argc){ return false; }
+    uint64_t h = 14695981039346656037ull ^ (uint64_t)argc;
+    for(int i=0; i < argc; i++){
+        uint64_t key;
+        switch(al_type(argv[i])){
+        case ATTOLISP_TYPE_INT:
+            key = (uint32_t)argv[i]->value;
+            break;
+        case ATTOLISP_TYPE_SYMBOL:
+            key = (uint64_t)1 << 32;
+            for(const char *c = argv[i]->name; *c; c++){
+                key = (key ^ (uint8_t)*c) * 1099511628211ull;
+            }
+            break;
+        case ATTOLISP_TYPE_TRUE:
+            key = (uint64_t)2 << 32;
+            break;
+        case ATTOLISP_TYPE_NIL:
+            key = (uint64_t)3 << 32;
+            break;
+        default:
+            return false;
+        }
+        h = (h ^ key) * 1099511628211ull;
+        h ^= h >> 29;
+    }
+    *hash = h;
+    return true;
+}
+
+// *****
+static al_memo_entry_t* al_memo_find(
+    al_memo_t *memo, uint64_t hash, al_object_t **argv, int argc
+){
+    al_memo_entry_t *set =
+        &memo->entries[(hash & (memo->nsets - 1)) * AL_MEMO_WAYS];
+    for(int way=0; way < AL_MEMO_WAYS; way++){
+        al_memo_entry_t *entry = &set[way];
+        if(!entry->stamp || entry->hash != hash || entry->argc != argc){
+            continue;
+        }
+        int i = 0;
+        while(i < argc && al_eql(entry->args[i], argv[i])){ i++; }
+        if(i == argc){ return entry; }
+    }
+    return NULL;
+}
+
+// Returns the cached result of a call, or NULL on a miss.
+static al_object_t* al_memo_lookup(
+    al_memo_t *memo, uint64_t hash, al_object_t **argv, int argc
+){
+    al_memo_entry_t *entry = al_memo_find(memo, hash, argv, argc);
+    if(!entry){
+        memo->misses++;
+        return NULL;
+    }
+    memo->hits++;
+    entry->stamp = ++memo->clock;
+    return entry->result;
+}
+
+// *****
+static void al_memo_store(
+    al_memo_t *memo, uint64_t hash, al_object_t **argv, int argc,
+    al_object_t *result
+){
+    al_memo_entry_t *entry = al_memo_find(memo, hash, argv, argc);
+    if(!entry){
+        al_memo_entry_t *set =
+            &memo->entries[(hash & (memo->nsets - 1)) * AL_MEMO_WAYS];
+        entry = &set[0];
+        for(int way=1; way < AL_MEMO_WAYS; way++){
+            if(set[way].stamp < entry->stamp){ entry = &set[way]; }
+        }
+        entry->hash = hash;
+        entry->argc = argc;
+        memcpy(entry->args, argv, (size_t)argc * sizeof(al_object_t*));
+    }
+    entry->result = result;
+    entry->stamp = ++memo->clock;
+}
+
+// -------------
+//  Evaluator
+// -------------
+static al_object_t* al_eval(
+    void *root, al_object_t **env, al_object_t **object
+);
+// run functions through the analyzer instead of re-walking their bodies
+static bool al_analyzer = true;
+static al_object_t* al_apply_function(
+    void *root, al_object_t **fn, al_object_t **args
+);
+
+// *****
+static void al_add_variable(
+    void *root,
+    al_object_t **env,
+    al_object_t **sym,
+    al_object_t **values
+){
+    AL_DEFINE2(vars, tmp);
+    *vars = (*env)->vars;
+    *tmp = al_acons(root, sym, values, vars);
+    (*env)->vars = *tmp;
+    al_define_epoch++;
+}
+
+// *****
+static al_object_t* al_push_env(
+    void *root,
+    al_object_t **env,
+    al_object_t **vars,
+    al_object_t **values
+){
+    AL_DEFINE3(map, symbol, value);
+    *map = al_nil;
+    for(; al_type(*vars) == ATTOLISP_TYPE_CELL;
+        *vars = (*vars)->cdr, *values = (*values)->cdr
+    ){
+        if(al_type(*values) != ATTOLISP_TYPE_CELL){
+            al_error(
+                "ERROR: Cannot apply function: number of argument does "
+                "match"
+            );
+        }
+        *symbol = (*vars)->car;
+        *value = (*values)->car;
+        *map = al_acons(root, symbol, value, map);
+    }
+    if(*vars != al_nil){
+        *map = al_acons(root, vars, values, map);
+    }
+
+    return al_new_env(root, map, env);
+}
+
+// *****
+static al_object_t* al_progn(
+    void *root, al_object_t **env, al_object_t **list
+){
+    AL_DEFINE2(pointer, result);
+    for(*pointer = *list; *pointer != al_nil; *pointer = (*pointer)->cdr){
+        *result = (*pointer)->car;
+        *result = al_eval(root, env, result);
+    }
+
+    return *result;
+}
+
+// *****
+static al_object_t* al_eval_list(
+    void *root, al_object_t **env, al_object_t **list
+){
+    AL_DEFINE4(head, pointer, expr, result);
+    *head = al_nil;
+    for(pointer = list; *pointer != al_nil; *pointer = (*pointer)->cdr){
+        *expr = (*pointer)->car;
+        *result = al_eval(root, env, expr);
+        *head = al_new_cons(root, result, head);
+    }
+
+    return al_reverse(*head);
+}
+
+// *****
+static bool al_is_list(al_object_t *object){
+    return object == al_nil || al_type(object) == ATTOLISP_TYPE_CELL;
+}
+
+// *****
+static al_object_t* al_apply_callback(
+    void *root,
+    al_object_t **env,
+    al_object_t **callback,
+    al_object_t **args
+){
+    if(al_analyzer && al_type(*callback) == ATTOLISP_TYPE_FUNCTION){
+        return al_apply_function(root, callback, args);
+    }
+    AL_DEFINE3(params, newEnv, body);
+    al_memo_t *memo = al_type(*callback) == ATTOLISP_TYPE_FUNCTION ?
+        al_memo_of(*callback) : NULL;
+    int argc = memo ? al_length(*args) : -1;
+    al_object_t **argv = NULL;
+    uint64_t hash;
+    if(0 <= argc && argc <= AL_MEMO_ARGS){
+        argv = al_root_reserve(root, (size_t)argc);
+        root = argv + argc;
+        int i = 0;
+        for(al_object_t *pointer = *args; pointer != al_nil;
+            pointer = pointer->cdr
+        ){ argv[i++] = pointer->car; }
+        if(al_memo_hash(argv, argc, &hash)){
+            al_object_t *result = al_memo_lookup(memo, hash, argv, argc);
+            if(result){ return result; }
+        }else{
+            argv = NULL;
+        }
+    }
+    *params = (*callback)->params;
+    *newEnv = (*callback)->env;
+    *newEnv = al_push_env(root, newEnv, params, args);
+    *body = (*callback)->body;
+
+    if(!argv){ return al_progn(root, newEnv, body); }
+    *body = al_progn(root, newEnv, body);
+    al_memo_store(memo, hash, argv, argc, *body);
+    return *body;
+}
+
+// *****
+static al_object_t* al_apply(
+    void *root,
+    al_object_t **env,
+    al_object_t **fn,
+    al_object_t **args
+){
+    if(!al_is_list(*args)){
+        al_error("ERROR: argument must be a list");
+    }
+    // if((*fn)->type != ATTOLISP_TYPE_FUNCTION ||
+    //     (*fn)->type != ATTOLISP_TYPE_PRIMITIVE
+    // ){
+    //     al_error("ERROR:: not supported");
+    // }
+    if(al_type(*fn) == ATTOLISP_TYPE_PRIMITIVE){
+        return (*fn)->fn(root, env, args);
+    }
+    if(al_type(*fn) == ATTOLISP_TYPE_FUNCTION){
+        AL_DEFINE1(xargs);
+        *xargs = al_eval_list(root, env, args);
+        al_enter();
+        *xargs = al_apply_callback(root, env, fn, xargs);
+        al_depth_left++;
+        return *xargs;
+    }
+    al_error("ERROR:: not supported");
+    //return al_nil; // never reached
+}
+
+// *****
+static al_object_t* al_find(al_object_t **env, al_object_t *sym){
+    for(al_object_t *pointer = *env; pointer != al_nil; pointer = pointer->up){
+        for(al_object_t *cell=pointer->vars; cell!=al_nil; cell=cell->cdr){
+            al_object_t *bind = cell->car;
+            if(sym == bind->car){ return bind; }
+        }
+    }
+
+    return NULL;
+}
+
+// *****
+static al_object_t* al_macroexpand(
+    void *root,
+    al_object_t **env,
+    al_object_t **object
+){
+    if(al_type(*object) != ATTOLISP_TYPE_CELL ||
+        al_type((*object)->car) != ATTOLISP_TYPE_SYMBOL
+    ){ return *object; }
+    AL_DEFINE3(bind, macro, args);
+    *bind = al_find(env, (*object)->car);
+    if(!*bind || al_type((*bind)->cdr) != ATTOLISP_TYPE_MACRO){
+        return *object;
+    }
+    *macro = (*bind)->cdr;
+    *args = (*object)->cdr;
+    return al_apply_callback(root, env, macro, args);
+}
+
+// *****
+static al_object_t* al_eval(
+    void *root,
+    al_object_t **env, al_object_t **object
+){
+    al_object_t *result;
+    switch(al_type(*object)){
+    case ATTOLISP_TYPE_INT:
+    case ATTOLISP_TYPE_PRIMITIVE:
+    case ATTOLISP_TYPE_FUNCTION:
+    case ATTOLISP_TYPE_TRUE:
+    case ATTOLISP_TYPE_NIL:
+        //result = 
+        return *object;
+        //break;
+    case ATTOLISP_TYPE_SYMBOL:{
+        al_object_t *bind = al_find(env, *object);
+        if(!bind){
+            al_error("ERROR: Undefined symbol: %s", (*object)->name);
+        }
+        //result = 
+        return bind->cdr;
+        //break;
+    }
+    
+    case ATTOLISP_TYPE_CELL:{
+        al_step();
+        AL_DEFINE3(fn, expanded, args);
+        *expanded = al_macroexpand(root, env, object);
+        if(*expanded != *object){
+            return al_eval(root, env, expanded);
+        }
+        *fn = (*object)->car;
+        *fn = al_eval(root, env, fn);
+        *args = (*object)->cdr;
+        if(al_type(*fn) != ATTOLISP_TYPE_PRIMITIVE &&
+            al_type(*fn) != ATTOLISP_TYPE_FUNCTION
+        ){
+            al_error("The of a list must be a function");  
+        }
+        if(!al_hooks){ return al_apply(root, env, fn, args); }
+        bool function = al_type(*fn) == ATTOLISP_TYPE_FUNCTION;
+        al_hook_call('B', *object, function);
+        *fn = al_apply(root, env, fn, args);
+        al_hook_call('E', *object, function);
+        return *fn;
+    }
+    default:
+        al_error("ERROR:: eval: Unknown tag type: %d\n", al_type(*object));
+    }// end switch
+
+    ///return result; // never reached
+}
+
+
+// ------------------------------------------------------------------
+//              PRIMITIVE FUNCTIONS AND SPECIAL FORMS
+// ------------------------------------------------------------------
+// Builtins that take evaluated arguments are written against an argument
+// vector of shadow-stack slots, so the analyzer can call them directly.
+typedef al_object_t* (*al_values_t)(void *root, al_object_t **argv, int argc);
+
+// *****
+static al_object_t* al_call_values(
+    void *root, al_object_t **env, al_object_t **list, al_values_t fn
+){
+    int argc = 0;
+    for(al_object_t *pointer = *list; al_type(pointer) == ATTOLISP_TYPE_CELL;
+        pointer = pointer->cdr
+    ){ argc++; }
+    al_object_t **argv = al_root_reserve(root, argc + 1);
+    root = argv + argc + 1;
+    argv[argc] = *list;
+    for(int i=0; i < argc; i++){
+        argv[i] = argv[argc]->car;
+        argv[i] = al_eval(root, env, &argv[i]);
+        argv[argc] = argv[argc]->cdr;
+    }
+
+    return fn(root, argv, argc);
+}
+
+// *****
+static al_object_t* al_values_cons(void *root, al_object_t **argv, int argc){
+    if(argc != 2){ al_error("Malformed cons"); }
+    return al_new_cons(root, &argv[0], &argv[1]);
+}
+
+// *****
+static al_object_t* al_values_car(void *root, al_object_t **argv, int argc){
+    (void)root;
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_CELL){
+        al_error("Malformed car");
+    }
+    return argv[0]->car;
+}
+
+// *****
+static al_object_t* al_values_cdr(void *root, al_object_t **argv, int argc){
+    (void)root;
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_CELL){
+        al_error("Malformed cdr");
+    }
+    return argv[0]->cdr;
+}
+
+// *****
+static al_object_t* al_values_setcar(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    if(argc != 2 || al_type(argv[0]) != ATTOLISP_TYPE_CELL){
+        al_error("Malformed setcar");
+    }
+    argv[0]->car = argv[1];
+    return argv[0];
+}
+
+// *****
+static al_object_t* al_values_plus(void *root, al_object_t **argv, int argc){
+    int result = 0;
+    for(int i=0; i < argc; i++){
+        if(al_type(argv[i]) != ATTOLISP_TYPE_INT){
+            al_error("+ takes only numbers");
+        }
+        result += argv[i]->value;
+    }
+
+    return al_new_int(root, result);
+}
+
+// *****
+static al_object_t* al_values_minus(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc == 0){ al_error("Malformed -"); }
+    for(int i=0; i < argc; i++){
+        if(al_type(argv[i]) != ATTOLISP_TYPE_INT){
+            al_error("- takes only numbers");
+        }
+    }
+    if(argc == 1){
+        return al_new_int(root, -argv[0]->value);
+    }
+    int result = argv[0]->value;
+    for(int i=1; i < argc; i++){ result -= argv[i]->value; }
+
+    return al_new_int(root, result);
+}
+
+// *****
+static al_object_t* al_values_lt(void *root, al_object_t **argv, int argc){
+    (void)root;
+    if(argc != 2){ al_error("Malformed <"); }
+    if(al_type(argv[0]) != ATTOLISP_TYPE_INT ||
+        al_type(argv[1]) != ATTOLISP_TYPE_INT
+    ){
+        al_error("< takes only numbers");
+    }
+
+    return argv[0]->value < argv[1]->value ? al_true : al_nil;
+}
+
+// *****
+static al_object_t* al_values_number_eq(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    if(argc != 2){ al_error("Malformed ="); }
+    if(al_type(argv[0]) != ATTOLISP_TYPE_INT ||
+        al_type(argv[1]) != ATTOLISP_TYPE_INT
+    ){
+        al_error("= only takes numbers");
+    }
+
+    return argv[0]->value == argv[1]->value ? al_true : al_nil;
+}
+
+// *****
+static al_object_t* al_values_eq(void *root, al_object_t **argv, int argc){
+    (void)root;
+    if(argc != 2){ al_error("Malformed eq"); }
+    return argv[0] == argv[1] ? al_true : al_nil;
+}
+
+// *****
+static al_object_t* al_primitive_quote(
+    void *root, al_object_t **env, al_object_t **list
+){
+    if(al_length(*list) != 1){ al_error("Malformed quote");}
+    return (*list)->car;
+}
+
+// *****
+static al_object_t* al_primitive_cons(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_cons);
+}
+
+// *****
+static al_object_t* al_primitive_car(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_car);
+}
+
+static al_object_t* al_primitive_cdr(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_cdr);
+}
+
+// *****
+static al_object_t* al_primitive_setq(
+    void *root, al_object_t **env, al_object_t **list
+){
+    if(al_length(*list) != 2 || al_type((*list)->car) != ATTOLISP_TYPE_SYMBOL){
+        al_error("Malformed setq");
+    }
+
+    AL_DEFINE2(bind, value);
+    *bind = al_find(env, (*list)->car);
+    if(!*bind){
+        al_error("ERROR: Unbound variable %s", (*list)->car->name);
+    }
+    *value = (*list)->cdr->car;
+    *value = al_eval(root, env, value);
+    (*bind)->cdr = *value;
+
+    return *value;
+}
+
+// *****
+static al_object_t* al_primitive_setcar(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_setcar);
+}
+
+// *****
+static al_object_t* al_primitive_while(
+    void *root, al_object_t **env, al_object_t **list
+){
+    if(al_length(*list) < 2){
+        al_error("ERROR: Malformed while");
+    }
+    AL_DEFINE2(cond, exprs);
+    *cond = (*list)->car;
+    while(al_eval(root, env, cond) != al_nil){
+        al_step();
+        *exprs = (*list)->cdr;
+        al_eval_list(root, env, exprs);
+    }
+
+    return al_nil;
+}
+
+// *****
+static al_object_t* al_primitive_gensym(
+    void *root, al_object_t **env, al_object_t **list
+){
+    static int count = 0;
+    char buffer[10];
+    snprintf(buffer, sizeof(buffer), "G__%d", count++);
+    return al_new_symbol(root, buffer);
+}
+
+// *****
+static al_object_t* al_primitive_plus(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_plus);
+}
+
+static al_object_t* al_primitive_minus(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_minus);
+}
+
+
+// *****
+static al_object_t* al_primitive_lt(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_lt);
+}
+
+// *****
+static al_object_t* al_handle_function(
+    void *root, al_object_t **env, al_object_t **list, int type
+){
+    if(al_type(*list) != ATTOLISP_TYPE_CELL ||
+        !al_is_list((*list)->car) ||
+        al_type((*list)->cdr) != ATTOLISP_TYPE_CELL
+    ){
+        al_error("Malformed lambda");
+    }
+    al_object_t *pointer = (*list)->car;
+    for(; al_type(pointer) == ATTOLISP_TYPE_CELL; pointer = pointer->cdr){
+        if(al_type(pointer->car) != ATTOLISP_TYPE_SYMBOL){
+            al_error("Parameter must be a symbol");
+        }
+    }
+    if(pointer != al_nil && al_type(pointer) != ATTOLISP_TYPE_SYMBOL){
+        al_error("Parameter must be a symbol");
+    }
+    AL_DEFINE2(params, body);
+    *params = (*list)->car;
+    *body = (*list)->cdr;
+    return al_new_function(root, env, type, params, body);
+}
+
+static al_object_t* al_primitive_lambda(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_handle_function(root, env, list, ATTOLISP_TYPE_FUNCTION);
+}
+
+static al_object_t* al_handle_defun(
+    void *root, al_object_t **env, al_object_t **list, int type
+){
+    if(al_type((*list)->car) != ATTOLISP_TYPE_SYMBOL ||
+        al_type((*list)->cdr) != ATTOLISP_TYPE_CELL
+    ){
+        al_error("Malformed defun");
+    }
+
+    AL_DEFINE3(fn, symbol, rest);
+    *symbol = (*list)->car;
+    *rest = (*list)->cdr;
+    *fn = al_handle_function(root, env, rest, type);
+    al_add_variable(root, env, symbol, fn);
+
+    return *fn;
+}
+
+static al_object_t* al_primitive_defun(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_handle_defun(root, env, list, ATTOLISP_TYPE_FUNCTION);
+}
+
+static al_code_t* al_code_new_function(
+    al_object_t *params, al_object_t *body, al_code_t *outer,
+    al_object_t *captured);
+
+// Gives the function object `fn` a result cache of its own.
+static void al_memoize(al_object_t *fn){
+    if(!fn->code){
+        fn->code = al_code_new_function(fn->params, fn->body, NULL, NULL);
+    }
+    al_code_t *code = fn->code;
+    if(!code->memo){ code->memo = al_memo_new(); }
+}
+
+// (defmemo name params body...) defines a function like defun, whose
+// recursive calls go through the cache as well.
+static al_object_t* al_primitive_defmemo(
+    void *root, al_object_t **env, al_object_t **list
+){
+    al_object_t *fn = al_handle_defun(
+        root, env, list, ATTOLISP_TYPE_FUNCTION);
+    al_memoize(fn);
+    return fn;
+}
+
+// (memoize fn) returns a memoized copy of the closure `fn`.
+static al_object_t* al_values_memoize(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_FUNCTION){
+        al_error("Malformed memoize");
+    }
+    AL_DEFINE3(params, body, env);
+    *params = argv[0]->params;
+    *body = argv[0]->body;
+    *env = argv[0]->env;
+    al_object_t *fn = al_new_function(
+        root, env, ATTOLISP_TYPE_FUNCTION, params, body);
+    al_memoize(fn);
+    return fn;
+}
+
+// (memo-stats fn) returns (hits . misses), or () if `fn` is not memoized.
+static al_object_t* al_values_memo_stats(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc != 1){ al_error("Malformed memo-stats"); }
+    al_memo_t *memo = al_type(argv[0]) == ATTOLISP_TYPE_FUNCTION ?
+        al_memo_of(argv[0]) : NULL;
+    if(!memo){ return al_nil; }
+    AL_DEFINE2(hits, misses);
+    *hits = al_new_int(root, (int)memo->hits);
+    *misses = al_new_int(root, (int)memo->misses);
+    return al_new_cons(root, hits, misses);
+}
+
+// (trace-flush) writes the trace file now; () when tracing is off.
+static al_object_t* al_values_trace_flush(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root; (void)argv;
+    if(argc != 0){ al_error("Malformed trace-flush"); }
+    return al_trace_flush() ? al_true : al_nil;
+}
+
+// (heap-dump "file") writes what survives a collection to `file`.
+static al_object_t* al_values_heap_dump(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_SYMBOL){
+        al_error("Malformed heap-dump");
+    }
+    char path[ATTOLISP_MAXLEN+1];
+    snprintf(path, sizeof(path), "%s", argv[0]->name);
+    al_heap_dump(root, path);
+    return al_true;
+}
+
+static al_object_t* al_primitive_memoize(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_memoize);
+}
+
+static al_object_t* al_primitive_memo_stats(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_memo_stats);
+}
+
+static al_object_t* al_primitive_heap_dump(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_heap_dump);
+}
+
+static al_object_t* al_primitive_trace_flush(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_trace_flush);
+}
+
+static al_object_t* al_primitive_define(
+    void *root, al_object_t **env, al_object_t **list
+){
+    if(al_length(*list) != 2 || al_type((*list)->car) != ATTOLISP_TYPE_SYMBOL){
+        al_error("Malformed define");
+    }
+    AL_DEFINE2(symbol, value);
+    *symbol = (*list)->car;
+    *value = (*list)->cdr->car;
+    *value = al_eval(root, env, value);
+    al_add_variable(root, env, symbol, value);
+
+    return *value;
+}
+
+static al_object_t* al_primitive_defmacro(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_handle_defun(root, env, list, ATTOLISP_TYPE_MACRO);
+}
+
+
+static al_object_t* al_primitive_macroexpand(
+    void *root, al_object_t **env, al_object_t **list
+){
+    if(al_length(*list) != 1){
+        al_error("Malformed macroexpand");
+    }
+    AL_DEFINE1(body);
+    *body = (*list)->car;
+    return al_macroexpand(root, env, body);
+}
+
+
+static al_object_t* al_primitive_println(
+    void *root, al_object_t **env, al_object_t **list
+){
+    AL_DEFINE1(tmp);
+    *tmp = (*list)->car;
+    al_print(al_eval(root, env, tmp));
+    printf("\n");
+    return al_nil;
+}
+
+static al_object_t* al_primitive_if(
+    void *root, al_object_t **env, al_object_t **list
+){
+    if(al_length(*list) < 2){
+        al_error("Malformed if");
+    }
+    AL_DEFINE3(cond, here, there);
+    *cond = (*list)->car;
+    *cond = al_eval(root, env, cond);
+    if(*cond != al_nil){
+        *here = (*list)->cdr->car;
+        return al_eval(root, env, here);
+    }
+    *there = (*list)->cdr->cdr;
+    return *there == al_nil ? al_nil : al_progn(root, env, there);
+}
+
+static al_object_t* al_primitive_number_eq(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_number_eq);
+}
+
+static al_object_t* al_primitive_eq(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_eq);
+}
+
+// -------------------------------
+// -------- LIST LIBRARY ---------
+// -------------------------------
+// The usual list functions, walking the lists in C instead of through one
+// interpreted call per element. Results are built with al_new_list.
+static al_object_t* al_funcall_values(
+    void *root, al_object_t **fn, al_object_t **argv, int argc);
+
+// *****
+static al_object_t* al_values_length(
+    void *root, al_object_t **argv, int argc
+){
+    int len = argc == 1 ? al_length(argv[0]) : -1;
+    if(len < 0){ al_error("Malformed length"); }
+    return al_new_int(root, len);
+}
+
+// *****
+static al_object_t* al_values_reverse(
+    void *root, al_object_t **argv, int argc
+){
+    int len = argc == 1 ? al_length(argv[0]) : -1;
+    if(len < 0){ al_error("Malformed reverse"); }
+    al_object_t *cells = al_new_list(root, (size_t)len);
+    al_object_t *result = al_nil;
+    for(al_object_t *pointer = argv[0]; pointer != al_nil;
+        pointer = pointer->cdr
+    ){
+        al_object_t *cell = cells;
+        cells = cells->cdr;
+        cell->car = pointer->car;
+        cell->cdr = result;
+        result = cell;
+    }
+    return result;
+}
+
+// Copies every argument but the last, which the result shares.
+static al_object_t* al_values_append(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc == 0){ return al_nil; }
+    size_t total = 0;
+    for(int i=0; i < argc - 1; i++){
+        int len = al_length(argv[i]);
+        if(len < 0){ al_error("Malformed append"); }
+        total += (size_t)len;
+    }
+    if(total == 0){ return argv[argc - 1]; }
+
+    al_object_t *result = al_new_list(root, total);
+    al_object_t *cell = result;
+    for(int i=0; i < argc - 1; i++){
+        for(al_object_t *pointer = argv[i]; pointer != al_nil;
+            pointer = pointer->cdr
+        ){
+            cell->car = pointer->car;
+            if(cell->cdr == al_nil){ cell->cdr = argv[argc - 1]; }
+            cell = cell->cdr;
+        }
+    }
+    return result;
+}
+
+// *****
+static al_object_t* al_values_nth(void *root, al_object_t **argv, int argc){
+    (void)root;
+    if(argc != 2 || al_type(argv[0]) != ATTOLISP_TYPE_INT ||
+        argv[0]->value < 0 || !al_is_list(argv[1])
+    ){
+        al_error("Malformed nth");
+    }
+    al_object_t *pointer = argv[1];
+    for(int i = argv[0]->value; 0 < i && al_type(pointer) == ATTOLISP_TYPE_CELL;
+        i--
+    ){
+        pointer = pointer->cdr;
+    }
+    return al_type(pointer) == ATTOLISP_TYPE_CELL ? pointer->car : al_nil;
+}
+
+// *****
+static al_object_t* al_values_member(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    if(argc != 2 || !al_is_list(argv[1])){ al_error("Malformed member"); }
+    for(al_object_t *pointer = argv[1]; al_type(pointer) == ATTOLISP_TYPE_CELL;
+        pointer = pointer->cdr
+    ){
+        if(al_eql(pointer->car, argv[0])){ return pointer; }
+    }
+    return al_nil;
+}
+
+// *****
+static al_object_t* al_values_assoc(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    if(argc != 2 || !al_is_list(argv[1])){ al_error("Malformed assoc"); }
+    for(al_object_t *pointer = argv[1]; al_type(pointer) == ATTOLISP_TYPE_CELL;
+        pointer = pointer->cdr
+    ){
+        al_object_t *pair = pointer->car;
+        if(al_type(pair) == ATTOLISP_TYPE_CELL && al_eql(pair->car, argv[0])){
+            return pair;
+        }
+    }
+    return al_nil;
+}
+
+// The result cells are allocated before the first call. `fn` may allocate,
+// so the walk goes through root slots.
+static al_object_t* al_values_map(void *root, al_object_t **argv, int argc){
+    int len = argc == 2 ? al_length(argv[1]) : -1;
+    if(len < 0){ al_error("Malformed map"); }
+    AL_DEFINE4(result, cell, pointer, value);
+    *result = al_new_list(root, (size_t)len);
+    *cell = *result;
+    for(*pointer = argv[1]; *pointer != al_nil && *cell != al_nil;
+        *pointer = (*pointer)->cdr, *cell = (*cell)->cdr
+    ){
+        *value = (*pointer)->car;
+        *value = al_funcall_values(root, &argv[0], value, 1);
+        (*cell)->car = *value;
+    }
+    return *result;
+}
+
+// Follows the a/d letters of `name`, a c[ad]+r, from right to left.
+static al_object_t* al_cxr(al_object_t **argv, int argc, const char *name){
+    if(argc != 1){ al_error("Malformed %s", name); }
+    al_object_t *object = argv[0];
+    for(size_t i = strlen(name) - 2; 0 < i; i--){
+        if(al_type(object) != ATTOLISP_TYPE_CELL){
+            al_error("Malformed %s", name);
+        }
+        object = name[i] == 'a' ? object->car : object->cdr;
+    }
+    return object;
+}
+
+#define AL_CXR(name)                                                \
+    static al_object_t* al_values_##name(                           \
+        void *root, al_object_t **argv, int argc                    \
+    ){                                                              \
+        (void)root;                                                 \
+        return al_cxr(argv, argc, #name);                           \
+    }
+
+AL_CXR(caar) AL_CXR(cadr) AL_CXR(cdar) AL_CXR(cddr)
+AL_CXR(caaar) AL_CXR(caadr) AL_CXR(cadar) AL_CXR(caddr)
+AL_CXR(cdaar) AL_CXR(cdadr) AL_CXR(cddar) AL_CXR(cdddr)
+#undef AL_CXR
+
+// Primitive entry points of the library, evaluating their arguments.
+#define AL_LIST_PRIMITIVE(name)                                     \
+    static al_object_t* al_primitive_##name(                        \
+        void *root, al_object_t **env, al_object_t **list           \
+    ){                                                              \
+        return al_call_values(root, env, list, al_values_##name);   \
+    }
+
+AL_LIST_PRIMITIVE(length) AL_LIST_PRIMITIVE(reverse)
+AL_LIST_PRIMITIVE(append) AL_LIST_PRIMITIVE(nth)
+AL_LIST_PRIMITIVE(member) AL_LIST_PRIMITIVE(assoc) AL_LIST_PRIMITIVE(map)
+AL_LIST_PRIMITIVE(caar) AL_LIST_PRIMITIVE(cadr)
+AL_LIST_PRIMITIVE(cdar) AL_LIST_PRIMITIVE(cddr)
+AL_LIST_PRIMITIVE(caaar) AL_LIST_PRIMITIVE(caadr)
+AL_LIST_PRIMITIVE(cadar) AL_LIST_PRIMITIVE(caddr)
+AL_LIST_PRIMITIVE(cdaar) AL_LIST_PRIMITIVE(cdadr)
+AL_LIST_PRIMITIVE(cddar) AL_LIST_PRIMITIVE(cdddr)
+#undef AL_LIST_PRIMITIVE
+
+// -------------------------------
+// ------ BINARY S-EXPRESSIONS ---
+// -------------------------------
+// (save-binary obj "file") writes a tree of cells, integers and symbols in a
+// form (load-binary "file") can map and rebuild without parsing:
+//
+//   header | links: uint32 car, cdr per cell | int32 per int | names
+//
+// A link is an index tagged in its low two bits with the table it refers
+// to; names are the symbols' NUL-terminated names, so each symbol is stored
+// and interned once. Shared and circular structure is kept. The file is in
+// the byte order of the machine that wrote it.
+#define AL_BIN_MAGIC    0x42534c41u     // "ALSB"
+#define AL_BIN_VERSION  1
+#define AL_BIN_MAX      ((size_t)1 << 30)
+
+enum { AL_BIN_CELL, AL_BIN_INT, AL_BIN_SYMBOL, AL_BIN_CONSTANT };
+#define AL_BIN_NIL      ((0u << 2) | AL_BIN_CONSTANT)
+#define AL_BIN_TRUE     ((1u << 2) | AL_BIN_CONSTANT)
+
+typedef struct al_bin_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t root;      // link to the saved object
+    uint32_t nsymbols;
+    uint64_t ncells;
+    uint64_t nints;
+    uint64_t names;     // bytes
+} al_bin_header_t;
+
+// objects met so far while saving, with the link each got
+typedef struct al_saver_t {
+    al_object_t **keys;
+    uint32_t *links;
+    size_t capacity;
+    size_t count[AL_BIN_CONSTANT];
+    al_object_t **objects[AL_BIN_CONSTANT];
+    size_t room[AL_BIN_CONSTANT];
+} al_saver_t;
+
+// *****
+static void al_saver_push(al_saver_t *saver, int table, al_object_t *object){
+    if(saver->count[table] == saver->room[table]){
+        saver->room[table] = saver->room[table] ? saver->room[table] * 2 : 256;
+        saver->objects[table] = realloc(saver->objects[table],
+            saver->room[table] * sizeof(al_object_t*));
+        if(!saver->objects[table]){ al_error("save-binary: out of memory"); }
+    }
+    saver->objects[table][saver->count[table]++] = object;
+}
+
+// *****
+static void al_saver_grow(al_saver_t *saver){
+    al_object_t **keys = saver->keys;
+    uint32_t *links = saver->links;
+    size_t capacity = saver->capacity;
+    saver->capacity = capacity ? capacity * 2 : 1024;
+    saver->keys = calloc(saver->capacity, sizeof(al_object_t*));
+    saver->links = malloc(saver->capacity * sizeof(uint32_t));
+    if(!saver->keys || !saver->links){ al_error("save-binary: out of memory"); }
+    for(size_t i=0; i < capacity; i++){
+        if(!keys[i]){ continue; }
+        size_t slot = ((uintptr_t)keys[i] >> 3) & (saver->capacity - 1);
+        while(saver->keys[slot]){ slot = (slot + 1) & (saver->capacity - 1); }
+        saver->keys[slot] = keys[i];
+        saver->links[slot] = links[i];
+    }
+    free(keys);
+    free(links);
+}
+
+// Returns the link of `object`, giving it the next index of its table the
+// first time it is met.
+static uint32_t al_saver_link(al_saver_t *saver, al_object_t *object){
+    if(object == al_nil){ return AL_BIN_NIL; }
+    if(object == al_true){ return AL_BIN_TRUE; }
+    int table;
+    switch(al_type(object)){
+    case ATTOLISP_TYPE_CELL: table = AL_BIN_CELL; break;
+    case ATTOLISP_TYPE_INT: table = AL_BIN_INT; break;
+    case ATTOLISP_TYPE_SYMBOL:
+        // load-binary takes no longer name
+        if(ATTOLISP_MAXLEN < strlen(object->name)){
+            al_error("ERROR: save-binary: symbol name longer than %d bytes",
+                ATTOLISP_MAXLEN);
+        }
+        table = AL_BIN_SYMBOL;
+        break;
+    default:
+        al_error("ERROR: save-binary: cannot save a %s",
+            al_type_names[al_type(object)]);
+        return AL_BIN_NIL; // never reached
+    }
+    size_t total = saver->count[0] + saver->count[1] + saver->count[2];
+    if(saver->capacity <= total * 2){ al_saver_grow(saver); }
+    size_t slot = ((uintptr_t)object >> 3) & (saver->capacity - 1);
+    for(; saver->keys[slot]; slot = (slot + 1) & (saver->capacity - 1)){
+        if(saver->keys[slot] == object){ return saver->links[slot]; }
+    }
+    if(AL_BIN_MAX <= saver->count[table]){
+        al_error("ERROR: save-binary: too many objects");
+    }
+    uint32_t link = (uint32_t)(saver->count[table] << 2) | (uint32_t)table;
+    saver->keys[slot] = object;
+    saver->links[slot] = link;
+    al_saver_push(saver, table, object);
+    return link;
+}
+
+// Saves `object` to `path`. Nothing is allocated in the heap meanwhile, so
+// the objects stay where they are.
+static void al_save_binary(al_object_t *object, const char *path){
+    al_saver_t saver = { 0 };
+    al_bin_header_t header = {
+        .magic = AL_BIN_MAGIC, .version = AL_BIN_VERSION
+    };
+    header.root = al_saver_link(&saver, object);
+    // cells are numbered as they are met, so this walks them breadth first
+    uint32_t *links = NULL;
+    for(size_t i=0; i < saver.count[AL_BIN_CELL]; i++){
+        if(i % 1024 == 0){
+            links = realloc(links, (i + 1024) * 2 * sizeof(uint32_t));
+            if(!links){ al_error("save-binary: out of memory"); }
+        }
+        al_object_t *cell = saver.objects[AL_BIN_CELL][i];
+        links[2*i] = al_saver_link(&saver, cell->car);
+        links[2*i + 1] = al_saver_link(&saver, cell->cdr);
+    }
+    header.ncells = saver.count[AL_BIN_CELL];
+    header.nints = saver.count[AL_BIN_INT];
+    header.nsymbols = (uint32_t)saver.count[AL_BIN_SYMBOL];
+    for(size_t i=0; i < header.nsymbols; i++){
+        header.names += strlen(saver.objects[AL_BIN_SYMBOL][i]->name) + 1;
+    }
+
+    FILE *out = fopen(path, "wb");
+    if(!out){ al_error("ERROR: cannot open %s", path); }
+    fwrite(&header, sizeof(header), 1, out);
+    if(header.ncells){
+        fwrite(links, 2 * sizeof(uint32_t), header.ncells, out);
+    }
+    for(size_t i=0; i < header.nints; i++){
+        int32_t value = saver.objects[AL_BIN_INT][i]->value;
+        fwrite(&value, sizeof(value), 1, out);
+    }
+    for(size_t i=0; i < header.nsymbols; i++){
+        const char *name = saver.objects[AL_BIN_SYMBOL][i]->name;
+        fwrite(name, 1, strlen(name) + 1, out);
+    }
+    if(fclose(out) != 0){ al_error("ERROR: cannot write %s", path); }
+
+    free(links);
+    free(saver.keys);
+    free(saver.links);
+    for(int table=0; table < AL_BIN_CONSTANT; table++){
+        free(saver.objects[table]);
+    }
+}
+
+// Tables of a file being loaded.
+typedef struct al_loader_t {
+    const al_bin_header_t *header;
+    uint8_t *cells;
+    uint8_t *ints;
+    al_object_t **symbols;
+} al_loader_t;
+
+// *****
+static bool al_loader_valid(const al_bin_header_t *header, uint32_t link){
+    size_t index = link >> 2;
+    switch(link & 3){
+    case AL_BIN_CELL: return index < header->ncells;
+    case AL_BIN_INT: return index < header->nints;
+    case AL_BIN_SYMBOL: return index < header->nsymbols;
+    default: return link == AL_BIN_NIL || link == AL_BIN_TRUE;
+    }
+}
+
+// Object a valid link refers to.
+static inline al_object_t* al_loader_object(
+    al_loader_t *loader, uint32_t link
+){
+    size_t index = link >> 2;
+    switch(link & 3){
+    case AL_BIN_CELL:
+        return al_slot_object(ATTOLISP_TYPE_CELL,
+            loader->cells + index * al_kind_size[ATTOLISP_TYPE_CELL]);
+    case AL_BIN_INT:
+        return al_slot_object(ATTOLISP_TYPE_INT,
+            loader->ints + index * al_kind_size[ATTOLISP_TYPE_INT]);
+    case AL_BIN_SYMBOL:
+        return loader->symbols[index];
+    default:
+        return link == AL_BIN_NIL ? al_nil : al_true;
+    }
+}
+
+// Claims a run of fresh pages for `count` objects of `kind` and leaves the
+// rest of the run to the bump allocator.
+static uint8_t* al_claim_run(int kind, size_t count){
+    size_t bytes = count * al_kind_size[kind];
+    size_t pages = al_round_up(bytes, AL_PAGE_SIZE) / AL_PAGE_SIZE;
+    uint8_t *run = al_page_claim(kind, pages);
+    al_bump[kind].top = run + bytes;
+    al_bump[kind].limit = run + pages * AL_PAGE_SIZE;
+    return run;
+}
+
+// Checks that the header matches the size of the file and that every link
+// and name stays within it.
+static bool al_loader_check(const uint8_t *data, size_t size){
+    const al_bin_header_t *header = (const al_bin_header_t*)data;
+    if(size < sizeof(*header) || header->magic != AL_BIN_MAGIC ||
+        header->version != AL_BIN_VERSION ||
+        AL_BIN_MAX < header->ncells || AL_BIN_MAX < header->nints
+    ){
+        return false;
+    }
+    // Each part is checked against what is left, so a crafted count cannot
+    // wrap the sum around.
+    size_t left = size - sizeof(*header);
+    uint64_t cells = header->ncells * 2 * sizeof(uint32_t);
+    uint64_t ints = header->nints * sizeof(int32_t);
+    if(left < cells){ return false; }
+    left -= cells;
+    if(left < ints){ return false; }
+    left -= ints;
+    if(left != header->names){ return false; }
+    const uint32_t *links = (const uint32_t*)(header + 1);
+    if(!al_loader_valid(header, header->root)){ return false; }
+    for(size_t i=0; i < 2 * header->ncells; i++){
+        if(!al_loader_valid(header, links[i])){ return false; }
+    }
+    const char *name = (const char*)(links + 2 * header->ncells) +
+        header->nints * sizeof(int32_t);
+    const char *end = (const char*)data + size;
+    for(uint32_t i=0; i < header->nsymbols; i++){
+        size_t len = strnlen(name, (size_t)(end - name));
+        if(name + len == end || ATTOLISP_MAXLEN < len){ return false; }
+        name += len + 1;
+    }
+    return true;
+}
+
+// Maps `path` and rebuilds what it holds. The symbols are interned first;
+// then room for every cell and integer is made at once, so the collector
+// runs at most once and the objects are laid out in two runs of pages that
+// are filled straight from the file.
+static al_object_t* al_load_binary(void *root, const char *path){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){ al_error("ERROR: cannot open %s", path); }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        al_error("ERROR: load-binary: %s is not a binary file", path);
+    }
+    size_t size = (size_t)st.st_size;
+    uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){ al_error("ERROR: cannot map %s", path); }
+    madvise(data, size, MADV_SEQUENTIAL);
+    if(!al_loader_check(data, size)){
+        munmap(data, size);
+        al_error("ERROR: load-binary: %s is not a binary file", path);
+    }
+
+    al_loader_t loader = { .header = (const al_bin_header_t*)data };
+    const al_bin_header_t *header = loader.header;
+    const uint32_t *links = (const uint32_t*)(header + 1);
+    const int32_t *values = (const int32_t*)(links + 2 * header->ncells);
+    const char *name = (const char*)(values + header->nints);
+
+    loader.symbols = al_root_reserve(root, header->nsymbols);
+    root = loader.symbols + header->nsymbols;
+    for(uint32_t i=0; i < header->nsymbols; i++){
+        loader.symbols[i] = al_intern(root, (char*)name);
+        name += strlen(name) + 1;
+    }
+
+    size_t bytes = al_round_up(
+        header->ncells * al_kind_size[ATTOLISP_TYPE_CELL], AL_PAGE_SIZE) +
+        al_round_up(header->nints * al_kind_size[ATTOLISP_TYPE_INT],
+            AL_PAGE_SIZE);
+    if((al_gc_always && !al_gc_running) || al_memsize < al_mem_used + bytes){
+        attolisp_gc(root);
+    }
+    if(al_memsize < al_mem_used + bytes){
+        munmap(data, size);
+        al_error("Memory exhausted");
+    }
+    if(header->nints){
+        loader.ints = al_claim_run(ATTOLISP_TYPE_INT, header->nints);
+        for(size_t i=0; i < header->nints; i++){
+            al_loader_object(&loader, (uint32_t)(i << 2) | AL_BIN_INT)->value =
+                values[i];
+        }
+    }
+    if(header->ncells){
+        loader.cells = al_claim_run(ATTOLISP_TYPE_CELL, header->ncells);
+    }
+    for(size_t i=0; i < header->ncells; i++){
+        al_object_t *cell = al_loader_object(
+            &loader, (uint32_t)(i << 2) | AL_BIN_CELL);
+        cell->car = al_loader_object(&loader, links[2*i]);
+        cell->cdr = al_loader_object(&loader, links[2*i + 1]);
+    }
+    al_charge(bytes);
+    if(al_profiling){
+        al_profile_alloc(ATTOLISP_TYPE_CELL, header->ncells,
+            header->ncells * al_kind_size[ATTOLISP_TYPE_CELL]);
+        al_profile_alloc(ATTOLISP_TYPE_INT, header->nints,
+            header->nints * al_kind_size[ATTOLISP_TYPE_INT]);
+    }
+    al_object_t *result = al_loader_object(&loader, header->root);
+    munmap(data, size);
+    return result;
+}
+
+// (save-binary obj "file") returns obj.
+static al_object_t* al_values_save_binary(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    if(argc != 2 || al_type(argv[1]) != ATTOLISP_TYPE_SYMBOL){
+        al_error("Malformed save-binary");
+    }
+    al_save_binary(argv[0], argv[1]->name);
+    return argv[0];
+}
+
+// *****
+static al_object_t* al_values_load_binary(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_SYMBOL){
+        al_error("Malformed load-binary");
+    }
+    char path[ATTOLISP_MAXLEN+1];
+    snprintf(path, sizeof(path), "%s", argv[0]->name);
+    return al_load_binary(root, path);
+}
+
+static al_object_t* al_primitive_save_binary(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_save_binary);
+}
+
+static al_object_t* al_primitive_load_binary(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_load_binary);
+}
+
+// -------------------------------
+// -------- GREEN THREADS --------
+// -------------------------------
+// (spawn fn) starts a task calling fn with no arguments. Tasks share one OS
+// thread and switch only where one of them has to wait: in (yield), in (recv
+// ch) on an empty channel, in (sleep ms), and in reading or writing a
+// descriptor that is not ready, where the task is parked on an epoll set.
+// The main program is a task too; the others run while it waits, and once
+// the input ends until they are all done or stuck. A task that fails prints
+// the error and ends, and the others go on.
+//
+// Each task has one mapping holding a guard page, its C stack, its root
+// slots and its frame stack, with ATTOLISP_TASK_STACK bytes of C stack. It
+// is reserved up front and backed only as it is used, so a task waiting on
+// I/O costs a few pages.
+#define ATTOLISP_TASK_STACK     ((size_t)8 << 20)
+#define AL_TASK_ROOT_SLOTS      ((size_t)1 << 16)
+#define AL_TASK_FRAME_STACK     ((size_t)1 << 20)
+#define AL_TASK_CACHE           64      // finished tasks kept for reuse
+#define AL_TASK_EVENTS          64
+
+enum { AL_TASK_RUNNING, AL_TASK_READY, AL_TASK_WAITING, AL_TASK_DONE };
+
+static size_t al_task_stack = ATTOLISP_TASK_STACK;
+static int al_task_count;
+static al_task_t *al_ready_head;
+static al_task_t *al_ready_tail;
+static al_task_t *al_receivers;     // newest first
+static al_task_t *al_task_done;     // finished, freed by the next task run
+static al_task_t *al_task_free;
+static int al_task_nfree;
+// sleeping tasks, a binary heap on `wake`
+static al_task_t **al_sleepers;
+static size_t al_nsleepers;
+static size_t al_sleepers_capacity;
+static int al_epoll = -1;
+static int al_io_waiters;
+// set when the main task is resumed because nothing else can run
+static bool al_task_stuck;
+
+// *****
+static void al_task_ready(al_task_t *task){
+    task->state = AL_TASK_READY;
+    task->next = NULL;
+    if(al_ready_tail){ al_ready_tail->next = task; }
+    else{ al_ready_head = task; }
+    al_ready_tail = task;
+}
+
+// *****
+static void al_task_save(al_task_t *task, void *root){
+    task->roots = al_root_stack;
+    task->root_top = root;
+    task->root_limit = al_root_limit;
+    task->frame_base = al_frame_base;
+    task->frame_top = al_frame_top;
+    task->frame_limit = al_frame_limit;
+    task->sites = al_site_stack;
+    task->site_depth = al_site_depth;
+    task->site_capacity = al_site_capacity;
+    task->fuel = al_fuel;
+    task->alloc_left = al_alloc_left;
+    task->depth_left = al_depth_left;
+    task->error_handler = al_error_handler;
+}
+
+// *****
+static void al_task_load(al_task_t *task){
+    al_root_stack = task->roots;
+    al_root_limit = task->root_limit;
+    al_frame_base = task->frame_base;
+    al_frame_top = task->frame_top;
+    al_frame_limit = task->frame_limit;
+    al_site_stack = task->sites;
+    al_site_depth = task->site_depth;
+    al_site_capacity = task->site_capacity;
+    al_fuel = task->fuel;
+    al_alloc_left = task->alloc_left;
+    al_depth_left = task->depth_left;
+    al_error_handler = task->error_handler;
+    task->state = AL_TASK_RUNNING;
+    al_task_current = task;
+}
+
+// *****
+static void al_task_release(al_task_t *task){
+    free(task->sites);
+    if(al_task_nfree < AL_TASK_CACHE){
+        task->next = al_task_free;
+        al_task_free = task;
+        al_task_nfree++;
+        return;
+    }
+    munmap(task->mapping, AL_PAGE_SIZE + al_task_stack +
+        AL_TASK_ROOT_SLOTS * sizeof(al_object_t*) + AL_TASK_FRAME_STACK);
+    free(task);
+}
+
+// Switches to `to`. Returns once something switches back.
+static void al_task_switch(void *root, al_task_t *to){
+    al_task_t *self = al_task_current;
+    al_task_save(self, root);
+    al_task_load(to);
+    swapcontext(&self->context, &to->context);
+    while(al_task_done){
+        al_task_t *task = al_task_done;
+        al_task_done = task->next;
+        al_task_release(task);
+    }
+}
+
+// *****
+static void al_sleepers_push(al_task_t *task){
+    if(al_nsleepers == al_sleepers_capacity){
+        al_sleepers_capacity = al_sleepers_capacity ?
+            al_sleepers_capacity * 2 : 64;
+        al_sleepers = realloc(al_sleepers,
+            al_sleepers_capacity * sizeof(al_task_t*));
+        if(!al_sleepers){ al_error("ERROR: out of memory for sleep"); }
+    }
+    size_t at = al_nsleepers++;
+    while(at && task->wake < al_sleepers[(at - 1) / 2]->wake){
+        al_sleepers[at] = al_sleepers[(at - 1) / 2];
+        at = (at - 1) / 2;
+    }
+    al_sleepers[at] = task;
+}
+
+// *****
+static al_task_t* al_sleepers_pop(void){
+    al_task_t *first = al_sleepers[0];
+    al_task_t *last = al_sleepers[--al_nsleepers];
+    size_t at = 0;
+    for(;;){
+        size_t child = 2 * at + 1;
+        if(al_nsleepers <= child){ break; }
+        if(child + 1 < al_nsleepers &&
+            al_sleepers[child + 1]->wake < al_sleepers[child]->wake
+        ){ child++; }
+        if(last->wake <= al_sleepers[child]->wake){ break; }
+        al_sleepers[at] = al_sleepers[child];
+        at = child;
+    }
+    al_sleepers[at] = last;
+    return first;
+}
+
+// Waits for a descriptor or the first sleeper, and queues what is ready.
+static void al_task_poll(void){
+    int timeout = -1;
+    if(al_nsleepers){
+        uint64_t now = al_trace_clock(), wake = al_sleepers[0]->wake;
+        timeout = wake <= now ? 0 : (int)((wake - now + 999999) / 1000000);
+    }
+    if(al_io_waiters){
+        struct epoll_event events[AL_TASK_EVENTS];
+        int count = epoll_wait(al_epoll, events, AL_TASK_EVENTS, timeout);
+        if(count < 0 && errno != EINTR){
+            al_error("ERROR: epoll_wait: %s", strerror(errno));
+        }
+        for(int i=0; i < count; i++){ al_task_ready(events[i].data.ptr); }
+    }else if(0 < timeout){
+        struct timespec pause = {
+            timeout / 1000, (long)(timeout % 1000) * 1000000 };
+        nanosleep(&pause, NULL);
+    }
+    uint64_t now = al_trace_clock();
+    while(al_nsleepers && al_sleepers[0]->wake <= now){
+        al_task_ready(al_sleepers_pop());
+    }
+}
+
+// Runs other tasks until the current one, which has queued or parked
+// itself, is resumed. Returns false in the main task if nothing is left
+// that could resume it.
+static bool al_schedule(void *root){
+    al_task_t *self = al_task_current;
+    for(;;){
+        al_task_t *next = al_ready_head;
+        if(next){
+            al_ready_head = next->next;
+            if(!al_ready_head){ al_ready_tail = NULL; }
+            if(next != self){ al_task_switch(root, next); }
+            else{ self->state = AL_TASK_RUNNING; }
+            if(self == &al_task_main && al_task_stuck){
+                al_task_stuck = false;
+                return false;
+            }
+            return true;
+        }
+        if(al_io_waiters || al_nsleepers){
+            al_task_poll();
+            continue;
+        }
+        if(self == &al_task_main){ return false; }
+        al_task_stuck = true;
+        al_task_switch(root, &al_task_main);
+        return true;
+    }
+}
+
+// Gives the units whose analysis an error cut short the frames pushed by the
+// inlining they were doing back; they are analyzed again on their next call.
+static void al_abandon_analysis(void){
+    for(al_code_t *code = al_codes; code; code = code->next){
+        if(code->inline_depth){
+            code->nframes -= code->inline_depth;
+            memmove(code->frames, code->frames + code->inline_depth,
+                (size_t)code->nframes * sizeof(al_frame_t));
+            code->inline_depth = 0;
+            code->barrier = 0;
+        }
+        code->preparing = false;
+    }
+}
+
+// *****
+static void al_task_exit(void *root){
+    al_task_t *self = al_task_current;
+    self->state = AL_TASK_DONE;
+    self->before->after = self->after;
+    self->after->before = self->before;
+    self->next = al_task_done;
+    al_task_done = self;
+    al_schedule(root);
+}
+
+// First function of every task; its function is in its first root slot.
+// The units it had running when it failed stay marked active, so they are
+// only kept alive longer than needed.
+static void al_task_entry(void){
+    al_task_t *task = al_task_current;
+    void *root = task->roots + 1;
+    jmp_buf handler;
+    if(!setjmp(handler)){
+        al_error_handler = &handler;
+        al_funcall_values(root, task->roots, NULL, 0);
+    }else{
+        al_abandon_analysis();
+    }
+    al_error_handler = NULL;
+    al_task_exit(root);
+}
+
+// *****
+static al_task_t* al_task_new(void){
+    size_t roots = AL_TASK_ROOT_SLOTS * sizeof(al_object_t*);
+    al_task_t *task = al_task_free;
+    if(task){
+        al_task_free = task->next;
+        al_task_nfree--;
+    }else{
+        task = calloc(1, sizeof(al_task_t));
+        if(!task){ al_error("ERROR: out of memory for a task"); }
+        task->mapping = mmap(
+            NULL, AL_PAGE_SIZE + al_task_stack + roots + AL_TASK_FRAME_STACK,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON | MAP_NORESERVE,
+            -1, 0
+        );
+        if(task->mapping == MAP_FAILED ||
+            mprotect(task->mapping, AL_PAGE_SIZE, PROT_NONE) != 0
+        ){
+            al_error("ERROR: cannot allocate a task stack");
+        }
+    }
+    uint8_t *stack = task->mapping + AL_PAGE_SIZE;
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp = stack;
+    task->context.uc_stack.ss_size = al_task_stack;
+    task->context.uc_link = NULL;
+    makecontext(&task->context, al_task_entry, 0);
+    task->id = ++al_task_count;
+    task->roots = (al_object_t**)(stack + al_task_stack);
+    task->root_top = task->roots + 1;
+    task->root_limit = task->roots + AL_TASK_ROOT_SLOTS;
+    task->frame_base = task->frame_top = (uint8_t*)task->root_limit;
+    task->frame_limit = task->frame_base + AL_TASK_FRAME_STACK;
+    task->sites = NULL;
+    task->site_depth = task->site_capacity = 0;
+    task->fuel = al_fuel_limit;
+    task->alloc_left = al_alloc_limit;
+    task->depth_left = al_depth_limit;
+    task->error_handler = NULL;
+    task->channel = NULL;
+    task->fd = -1;
+    task->before = al_task_main.before;
+    task->after = &al_task_main;
+    task->before->after = task;
+    al_task_main.before = task;
+    return task;
+}
+
+// Runs the other tasks until they are all done or stuck.
+static void al_task_drain(void *root){
+    al_task_main.state = AL_TASK_WAITING;
+    al_schedule(root);
+}
+
+// Drops every task but the main one, which must be running.
+static void al_task_kill_all(void){
+    while(al_task_main.after != &al_task_main){
+        al_task_t *task = al_task_main.after;
+        if(0 <= task->fd){ epoll_ctl(al_epoll, EPOLL_CTL_DEL, task->fd, NULL); }
+        task->before->after = task->after;
+        task->after->before = task->before;
+        al_task_release(task);
+    }
+    al_ready_head = al_ready_tail = NULL;
+    al_receivers = NULL;
+    al_nsleepers = 0;
+    al_io_waiters = 0;
+}
+
+// Parks the current task until `fd` is ready for `events`.
+static void al_task_wait_fd(void *root, int fd, uint32_t events){
+    if(al_epoll < 0 && (al_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        al_error("ERROR: epoll_create: %s", strerror(errno));
+    }
+    al_task_t *self = al_task_current;
+    struct epoll_event event = {
+        .events = events | EPOLLONESHOT, .data.ptr = self };
+    if(epoll_ctl(al_epoll, EPOLL_CTL_ADD, fd, &event) != 0){
+        al_error("ERROR: cannot wait on descriptor %d: %s",
+            fd, strerror(errno));
+    }
+    self->fd = fd;
+    self->state = AL_TASK_WAITING;
+    al_io_waiters++;
+    al_schedule(root);
+    epoll_ctl(al_epoll, EPOLL_CTL_DEL, fd, NULL);
+    self->fd = -1;
+    al_io_waiters--;
+}
+
+// (spawn fn) returns the number of the new task.
+static al_object_t* al_values_spawn(void *root, al_object_t **argv, int argc){
+    if(argc != 1 || (al_type(argv[0]) != ATTOLISP_TYPE_FUNCTION &&
+        al_type(argv[0]) != ATTOLISP_TYPE_PRIMITIVE)
+    ){
+        al_error("Malformed spawn");
+    }
+    al_task_t *task = al_task_new();
+    task->roots[0] = argv[0];
+    al_task_ready(task);
+    return al_new_int(root, task->id);
+}
+
+// *****
+static al_object_t* al_values_yield(void *root, al_object_t **argv, int argc){
+    (void)argv;
+    if(argc != 0){ al_error("Malformed yield"); }
+    al_task_ready(al_task_current);
+    al_schedule(root);
+    return al_nil;
+}
+
+// *****
+static al_object_t* al_values_sleep(void *root, al_object_t **argv, int argc){
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_INT ||
+        argv[0]->value < 0
+    ){
+        al_error("Malformed sleep");
+    }
+    al_task_t *self = al_task_current;
+    self->wake = al_trace_clock() + (uint64_t)argv[0]->value * 1000000u;
+    self->state = AL_TASK_WAITING;
+    al_sleepers_push(self);
+    al_schedule(root);
+    return al_nil;
+}
+
+// A channel holds the list of values sent and not received yet in `car` and
+// the last cell of that list in `cdr`.
+static al_object_t* al_values_make_channel(
+    void *root, al_object_t **argv, int argc
+){
+    (void)argv;
+    if(argc != 0){ al_error("Malformed make-channel"); }
+    al_object_t *channel = al_alloc(
+        root, ATTOLISP_TYPE_CHANNEL, 2 * sizeof(void*));
+    channel->car = channel->cdr = al_nil;
+    return channel;
+}
+
+// (send ch value) queues value and wakes the task that has waited longest
+// to receive from ch.
+static al_object_t* al_values_send(void *root, al_object_t **argv, int argc){
+    if(argc != 2 || al_type(argv[0]) != ATTOLISP_TYPE_CHANNEL){
+        al_error("Malformed send");
+    }
+    AL_DEFINE1(cell);
+    *cell = al_new_cons(root, &argv[1], &al_nil);
+    if(argv[0]->car == al_nil){ argv[0]->car = *cell; }
+    else{ argv[0]->cdr->cdr = *cell; }
+    argv[0]->cdr = *cell;
+    al_task_t **oldest = NULL;
+    for(al_task_t **link = &al_receivers; *link; link = &(*link)->next){
+        if(*(*link)->channel == argv[0]){ oldest = link; }
+    }
+    if(oldest){
+        al_task_t *task = *oldest;
+        *oldest = task->next;
+        al_task_ready(task);
+    }
+    return argv[1];
+}
+
+// (recv ch) waits until ch holds a value and takes the first one.
+static al_object_t* al_values_recv(void *root, al_object_t **argv, int argc){
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_CHANNEL){
+        al_error("Malformed recv");
+    }
+    al_task_t *self = al_task_current;
+    while(argv[0]->car == al_nil){
+        self->channel = &argv[0];
+        self->state = AL_TASK_WAITING;
+        self->next = al_receivers;
+        al_receivers = self;
+        bool resumed = al_schedule(root);
+        for(al_task_t **link = &al_receivers; *link; link = &(*link)->next){
+            if(*link == self){
+                *link = self->next;
+                break;
+            }
+        }
+        self->channel = NULL;
+        if(!resumed){ al_error("ERROR: recv: no task left to send"); }
+    }
+    al_object_t *value = argv[0]->car->car;
+    argv[0]->car = argv[0]->car->cdr;
+    if(argv[0]->car == al_nil){ argv[0]->cdr = al_nil; }
+    return value;
+}
+
+// *****
+// Input buffers of descriptors read by read-line, by descriptor.
+typedef struct al_port_t {
+    char *buffer;
+    size_t start, end, capacity;
+    bool eof;
+    pid_t pid;                      // command writing into it, see shell
+} al_port_t;
+
+static al_port_t **al_ports;
+static int al_nports;
+
+// *****
+static al_port_t* al_port_of(int fd){
+    if(al_nports <= fd){
+        int count = al_nports ? al_nports : 16;
+        while(count <= fd){ count *= 2; }
+        al_ports = realloc(al_ports, (size_t)count * sizeof(al_port_t*));
+        if(!al_ports){ al_error("ERROR: out of memory for ports"); }
+        memset(al_ports + al_nports, 0,
+            (size_t)(count - al_nports) * sizeof(al_port_t*));
+        al_nports = count;
+    }
+    if(!al_ports[fd] && !(al_ports[fd] = calloc(1, sizeof(al_port_t)))){
+        al_error("ERROR: out of memory for ports");
+    }
+    return al_ports[fd];
+}
+
+// *****
+static int al_fd_arg(al_object_t **argv, int argc, int count, char *name){
+    if(argc != count || al_type(argv[0]) != ATTOLISP_TYPE_INT ||
+        argv[0]->value < 0
+    ){
+        al_error("Malformed %s", name);
+    }
+    return argv[0]->value;
+}
+
+// (open "file" mode) opens file for read, write or append and returns the
+// descriptor.
+static al_object_t* al_values_open(void *root, al_object_t **argv, int argc){
+    if(argc != 2 || al_type(argv[0]) != ATTOLISP_TYPE_SYMBOL ||
+        al_type(argv[1]) != ATTOLISP_TYPE_SYMBOL
+    ){
+        al_error("Malformed open");
+    }
+    int flags = O_NONBLOCK | O_CLOEXEC;
+    if(strcmp(argv[1]->name, "read") == 0){ flags |= O_RDONLY; }
+    else if(strcmp(argv[1]->name, "write") == 0){
+        flags |= O_WRONLY | O_CREAT | O_TRUNC;
+    }else if(strcmp(argv[1]->name, "append") == 0){
+        flags |= O_WRONLY | O_CREAT | O_APPEND;
+    }else{
+        al_error("ERROR: open: unknown mode %s", argv[1]->name);
+    }
+    int fd = open(argv[0]->name, flags, 0666);
+    if(fd < 0){
+        al_error("ERROR: cannot open %s: %s", argv[0]->name, strerror(errno));
+    }
+    return al_new_int(root, fd);
+}
+
+// (shell "command") runs command with sh and returns a descriptor reading
+// its standard output.
+static al_object_t* al_values_shell(void *root, al_object_t **argv, int argc){
+    extern char **environ;
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_SYMBOL){
+        al_error("Malformed shell");
+    }
+    int ends[2];
+    if(pipe(ends) != 0){ al_error("ERROR: shell: %s", strerror(errno)); }
+    fcntl(ends[0], F_SETFD, FD_CLOEXEC);
+    fcntl(ends[1], F_SETFD, FD_CLOEXEC);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, ends[1], STDOUT_FILENO);
+    char *args[] = { "sh", "-c", argv[0]->name, NULL };
+    pid_t pid;
+    int error = posix_spawn(&pid, "/bin/sh", &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(ends[1]);
+    if(error){
+        close(ends[0]);
+        al_error("ERROR: shell: %s", strerror(error));
+    }
+    fcntl(ends[0], F_SETFL, fcntl(ends[0], F_GETFL) | O_NONBLOCK);
+    al_port_of(ends[0])->pid = pid;
+    return al_new_int(root, ends[0]);
+}
+
+// (read-line fd) returns the next line as a symbol, () at the end.
+static al_object_t* al_values_read_line(
+    void *root, al_object_t **argv, int argc
+){
+    int fd = al_fd_arg(argv, argc, 1, "read-line");
+    al_port_t *port = al_port_of(fd);
+    for(;;){
+        char *line = port->buffer + port->start;
+        char *newline = port->start < port->end ?
+            memchr(line, '\n', port->end - port->start) : NULL;
+        if(newline || (port->eof && port->start < port->end)){
+            size_t end = newline ? (size_t)(newline - port->buffer) :
+                port->end;
+            port->buffer[end] = '\0';
+            port->start = newline ? end + 1 : end;
+            // a symbol the reader could have made, so eq finds it
+            if(ATTOLISP_MAXLEN < strlen(line)){
+                al_error("ERROR: read-line: line longer than %d bytes",
+                    ATTOLISP_MAXLEN);
+            }
+            return al_intern(root, line);
+        }
+        if(port->eof){ return al_nil; }
+        if(port->start){
+            port->end -= port->start;
+            memmove(port->buffer, line, port->end);
+            port->start = 0;
+        }
+        // one byte is kept for the terminator
+        if(port->capacity < port->end + 2){
+            port->capacity = port->capacity ? port->capacity * 2 : 4096;
+            port->buffer = realloc(port->buffer, port->capacity);
+            if(!port->buffer){ al_error("ERROR: read-line: line too long"); }
+        }
+        ssize_t got = read(fd, port->buffer + port->end,
+            port->capacity - port->end - 1);
+        if(0 < got){ port->end += (size_t)got; }
+        else if(got == 0){ port->eof = true; }
+        else if(errno == EAGAIN){ al_task_wait_fd(root, fd, EPOLLIN); }
+        else if(errno != EINTR){
+            al_error("ERROR: read-line: %s", strerror(errno));
+        }
+    }
+}
+
+// (write-line fd value) writes a symbol's name or a number and a newline.
+static al_object_t* al_values_write_line(
+    void *root, al_object_t **argv, int argc
+){
+    int fd = al_fd_arg(argv, argc, 2, "write-line");
+    char number[16];
+    const char *text = number;
+    if(al_type(argv[1]) == ATTOLISP_TYPE_SYMBOL){ text = argv[1]->name; }
+    else if(al_type(argv[1]) == ATTOLISP_TYPE_INT){
+        snprintf(number, sizeof(number), "%d", argv[1]->value);
+    }else{
+        al_error("Malformed write-line");
+    }
+    // copied, since the symbol may move while the task waits
+    size_t len = strlen(text);
+    char *line = malloc(len + 1);
+    if(!line){ al_error("ERROR: out of memory for write-line"); }
+    memcpy(line, text, len);
+    line[len++] = '\n';
+    for(size_t done = 0; done < len; ){
+        ssize_t put = write(fd, line + done, len - done);
+        if(0 <= put){ done += (size_t)put; }
+        else if(errno == EAGAIN){ al_task_wait_fd(root, fd, EPOLLOUT); }
+        else if(errno != EINTR){
+            free(line);
+            al_error("ERROR: write-line: %s", strerror(errno));
+        }
+    }
+    free(line);
+    return argv[1];
+}
+
+// (close fd) returns the exit status of a shell command, t otherwise.
+static al_object_t* al_values_close(void *root, al_object_t **argv, int argc){
+    int fd = al_fd_arg(argv, argc, 1, "close");
+    al_port_t *port = fd < al_nports ? al_ports[fd] : NULL;
+    if(close(fd) != 0){ al_error("ERROR: close: %s", strerror(errno)); }
+    if(!port){ return al_true; }
+    al_ports[fd] = NULL;
+    pid_t pid = port->pid;
+    free(port->buffer);
+    free(port);
+    int status;
+    if(!pid || waitpid(pid, &status, 0) != pid){ return al_true; }
+    return al_new_int(root, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+static al_object_t* al_primitive_spawn(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_spawn);
+}
+
+static al_object_t* al_primitive_yield(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_yield);
+}
+
+static al_object_t* al_primitive_sleep(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_sleep);
+}
+
+static al_object_t* al_primitive_make_channel(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_make_channel);
+}
+
+static al_object_t* al_primitive_send(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_send);
+}
+
+static al_object_t* al_primitive_recv(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_recv);
+}
+
+static al_object_t* al_primitive_open(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_open);
+}
+
+static al_object_t* al_primitive_shell(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_shell);
+}
+
+static al_object_t* al_primitive_read_line(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_read_line);
+}
+
+static al_object_t* al_primitive_write_line(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_write_line);
+}
+
+static al_object_t* al_primitive_close(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_close);
+}
+
+// -------------------------------
+// ----- FOREIGN FUNCTIONS -------
+// -------------------------------
+// (ffi-bind "lib.so" "name" result (arg ...)) looks up a C function and
+// returns a Lisp function calling it; with () as the library the lookup
+// covers the program and the libraries it has loaded. Types are int, double
+// and pointer, and void for the result. AttoLisp has only integers, so a
+// double is made from one and truncated back into one, and a double result
+// out of the range of an integer is an error. A pointer argument is a
+// buffer or (). A pointer result becomes a buffer around the address, or ()
+// for NULL: with (pointer n) as the result type the buffer has n bytes,
+// with pointer it has none and is only good for passing back to C.
+//
+// On x86-64 and AArch64 arguments go in registers, integers and pointers in
+// one sequence and doubles in another. Every binding is called through one
+// of two function types taking the most of each, and bind time works out
+// the register of each argument, so a call only converts the values. C
+// functions taking more arguments than that, or a variable number of them,
+// cannot be bound, and on other targets ffi-bind always fails.
+#if defined(__x86_64__) || defined(__aarch64__)
+#define AL_FFI_REGISTERS    1
+#else
+#define AL_FFI_REGISTERS    0
+#endif
+//
+// (make-buffer n) allocates n zeroed bytes in the large object space, where
+// they never move, so C gets their address as is.
+#define AL_FFI_INTS     6
+#define AL_FFI_REALS    8
+#define AL_FFI_ARGS     (AL_FFI_INTS + AL_FFI_REALS)
+
+enum { AL_FFI_VOID, AL_FFI_INT, AL_FFI_DOUBLE, AL_FFI_POINTER };
+
+typedef intptr_t (*al_ffi_int_t)(
+    intptr_t, intptr_t, intptr_t, intptr_t, intptr_t, intptr_t,
+    double, double, double, double, double, double, double, double);
+typedef double (*al_ffi_double_t)(
+    intptr_t, intptr_t, intptr_t, intptr_t, intptr_t, intptr_t,
+    double, double, double, double, double, double, double, double);
+
+typedef struct al_foreign_t {
+    void *fn;
+    int result;
+    size_t length;                  // bytes behind a pointer result
+    int argc;
+    uint8_t types[AL_FFI_ARGS];
+    uint8_t slots[AL_FFI_ARGS];     // register of each argument in its class
+} al_foreign_t;
+
+// bindings, numbered by the calls made to them
+static al_foreign_t *al_foreigns;
+static int al_nforeigns;
+static int al_foreigns_capacity;
+
+// *****
+static int al_ffi_type(al_object_t *type, bool result){
+    if(al_type(type) == ATTOLISP_TYPE_SYMBOL){
+        if(strcmp(type->name, "int") == 0){ return AL_FFI_INT; }
+        if(strcmp(type->name, "double") == 0){ return AL_FFI_DOUBLE; }
+        if(strcmp(type->name, "pointer") == 0){ return AL_FFI_POINTER; }
+        if(result && strcmp(type->name, "void") == 0){ return AL_FFI_VOID; }
+    }
+    al_error("ERROR: ffi-bind: unknown type");
+    return AL_FFI_VOID; // never reached
+}
+
+// *****
+static al_object_t* al_new_buffer(void *root, size_t length){
+    if(!al_los_base || INT_MAX - 64 < length){
+        al_error("ERROR: cannot allocate a buffer of %zu bytes", length);
+    }
+    size_t size = al_round_up(
+        AL_HEADER + 2 * sizeof(void*) + length, sizeof(void*));
+    al_charge(size);
+    if(al_profiling){ al_profile_alloc(ATTOLISP_TYPE_BUFFER, 1, size); }
+    // large object pages are zero when they are handed out
+    al_object_t *buffer = al_los_alloc(root, ATTOLISP_TYPE_BUFFER, size);
+    buffer->length = length;
+    buffer->address = &buffer->address + 1;
+    return buffer;
+}
+
+// Truncates a double from C into an integer, which it has to fit.
+static al_object_t* al_new_truncated(void *root, double value, char *name){
+    // also false for NaN
+    if(!(-2147483649.0 < value && value < 2147483648.0)){
+        al_error("ERROR: %s: %g does not fit in an integer", name, value);
+    }
+    return al_new_int(root, (int)value);
+}
+
+// Wraps `length` bytes owned by C; the wrapper moves like any small object.
+static al_object_t* al_new_pointer(void *root, void *address, size_t length){
+    if(!address){ return al_nil; }
+    al_object_t *buffer = al_alloc(
+        root, ATTOLISP_TYPE_BUFFER, 2 * sizeof(void*));
+    buffer->length = length;
+    buffer->address = address;
+    return buffer;
+}
+
+// Binds the function and returns the number of the binding.
+static al_object_t* al_values_ffi_bind(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc != 4 || al_type(argv[1]) != ATTOLISP_TYPE_SYMBOL ||
+        (argv[0] != al_nil && al_type(argv[0]) != ATTOLISP_TYPE_SYMBOL)
+    ){
+        al_error("Malformed ffi-bind");
+    }
+    if(!AL_FFI_REGISTERS){
+        al_error("ERROR: ffi-bind is not supported on this target");
+    }
+    al_foreign_t foreign = { .result = AL_FFI_POINTER };
+    al_object_t *result = argv[2];
+    if(al_type(result) == ATTOLISP_TYPE_CELL){
+        // (pointer n)
+        if(al_type(result->cdr) != ATTOLISP_TYPE_CELL ||
+            al_type(result->cdr->car) != ATTOLISP_TYPE_INT ||
+            result->cdr->car->value < 0 || result->cdr->cdr != al_nil ||
+            al_ffi_type(result->car, false) != AL_FFI_POINTER
+        ){
+            al_error("Malformed ffi-bind");
+        }
+        foreign.length = (size_t)result->cdr->car->value;
+    }else{
+        foreign.result = al_ffi_type(result, true);
+    }
+    int ints = 0, reals = 0;
+    for(al_object_t *type = argv[3]; type != al_nil; type = type->cdr){
+        if(al_type(type) != ATTOLISP_TYPE_CELL){
+            al_error("Malformed ffi-bind");
+        }
+        int kind = al_ffi_type(type->car, false);
+        if(kind == AL_FFI_DOUBLE ? reals == AL_FFI_REALS : ints == AL_FFI_INTS){
+            al_error("ERROR: ffi-bind: %s takes too many arguments",
+                argv[1]->name);
+        }
+        foreign.types[foreign.argc] = (uint8_t)kind;
+        foreign.slots[foreign.argc++] =
+            (uint8_t)(kind == AL_FFI_DOUBLE ? reals++ : ints++);
+    }
+    void *library = dlopen(
+        argv[0] == al_nil ? NULL : argv[0]->name, RTLD_NOW | RTLD_LOCAL);
+    if(!library){ al_error("ERROR: ffi-bind: %s", dlerror()); }
+    if(!(foreign.fn = dlsym(library, argv[1]->name))){
+        al_error("ERROR: ffi-bind: %s", dlerror());
+    }
+    if(al_nforeigns == al_foreigns_capacity){
+        al_foreigns_capacity = al_foreigns_capacity ?
+            al_foreigns_capacity * 2 : 16;
+        al_foreigns = realloc(al_foreigns,
+            (size_t)al_foreigns_capacity * sizeof(al_foreign_t));
+        if(!al_foreigns){ al_error("ERROR: out of memory for ffi-bind"); }
+    }
+    al_foreigns[al_nforeigns] = foreign;
+    return al_new_int(root, al_nforeigns++);
+}
+
+// (ffi-call binding arg ...), called by the functions ffi-bind makes.
+static al_object_t* al_values_ffi_call(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc < 1 || al_type(argv[0]) != ATTOLISP_TYPE_INT ||
+        argv[0]->value < 0 || al_nforeigns <= argv[0]->value ||
+        al_foreigns[argv[0]->value].argc != argc - 1
+    ){
+        al_error("Malformed ffi-call");
+    }
+    al_foreign_t *foreign = &al_foreigns[argv[0]->value];
+    intptr_t ints[AL_FFI_INTS] = { 0 };
+    double reals[AL_FFI_REALS] = { 0 };
+    for(int i=0; i < foreign->argc; i++){
+        al_object_t *arg = argv[i + 1];
+        if(foreign->types[i] == AL_FFI_POINTER){
+            if(arg != al_nil && al_type(arg) != ATTOLISP_TYPE_BUFFER){
+                al_error("ERROR: ffi-call: argument %d is not a buffer", i);
+            }
+            ints[foreign->slots[i]] =
+                arg == al_nil ? 0 : (intptr_t)arg->address;
+            continue;
+        }
+        if(al_type(arg) != ATTOLISP_TYPE_INT){
+            al_error("ERROR: ffi-call: argument %d is not a number", i);
+        }
+        if(foreign->types[i] == AL_FFI_DOUBLE){
+            reals[foreign->slots[i]] = arg->value;
+        }else{
+            ints[foreign->slots[i]] = arg->value;
+        }
+    }
+#define AL_FFI_ARGUMENTS                                            \
+    ints[0], ints[1], ints[2], ints[3], ints[4], ints[5],           \
+    reals[0], reals[1], reals[2], reals[3],                         \
+    reals[4], reals[5], reals[6], reals[7]
+    if(foreign->result == AL_FFI_DOUBLE){
+        double result = ((al_ffi_double_t)foreign->fn)(AL_FFI_ARGUMENTS);
+        return al_new_truncated(root, result, "ffi-call");
+    }
+    intptr_t result = ((al_ffi_int_t)foreign->fn)(AL_FFI_ARGUMENTS);
+#undef AL_FFI_ARGUMENTS
+    switch(foreign->result){
+    case AL_FFI_INT: return al_new_int(root, (int)result);
+    case AL_FFI_POINTER:
+        return al_new_pointer(root, (void*)result, foreign->length);
+    default: return al_nil;
+    }
+}
+
+// Makes (lambda (x0 ...) (ffi-call binding x0 ...)) among the globals, so
+// calls to it are analyzed into direct calls of ffi-call.
+static al_object_t* al_primitive_ffi_bind(
+    void *root, al_object_t **env, al_object_t **list
+){
+    AL_DEFINE4(global, params, call, form);
+    *call = al_call_values(root, env, list, al_values_ffi_bind);
+    *params = al_nil;
+    for(int i = al_foreigns[(*call)->value].argc - 1; 0 <= i; i--){
+        char name[16];
+        snprintf(name, sizeof(name), "x%d", i);
+        *form = al_intern(root, name);
+        *params = al_new_cons(root, form, params);
+    }
+    *call = al_new_cons(root, call, params);
+    *form = al_intern(root, "ffi-call");
+    *call = al_new_cons(root, form, call);
+    *call = al_new_cons(root, call, &al_nil);
+    *call = al_new_cons(root, params, call);
+    *form = al_intern(root, "lambda");
+    *form = al_new_cons(root, form, call);
+    for(*global = *env; (*global)->up != al_nil; *global = (*global)->up){}
+    return al_eval(root, global, form);
+}
+
+// *****
+static al_object_t* al_values_make_buffer(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_INT ||
+        argv[0]->value < 0
+    ){
+        al_error("Malformed make-buffer");
+    }
+    return al_new_buffer(root, (size_t)argv[0]->value);
+}
+
+// *****
+static al_object_t* al_values_buffer_length(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_BUFFER){
+        al_error("Malformed buffer-length");
+    }
+    return al_new_int(root, (int)argv[0]->length);
+}
+
+// Finds element `index` of a buffer seen as an array of byte, int or
+// double; its size is stored in `size`.
+static uint8_t* al_buffer_element(
+    al_object_t **argv, char *name, size_t *size
+){
+    if(al_type(argv[0]) != ATTOLISP_TYPE_BUFFER ||
+        al_type(argv[1]) != ATTOLISP_TYPE_INT ||
+        al_type(argv[2]) != ATTOLISP_TYPE_SYMBOL
+    ){
+        al_error("Malformed %s", name);
+    }
+    if(strcmp(argv[2]->name, "byte") == 0){ *size = 1; }
+    else if(strcmp(argv[2]->name, "int") == 0){ *size = sizeof(int); }
+    else if(strcmp(argv[2]->name, "double") == 0){ *size = sizeof(double); }
+    else{ al_error("ERROR: %s: unknown type %s", name, argv[2]->name); }
+    size_t index = (size_t)(unsigned)argv[1]->value;
+    if(argv[1]->value < 0 || argv[0]->length / *size <= index){
+        al_error("ERROR: %s: index %d out of range", name, argv[1]->value);
+    }
+    return (uint8_t*)argv[0]->address + index * *size;
+}
+
+// (buffer-ref buffer index type) reads element `index` of type byte, int
+// or double.
+static al_object_t* al_values_buffer_ref(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc != 3){ al_error("Malformed buffer-ref"); }
+    size_t size;
+    uint8_t *element = al_buffer_element(argv, "buffer-ref", &size);
+    if(size == 1){ return al_new_int(root, *element); }
+    if(size == sizeof(int)){
+        int value;
+        memcpy(&value, element, sizeof(value));
+        return al_new_int(root, value);
+    }
+    double value;
+    memcpy(&value, element, sizeof(value));
+    return al_new_truncated(root, value, "buffer-ref");
+}
+
+// (buffer-set buffer index type value) returns value.
+static al_object_t* al_values_buffer_set(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    if(argc != 4 || al_type(argv[3]) != ATTOLISP_TYPE_INT){
+        al_error("Malformed buffer-set");
+    }
+    size_t size;
+    uint8_t *element = al_buffer_element(argv, "buffer-set", &size);
+    int value = argv[3]->value;
+    double real = value;
+    if(size == 1){ *element = (uint8_t)value; }
+    else if(size == sizeof(int)){ memcpy(element, &value, sizeof(value)); }
+    else{ memcpy(element, &real, sizeof(real)); }
+    return argv[3];
+}
+
+static al_object_t* al_primitive_ffi_call(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_ffi_call);
+}
+
+static al_object_t* al_primitive_make_buffer(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_make_buffer);
+}
+
+static al_object_t* al_primitive_buffer_length(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_buffer_length);
+}
+
+static al_object_t* al_primitive_buffer_ref(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_buffer_ref);
+}
+
+static al_object_t* al_primitive_buffer_set(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_buffer_set);
+}
+
+// -------------------------------
+// ----- WEAK REFERENCES ---------
+// -------------------------------
+// (make-weak-ref x) refers to x without keeping it alive: once nothing else
+// does, a collection turns (weak-ref-value w) into nil. (make-weak-table)
+// holds entries as long as their keys are live, see WEAK TABLES; an entry
+// whose key died stays counted until the next collection drops it.
+static al_object_t* al_values_make_weak_ref(
+    void *root, al_object_t **argv, int argc
+){
+    if(argc != 1){ al_error("Malformed make-weak-ref"); }
+    al_object_t *weak = al_alloc(root, ATTOLISP_TYPE_WEAK, 2 * sizeof(void*));
+    weak->referent = argv[0];
+    weak->weak_next = NULL;
+    return weak;
+}
+
+// *****
+static al_object_t* al_values_weak_ref_value(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    if(argc != 1 || al_type(argv[0]) != ATTOLISP_TYPE_WEAK){
+        al_error("Malformed weak-ref-value");
+    }
+    return argv[0]->referent;
+}
+
+// *****
+static al_object_t* al_values_make_weak_table(
+    void *root, al_object_t **argv, int argc
+){
+    (void)argv;
+    if(argc != 0){ al_error("Malformed make-weak-table"); }
+    al_object_t *object = al_alloc(
+        root, ATTOLISP_TYPE_TABLE, 2 * sizeof(void*));
+    al_table_t *table = calloc(1, sizeof(al_table_t));
+    al_table_entry_t *entries = calloc(AL_TABLE_MIN, sizeof(*entries));
+    if(!table || !entries){ al_error("Memory exhausted"); }
+    table->entries = entries;
+    table->capacity = AL_TABLE_MIN;
+    table->next = al_tables;
+    al_tables = table;
+    object->table = table;
+    object->weak_next = NULL;
+    return object;
+}
+
+// *****
+static al_table_t* al_table_arg(al_object_t **argv, int argc, int want,
+    const char *name
+){
+    if(argc != want || al_type(argv[0]) != ATTOLISP_TYPE_TABLE){
+        al_error("Malformed %s", name);
+    }
+    return argv[0]->table;
+}
+
+// (weak-table-ref table key) returns nil when key has no entry.
+static al_object_t* al_values_weak_table_ref(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    al_table_t *table = al_table_arg(argv, argc, 2, "weak-table-ref");
+    al_table_entry_t *entry = al_table_slot(table, argv[1]);
+    return entry->key ? entry->value : al_nil;
+}
+
+// (weak-table-set table key value) returns value.
+static al_object_t* al_values_weak_table_set(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    al_table_t *table = al_table_arg(argv, argc, 3, "weak-table-set");
+    al_table_put(table, argv[1], argv[2]);
+    return argv[2];
+}
+
+// *****
+static al_object_t* al_values_weak_table_remove(
+    void *root, al_object_t **argv, int argc
+){
+    (void)root;
+    al_table_remove(al_table_arg(argv, argc, 2, "weak-table-remove"), argv[1]);
+    return al_nil;
+}
+
+// *****
+static al_object_t* al_values_weak_table_count(
+    void *root, al_object_t **argv, int argc
+){
+    al_table_t *table = al_table_arg(argv, argc, 1, "weak-table-count");
+    return al_new_int(root, (int)table->count);
+}
+
+static al_object_t* al_primitive_make_weak_ref(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_make_weak_ref);
+}
+
+static al_object_t* al_primitive_weak_ref_value(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_weak_ref_value);
+}
+
+static al_object_t* al_primitive_make_weak_table(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_make_weak_table);
+}
+
+static al_object_t* al_primitive_weak_table_ref(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_weak_table_ref);
+}
+
+static al_object_t* al_primitive_weak_table_set(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_weak_table_set);
+}
+
+static al_object_t* al_primitive_weak_table_remove(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_weak_table_remove);
+}
+
+static al_object_t* al_primitive_weak_table_count(
+    void *root, al_object_t **env, al_object_t **list
+){
+    return al_call_values(root, env, list, al_values_weak_table_count);
+}
+
+static void al_add_primitive(
+    void *root, al_object_t **env, char *name, al_primitive_t fn
+){
+    AL_DEFINE2(symbol, primitive);
+    *symbol = al_intern(root, name);
+    *primitive = al_new_primitive(root, fn);
+    al_add_variable(root, env, symbol, primitive);
+}
+
+static void al_define_constants(void *root, al_object_t **env){
+    AL_DEFINE1(symbol);
+    *symbol = al_intern(root, "t");
+    al_add_variable(root, env, symbol, &al_true);
+}
+
+static void al_define_primitives(void *root, al_object_t **env){
+    al_add_primitive(root, env, "quote", al_primitive_quote);
+    al_add_primitive(root, env, "cons", al_primitive_cons);
+    al_add_primitive(root, env, "car", al_primitive_car);
+    al_add_primitive(root, env, "cdr", al_primitive_cdr);
+    al_add_primitive(root, env, "setq", al_primitive_setq);
+    al_add_primitive(root, env, "setcar", al_primitive_setcar);
+    al_add_primitive(root, env, "while", al_primitive_while);
+    al_add_primitive(root, env, "gensym", al_primitive_gensym);
+    al_add_primitive(root, env, "+", al_primitive_plus);
+    al_add_primitive(root, env, "-", al_primitive_minus);
+    al_add_primitive(root, env, "<", al_primitive_lt);
+    al_add_primitive(root, env, "define", al_primitive_define);
+    al_add_primitive(root, env, "defun", al_primitive_defun);
+    al_add_primitive(root, env, "defmacro", al_primitive_defmacro);
+    al_add_primitive(root, env, "defmemo", al_primitive_defmemo);
+    al_add_primitive(root, env, "memoize", al_primitive_memoize);
+    al_add_primitive(root, env, "memo-stats", al_primitive_memo_stats);
+    al_add_primitive(root, env, "trace-flush", al_primitive_trace_flush);
+    al_add_primitive(root, env, "heap-dump", al_primitive_heap_dump);
+    al_add_primitive(root, env, "save-binary", al_primitive_save_binary);
+    al_add_primitive(root, env, "load-binary", al_primitive_load_binary);
+    al_add_primitive(root, env, "spawn", al_primitive_spawn);
+    al_add_primitive(root, env, "yield", al_primitive_yield);
+    al_add_primitive(root, env, "sleep", al_primitive_sleep);
+    al_add_primitive(root, env, "make-channel", al_primitive_make_channel);
+    al_add_primitive(root, env, "send", al_primitive_send);
+    al_add_primitive(root, env, "recv", al_primitive_recv);
+    al_add_primitive(root, env, "open", al_primitive_open);
+    al_add_primitive(root, env, "shell", al_primitive_shell);
+    al_add_primitive(root, env, "read-line", al_primitive_read_line);
+    al_add_primitive(root, env, "write-line", al_primitive_write_line);
+    al_add_primitive(root, env, "close", al_primitive_close);
+    al_add_primitive(root, env, "ffi-bind", al_primitive_ffi_bind);
+    al_add_primitive(root, env, "ffi-call", al_primitive_ffi_call);
+    al_add_primitive(root, env, "make-buffer", al_primitive_make_buffer);
+    al_add_primitive(root, env, "buffer-length", al_primitive_buffer_length);
+    al_add_primitive(root, env, "buffer-ref", al_primitive_buffer_ref);
+    al_add_primitive(root, env, "buffer-set", al_primitive_buffer_set);
+    al_add_primitive(root, env, "make-weak-ref", al_primitive_make_weak_ref);
+    al_add_primitive(root, env, "weak-ref-value", al_primitive_weak_ref_value);
+    al_add_primitive(root, env, "make-weak-table",
+        al_primitive_make_weak_table);
+    al_add_primitive(root, env, "weak-table-ref",
+        al_primitive_weak_table_ref);
+    al_add_primitive(root, env, "weak-table-set",
+        al_primitive_weak_table_set);
+    al_add_primitive(root, env, "weak-table-remove",
+        al_primitive_weak_table_remove);
+    al_add_primitive(root, env, "weak-table-count",
+        al_primitive_weak_table_count);
+    al_add_primitive(root, env, "macroexpand", al_primitive_macroexpand);
+    al_add_primitive(root, env, "lambda", al_primitive_lambda);
+    al_add_primitive(root, env, "if", al_primitive_if);
+    al_add_primitive(root, env, "=", al_primitive_number_eq);
+    al_add_primitive(root, env, "eq", al_primitive_eq);
+    al_add_primitive(root, env, "println", al_primitive_println);
+    al_add_primitive(root, env, "length", al_primitive_length);
+    al_add_primitive(root, env, "reverse", al_primitive_reverse);
+    al_add_primitive(root, env, "append", al_primitive_append);
+    al_add_primitive(root, env, "nth", al_primitive_nth);
+    al_add_primitive(root, env, "member", al_primitive_member);
+    al_add_primitive(root, env, "assoc", al_primitive_assoc);
+    al_add_primitive(root, env, "map", al_primitive_map);
+    al_add_primitive(root, env, "caar", al_primitive_caar);
+    al_add_primitive(root, env, "cadr", al_primitive_cadr);
+    al_add_primitive(root, env, "cdar", al_primitive_cdar);
+    al_add_primitive(root, env, "cddr", al_primitive_cddr);
+    al_add_primitive(root, env, "caaar", al_primitive_caaar);
+    al_add_primitive(root, env, "caadr", al_primitive_caadr);
+    al_add_primitive(root, env, "cadar", al_primitive_cadar);
+    al_add_primitive(root, env, "caddr", al_primitive_caddr);
+    al_add_primitive(root, env, "cdaar", al_primitive_cdaar);
+    al_add_primitive(root, env, "cdadr", al_primitive_cdadr);
+    al_add_primitive(root, env, "cddar", al_primitive_cddar);
+    al_add_primitive(root, env, "cdddr", al_primitive_cdddr);
+}
+
+
+// ------------------------------------------------------------------
+//                          ANALYZER
+// ------------------------------------------------------------------
+// A form is translated once into a tree of al_node_t, whose handlers do the
+// work al_eval would otherwise redo on every visit. Special forms and
+// builtins are recognised up front and macros are expanded. Each variable is
+// resolved to a local (frame depth and name) or to a global, whose binding is
+// cached until the next define. A lambda body is analyzed the first time one
+// of its closures is called. A node that relies on a global being a given
+// special form, builtin or macro checks that binding through the same cache.
+// If the name has been rebound, it falls back to al_eval on the original form.
+#define AL_ARENA_CHUNK  4096
+
+typedef struct al_node_t al_node_t;
+typedef al_object_t* (*al_exec_t)(
+    void *root, al_object_t **env, al_node_t *node);
+
+struct al_node_t {
+    al_exec_t exec;
+    al_code_t *code;            // owning unit
+    int index;                  // constant: value, name or call arguments
+    int depth;                  // frames between a local and its use
+    int cache;                  // binding cache of a global variable
+    int guard;                  // binding cache of the head symbol, or -1
+    int expect;                 // constant the head symbol must be bound to
+    int source;                 // constant holding the whole form
+    int count;
+    union {
+        al_values_t values;     // builtin
+        al_code_t *lambda;      // body of the closures it creates
+    };
+    al_node_t *kids[];
+};
+
+// variable reference kinds
+enum { AL_REF_LOCAL, AL_REF_DYNAMIC, AL_REF_GLOBAL };
+
+static const struct {
+    al_primitive_t primitive;
+    al_values_t values;
+} al_builtins[] = {
+    { al_primitive_cons, al_values_cons },
+    { al_primitive_car, al_values_car },
+    { al_primitive_cdr, al_values_cdr },
+    { al_primitive_setcar, al_values_setcar },
+    { al_primitive_plus, al_values_plus },
+    { al_primitive_minus, al_values_minus },
+    { al_primitive_lt, al_values_lt },
+    { al_primitive_number_eq, al_values_number_eq },
+    { al_primitive_eq, al_values_eq },
+    { al_primitive_length, al_values_length },
+    { al_primitive_reverse, al_values_reverse },
+    { al_primitive_append, al_values_append },
+    { al_primitive_nth, al_values_nth },
+    { al_primitive_member, al_values_member },
+    { al_primitive_assoc, al_values_assoc },
+    { al_primitive_map, al_values_map },
+    { al_primitive_caar, al_values_caar },
+    { al_primitive_cadr, al_values_cadr },
+    { al_primitive_cdar, al_values_cdar },
+    { al_primitive_cddr, al_values_cddr },
+    { al_primitive_caaar, al_values_caaar },
+    { al_primitive_caadr, al_values_caadr },
+    { al_primitive_cadar, al_values_cadar },
+    { al_primitive_caddr, al_values_caddr },
+    { al_primitive_cdaar, al_values_cdaar },
+    { al_primitive_cdadr, al_values_cdadr },
+    { al_primitive_cddar, al_values_cddar },
+    { al_primitive_cdddr, al_values_cdddr },
+    { al_primitive_memoize, al_values_memoize },
+    { al_primitive_memo_stats, al_values_memo_stats },
+    { al_primitive_trace_flush, al_values_trace_flush },
+    { al_primitive_heap_dump, al_values_heap_dump },
+    { al_primitive_save_binary, al_values_save_binary },
+    { al_primitive_load_binary, al_values_load_binary },
+    { al_primitive_spawn, al_values_spawn },
+    { al_primitive_yield, al_values_yield },
+    { al_primitive_sleep, al_values_sleep },
+    { al_primitive_make_channel, al_values_make_channel },
+    { al_primitive_send, al_values_send },
+    { al_primitive_recv, al_values_recv },
+    { al_primitive_open, al_values_open },
+    { al_primitive_shell, al_values_shell },
+    { al_primitive_read_line, al_values_read_line },
+    { al_primitive_write_line, al_values_write_line },
+    { al_primitive_close, al_values_close },
+    { al_primitive_ffi_call, al_values_ffi_call },
+    { al_primitive_make_buffer, al_values_make_buffer },
+    { al_primitive_buffer_length, al_values_buffer_length },
+    { al_primitive_buffer_ref, al_values_buffer_ref },
+    { al_primitive_buffer_set, al_values_buffer_set },
+    { al_primitive_make_weak_ref, al_values_make_weak_ref },
+    { al_primitive_weak_ref_value, al_values_weak_ref_value },
+    { al_primitive_make_weak_table, al_values_make_weak_table },
+    { al_primitive_weak_table_ref, al_values_weak_table_ref },
+    { al_primitive_weak_table_set, al_values_weak_table_set },
+    { al_primitive_weak_table_remove, al_values_weak_table_remove },
+    { al_primitive_weak_table_count, al_values_weak_table_count },
+};
+
+static al_node_t* al_analyze(
+    void *root, al_code_t *code, al_object_t **aenv, al_object_t **expr);
+static al_object_t* al_call_function(
+    void *root, al_object_t **fn, al_object_t **argv, int argc);
+
+// Calls `fn` on values, for the library functions that take a function.
+// Only builtins among the primitives can be called this way.
+static al_object_t* al_funcall_values(
+    void *root, al_object_t **fn, al_object_t **argv, int argc
+){
+    if(al_type(*fn) == ATTOLISP_TYPE_PRIMITIVE){
+        for(size_t i=0; i < sizeof(al_builtins) / sizeof(al_builtins[0]); i++){
+            if(al_builtins[i].primitive == (*fn)->fn){
+                return al_builtins[i].values(root, argv, argc);
+            }
+        }
+        al_error("ERROR: special forms cannot be called as functions");
+    }
+    if(al_type(*fn) != ATTOLISP_TYPE_FUNCTION){
+        al_error("ERROR: not a function");
+    }
+    if(al_analyzer){
+        return al_call_function(root, fn, argv, argc);
+    }
+    AL_DEFINE2(args, env);
+    *args = al_nil;
+    for(int i=argc - 1; 0 <= i; i--){
+        *args = al_new_cons(root, &argv[i], args);
+    }
+    *env = (*fn)->env;
+    return al_apply_callback(root, env, fn, args);
+}
+
+// *****
+static void* al_grow(void *array, int *capacity, int count, size_t size){
+    if(count < *capacity){ return array; }
+    *capacity = *capacity ? *capacity * 2 : 8;
+    array = realloc(array, (size_t)*capacity * size);
+    if(!array){ al_error("Cannot allocate code"); }
+    return array;
+}
+
+// *****
+static al_code_t* al_code_new(void){
+    al_code_t *code = calloc(1, sizeof(al_code_t));
+    if(!code){ al_error("Cannot allocate code"); }
+    code->mark = al_gc_count;
+    code->next = al_codes;
+    al_codes = code;
+    return code;
+}
+
+// *****
+static void al_code_free(al_code_t *code){
+    while(code->arena){
+        al_chunk_t *chunk = code->arena;
+        code->arena = chunk->next;
+        free(chunk);
+    }
+    free(code->constants);
+    free(code->caches);
+    free(code->children);
+    free(code->frames);
+    free(code->memo);
+    free(code);
+}
+
+// *****
+static void* al_code_alloc(al_code_t *code, size_t size){
+    size = al_round_up(size, sizeof(void*));
+    al_chunk_t *chunk = code->arena;
+    if(!chunk || chunk->size < chunk->used + size){
+        size_t capacity = size < AL_ARENA_CHUNK ? AL_ARENA_CHUNK : size;
+        chunk = malloc(sizeof(al_chunk_t) + capacity);
+        if(!chunk){ al_error("Cannot allocate code"); }
+        chunk->next = code->arena;
+        chunk->used = 0;
+        chunk->size = capacity;
+        code->arena = chunk;
+    }
+    void *pointer = chunk->data + chunk->used;
+    chunk->used += size;
+    return pointer;
+}
+
+// *****
+static int al_code_constant(al_code_t *code, al_object_t *object){
+    code->constants = al_grow(code->constants, &code->maxconstants,
+        code->nconstants, sizeof(al_object_t*));
+    code->constants[code->nconstants] = object;
+    return code->nconstants++;
+}
+
+// *****
+static int al_code_cache(al_code_t *code, al_object_t *symbol){
+    int index = al_code_constant(code, symbol);
+    code->caches = al_grow(code->caches, &code->maxcaches,
+        code->ncaches, sizeof(al_cache_t));
+    code->caches[code->ncaches] = (al_cache_t){
+        index, code->nframes, 0, NULL, NULL };
+    return code->ncaches++;
+}
+
+// The unit of a lambda nested `outer`'s frames deep. A NULL `outer` gives a
+// unit that only knows its own parameters. A flat closure sees, instead of
+// the frames of `outer`, a single frame with the `captured` names.
+static al_code_t* al_code_new_function(
+    al_object_t *params, al_object_t *body, al_code_t *outer,
+    al_object_t *captured
+){
+    int nouter = captured ? 1 : outer ? outer->nframes : 0;
+    al_code_t *code = al_code_new();
+    code->frames = malloc((size_t)(nouter + 1) * sizeof(al_frame_t));
+    if(!code->frames){ al_error("Cannot allocate code"); }
+    code->nframes = nouter + 1;
+    code->frames[0].params = al_code_constant(code, params);
+    code->frames[0].dynamic = false;
+    if(captured){
+        code->frames[1].params = al_code_constant(code, captured);
+        code->frames[1].dynamic = false;
+    }else{
+        for(int i=0; i < nouter; i++){
+            code->frames[i + 1].params = al_code_constant(
+                code, outer->constants[outer->frames[i].params]);
+            code->frames[i + 1].dynamic = outer->frames[i].dynamic;
+        }
+    }
+    code->body = al_code_constant(code, body);
+    code->arity = al_length(params);
+    if(outer){
+        outer->children = al_grow(outer->children, &outer->maxchildren,
+            outer->nchildren, sizeof(al_code_t*));
+        outer->children[outer->nchildren++] = code;
+    }
+    return code;
+}
+
+// Called by the collector for every live function; may run on several GC
+// threads at once.
+static void al_code_mark(al_code_t *code){
+    if(__atomic_exchange_n(&code->mark, al_gc_count, __ATOMIC_RELAXED) ==
+        al_gc_count
+    ){ return; }
+    for(int i=0; i < code->nchildren; i++){
+        al_code_mark(code->children[i]);
+    }
+}
+
+// Frees the units no live function refers to, after a collection. Cached
+// bindings are dropped rather than traced so they never keep a frame alive.
+static void al_code_sweep(void){
+    for(al_code_t *code = al_codes; code; code = code->next){
+        if(code->active){ al_code_mark(code); }
+    }
+    al_code_t **link = &al_codes;
+    while(*link){
+        al_code_t *code = *link;
+        if(code->mark != al_gc_count){
+            *link = code->next;
+            al_code_free(code);
+            continue;
+        }
+        for(int i=0; i < code->ncaches; i++){
+            code->caches[i].frame = code->caches[i].binding = NULL;
+        }
+        link = &code->next;
+    }
+}
+
+// ---- run time
+static inline al_object_t* al_frame_at(al_object_t *frame, int depth){
+    while(depth--){ frame = frame->up; }
+    return frame;
+}
+
+// Globals are looked up from the frame just outside the static scope of the
+// use.
+static al_object_t* al_code_binding(
+    al_object_t **env, al_code_t *code, int index
+){
+    al_cache_t *cache = &code->caches[index];
+    al_object_t *frame = al_frame_at(*env, cache->depth);
+    if(cache->frame != frame || cache->epoch != al_define_epoch){
+        cache->binding = al_find(&frame, code->constants[cache->symbol]);
+        cache->frame = frame;
+        cache->epoch = al_define_epoch;
+    }
+    return cache->binding;
+}
+
+// *****
+static al_object_t* al_local_binding(al_object_t **env, al_node_t *node){
+    al_object_t *frame = al_frame_at(*env, node->depth);
+    al_object_t *symbol = node->code->constants[node->index];
+    for(al_object_t *cell = frame->vars; cell != al_nil; cell = cell->cdr){
+        if(cell->car->car == symbol){ return cell->car; }
+    }
+    return NULL;
+}
+
+// *****
+static al_object_t* al_node_binding(al_object_t **env, al_node_t *node){
+    if(0 <= node->depth){ return al_local_binding(env, node); }
+    if(0 <= node->cache){
+        return al_code_binding(env, node->code, node->cache);
+    }
+    return al_find(env, node->code->constants[node->index]);
+}
+
+// *****
+static inline bool al_guard(al_object_t **env, al_node_t *node){
+    al_object_t *bind = al_code_binding(env, node->code, node->guard);
+    return bind && bind->cdr == node->code->constants[node->expect];
+}
+
+// Copies a stack frame, and the ones it is nested in, to the heap. The code
+// running in the frame continues on the copy through the owner slot.
+static al_object_t* al_frame_promote(void *root, al_object_t *frame){
+    if(!al_on_frame_stack(frame)){ return frame; }
+    AL_DEFINE4(up, map, symbol, value);
+    *up = al_frame_promote(root, frame->up);
+    *map = al_nil;
+    // stack objects do not move, so `cell` stays valid across allocation
+    for(al_object_t *cell = frame->vars; cell != al_nil; cell = cell->cdr){
+        *symbol = cell->car->car;
+        *value = cell->car->cdr;
+        *map = al_acons(root, symbol, value, map);
+    }
+    *map = al_reverse(*map);
+    al_object_t *heap = al_new_env(root, map, up);
+    al_frame_record_t *record = (al_frame_record_t*)(
+        (uint8_t*)frame - sizeof(al_frame_record_t));
+    *record->owner = heap;
+    return heap;
+}
+
+// Called before `env` is handed to anything that may keep it: closures,
+// defines and primitives, which see the frame only through al_eval.
+static inline void al_escape(void *root, al_object_t **env){
+    if(al_on_frame_stack(*env)){ *env = al_frame_promote(root, *env); }
+}
+
+// *****
+static al_object_t* al_exec_generic(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_DEFINE1(form);
+    al_escape(root, env);
+    *form = node->code->constants[node->source];
+    return al_eval(root, env, form);
+}
+
+#define AL_GUARD(root, env, node)                                   \
+    if(0 <= (node)->guard && !al_guard((env), (node))){             \
+        return al_exec_generic((root), (env), (node));              \
+    }
+
+// *****
+static al_object_t* al_exec_const(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_GUARD(root, env, node);
+    return node->code->constants[node->index];
+}
+
+// *****
+static al_object_t* al_exec_local(
+    void *root, al_object_t **env, al_node_t *node
+){
+    (void)root;
+    al_object_t *bind = al_local_binding(env, node);
+    if(!bind){
+        al_error("ERROR: Undefined symbol: %s",
+            node->code->constants[node->index]->name);
+    }
+    return bind->cdr;
+}
+
+// *****
+static al_object_t* al_exec_global(
+    void *root, al_object_t **env, al_node_t *node
+){
+    (void)root;
+    al_object_t *bind = al_code_binding(env, node->code, node->cache);
+    if(!bind){
+        al_error("ERROR: Undefined symbol: %s",
+            node->code->constants[node->index]->name);
+    }
+    return bind->cdr;
+}
+
+// *****
+static al_object_t* al_exec_dynamic(
+    void *root, al_object_t **env, al_node_t *node
+){
+    (void)root;
+    al_object_t *bind = al_find(env, node->code->constants[node->index]);
+    if(!bind){
+        al_error("ERROR: Undefined symbol: %s",
+            node->code->constants[node->index]->name);
+    }
+    return bind->cdr;
+}
+
+// *****
+static al_object_t* al_exec_setq(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_GUARD(root, env, node);
+    AL_DEFINE1(value);
+    *value = node->kids[0]->exec(root, env, node->kids[0]);
+    al_object_t *bind = al_node_binding(env, node);
+    if(!bind){
+        al_error("ERROR: Unbound variable %s",
+            node->code->constants[node->index]->name);
+    }
+    bind->cdr = *value;
+
+    return *value;
+}
+
+// *****
+static al_object_t* al_exec_progn(
+    void *root, al_object_t **env, al_node_t *node
+){
+    int last = node->count - 1;
+    for(int i=0; i < last; i++){
+        node->kids[i]->exec(root, env, node->kids[i]);
+    }
+    return node->kids[last]->exec(root, env, node->kids[last]);
+}
+
+// *****
+static al_object_t* al_exec_if(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_GUARD(root, env, node);
+    if(node->kids[0]->exec(root, env, node->kids[0]) != al_nil){
+        return node->kids[1]->exec(root, env, node->kids[1]);
+    }
+    return node->kids[2]->exec(root, env, node->kids[2]);
+}
+
+// *****
+static al_object_t* al_exec_while(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_GUARD(root, env, node);
+    while(node->kids[0]->exec(root, env, node->kids[0]) != al_nil){
+        al_step();
+        for(int i=1; i < node->count; i++){
+            node->kids[i]->exec(root, env, node->kids[i]);
+        }
+    }
+
+    return al_nil;
+}
+
+// *****
+static al_object_t* al_exec_lambda(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_GUARD(root, env, node);
+    AL_DEFINE4(map, bind, closure, fn);
+    al_escape(root, env);
+    *closure = *env;
+    if(0 <= node->depth){
+        // Flat closure: a frame sharing the binding conses of the captured
+        // variables, so assignments stay visible on both sides, on top of
+        // the frame globals are looked up from.
+        *map = al_nil;
+        for(int i=node->count - 1; 0 <= i; i--){
+            *bind = al_local_binding(env, node->kids[i]);
+            if(!*bind){
+                al_error("ERROR: Undefined symbol: %s",
+                    node->code->constants[node->kids[i]->index]->name);
+            }
+            *map = al_new_cons(root, bind, map);
+        }
+        *closure = al_frame_at(*env, node->depth);
+        *closure = al_new_env(root, map, closure);
+    }
+    *map = node->code->constants[node->index];
+    *bind = node->code->constants[node->index + 1];
+    *fn = al_new_function(root, closure, ATTOLISP_TYPE_FUNCTION, map, bind);
+    (*fn)->code = node->lambda;
+
+    return *fn;
+}
+
+// *****
+static al_object_t* al_exec_define(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_GUARD(root, env, node);
+    AL_DEFINE2(symbol, value);
+    *value = node->kids[0]->exec(root, env, node->kids[0]);
+    al_escape(root, env);
+    *symbol = node->code->constants[node->index];
+    al_add_variable(root, env, symbol, value);
+
+    return *value;
+}
+
+// *****
+static al_object_t* al_exec_expansion(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_GUARD(root, env, node);
+    return node->kids[0]->exec(root, env, node->kids[0]);
+}
+
+// Hooks a call made by `node`, named after the form it was analyzed from.
+static void al_hook_node(char phase, al_node_t *node, bool function){
+    al_hook_call(phase,
+        node->source < 0 ? al_nil : node->code->constants[node->source],
+        function);
+}
+
+// *****
+static al_object_t* al_exec_builtin(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_GUARD(root, env, node);
+    al_object_t **argv = al_root_reserve(root, node->count);
+    root = argv + node->count;
+    for(int i=0; i < node->count; i++){
+        argv[i] = node->kids[i]->exec(root, env, node->kids[i]);
+    }
+
+    if(!al_hooks){ return node->values(root, argv, node->count); }
+    al_hook_node('B', node, false);
+    al_object_t *result = node->values(root, argv, node->count);
+    al_hook_node('E', node, false);
+    return result;
+}
+
+// *****
+static al_object_t* al_exec_call(
+    void *root, al_object_t **env, al_node_t *node
+){
+    AL_DEFINE2(fn, args);
+    *fn = node->kids[0]->exec(root, env, node->kids[0]);
+    switch(al_type(*fn)){
+    case ATTOLISP_TYPE_FUNCTION:{
+        int argc = node->count - 1;
+        al_object_t **argv = al_root_reserve(root, argc);
+        root = argv + argc;
+        for(int i=0; i < argc; i++){
+            argv[i] = node->kids[i + 1]->exec(root, env, node->kids[i + 1]);
+        }
+        if(!al_hooks){ return al_call_function(root, fn, argv, argc); }
+        al_hook_node('B', node, true);
+        *args = al_call_function(root, fn, argv, argc);
+        al_hook_node('E', node, true);
+        return *args;
+    }
+    case ATTOLISP_TYPE_PRIMITIVE:
+        // primitives still get their arguments unevaluated
+        al_escape(root, env);
+        *args = node->code->constants[node->index];
+        if(!al_hooks){ return (*fn)->fn(root, env, args); }
+        al_hook_node('B', node, false);
+        *args = (*fn)->fn(root, env, args);
+        al_hook_node('E', node, false);
+        return *args;
+    case ATTOLISP_TYPE_MACRO:
+        // defined after this form was analyzed
+        return al_exec_generic(root, env, node);
+    default:
+        al_error("The of a list must be a function");
+    }
+
+    return al_nil; // never reached
+}
+
+// *****
+static al_object_t* al_exec_deopt(
+    void *root, al_object_t **env, al_node_t *node
+){
+    return node->kids[1]->exec(root, env, node->kids[1]);
+}
+
+// Runs the optimized kids[0] while the binding it was derived from holds.
+// Once it does not, the node switches to the plain kids[1] for good.
+static al_object_t* al_exec_guarded(
+    void *root, al_object_t **env, al_node_t *node
+){
+    if(!al_guard(env, node)){
+        node->exec = al_exec_deopt;
+        return al_exec_deopt(root, env, node);
+    }
+    return node->kids[0]->exec(root, env, node->kids[0]);
+}
+
+// An inlined call: kids[0] is the callee's body, run in a frame binding the
+// parameters, and kids[1] the original call, whose arguments it evaluates.
+static al_object_t* al_exec_inline(
+    void *root, al_object_t **env, al_node_t *node
+){
+    if(!al_guard(env, node)){
+        node->exec = al_exec_deopt;
+        return al_exec_deopt(root, env, node);
+    }
+    al_node_t *call = node->kids[1];
+    int argc = call->count - 1;
+    al_object_t **argv = al_root_reserve(root, argc);
+    root = argv + argc;
+    for(int i=0; i < argc; i++){
+        argv[i] = call->kids[i + 1]->exec(root, env, call->kids[i + 1]);
+    }
+    AL_DEFINE3(params, map, symbol);
+    *params = node->code->constants[node->index];
+    if(al_stack_frames){
+        // the inlined body makes no closures, so the frame cannot leak
+        uint8_t *mark = al_frame_top;
+        *map = al_frame_push(map, *params, argv, argc, *env);
+        al_object_t *result = node->kids[0]->exec(root, map, node->kids[0]);
+        al_frame_top = mark;
+        return result;
+    }
+    *map = al_nil;
+    for(int i=0; i < argc; i++, *params = (*params)->cdr){
+        *symbol = (*params)->car;
+        *map = al_acons(root, symbol, &argv[i], map);
+    }
+    *map = al_new_env(root, map, env);
+
+    return node->kids[0]->exec(root, map, node->kids[0]);
+}
+
+// *****
+static al_object_t* al_code_run(
+    void *root, al_object_t **env, al_code_t *code
+){
+    code->active++;
+    al_object_t *result = code->entry->exec(root, env, code->entry);
+    code->active--;
+    return result;
+}
+
+// ---- analysis
+static al_node_t* al_new_node(al_code_t *code, al_exec_t exec, int count){
+    al_node_t *node = al_code_alloc(
+        code, sizeof(al_node_t) + (size_t)count * sizeof(al_node_t*));
+    node->exec = exec;
+    node->code = code;
+    node->index = node->depth = node->cache = -1;
+    node->guard = node->expect = node->source = -1;
+    node->count = count;
+    node->values = NULL;
+    return node;
+}
+
+// *****
+static al_node_t* al_analyze_constant(al_code_t *code, al_object_t *object){
+    al_node_t *node = al_new_node(code, al_exec_const, 0);
+    node->index = al_code_constant(code, object);
+    return node;
+}
+
+// *****
+static al_node_t* al_analyze_generic(al_code_t *code, al_object_t *form){
+    al_node_t *node = al_new_node(code, al_exec_generic, 0);
+    node->source = al_code_constant(code, form);
+    return node;
+}
+
+// *****
+static int al_resolve(al_code_t *code, al_object_t *symbol, int *depth){
+    for(int i=0; i < code->nframes; i++){
+        bool found = false;
+        al_object_t *params = code->constants[code->frames[i].params];
+        for(; al_type(params) == ATTOLISP_TYPE_CELL; params = params->cdr){
+            if(params->car == symbol){ found = true; }
+        }
+        found = found || params == symbol;
+        if(!found && !code->frames[i].dynamic){ continue; }
+        if(0 < code->barrier && code->barrier <= i){
+            code->inline_failed = true;
+        }
+        *depth = i;
+        // a define may shadow anything further out
+        return found ? AL_REF_LOCAL : AL_REF_DYNAMIC;
+    }
+    return AL_REF_GLOBAL;
+}
+
+// Fills in how `node` finds the binding of `symbol`.
+static void al_bind_variable(
+    al_code_t *code, al_node_t *node, al_object_t *symbol
+){
+    int depth;
+    switch(al_resolve(code, symbol, &depth)){
+    case AL_REF_LOCAL:
+        node->depth = depth;
+        node->index = al_code_constant(code, symbol);
+        break;
+    case AL_REF_DYNAMIC:
+        node->index = al_code_constant(code, symbol);
+        break;
+    default:
+        node->cache = al_code_cache(code, symbol);
+        node->index = code->caches[node->cache].symbol;
+    }
+}
+
+// *****
+static al_node_t* al_analyze_variable(al_code_t *code, al_object_t *symbol){
+    al_node_t *node = al_new_node(code, al_exec_global, 0);
+    al_bind_variable(code, node, symbol);
+    if(0 <= node->depth){
+        node->exec = al_exec_local;
+    }else if(node->cache < 0){
+        node->exec = al_exec_dynamic;
+    }
+    return node;
+}
+
+// *****
+static int al_count_cells(al_object_t *list){
+    int count = 0;
+    for(; al_type(list) == ATTOLISP_TYPE_CELL; list = list->cdr){ count++; }
+    return count;
+}
+
+// *****
+static void al_analyze_list(
+    void *root, al_code_t *code, al_object_t **aenv, al_object_t **list,
+    al_node_t **kids
+){
+    AL_DEFINE2(pointer, expr);
+    int i = 0;
+    for(*pointer = *list; al_type(*pointer) == ATTOLISP_TYPE_CELL;
+        *pointer = (*pointer)->cdr
+    ){
+        *expr = (*pointer)->car;
+        kids[i++] = al_analyze(root, code, aenv, expr);
+    }
+}
+
+// *****
+static al_node_t* al_analyze_body(
+    void *root, al_code_t *code, al_object_t **aenv, al_object_t **body
+){
+    int count = al_count_cells(*body);
+    if(count == 0){ return al_analyze_constant(code, al_nil); }
+    if(count == 1){
+        AL_DEFINE1(expr);
+        *expr = (*body)->car;
+        return al_analyze(root, code, aenv, expr);
+    }
+    al_node_t *node = al_new_node(code, al_exec_progn, count);
+    al_analyze_list(root, code, aenv, body, node->kids);
+    return node;
+}
+
+// Collects in `names` the symbols of `object` that are locals of `code`.
+// False if the set cannot be known from the text alone: a macro could
+// introduce references of its own.
+static bool al_collect_free(
+    al_code_t *code, al_object_t **aenv, al_object_t *object,
+    al_object_t *params, al_object_t ***names, int *count, int *capacity
+){
+    for(; al_type(object) == ATTOLISP_TYPE_CELL; object = object->cdr){
+        if(!al_collect_free(code, aenv, object->car, params, names, count,
+            capacity)
+        ){ return false; }
+    }
+    if(al_type(object) != ATTOLISP_TYPE_SYMBOL){ return true; }
+    int depth;
+    if(al_resolve(code, object, &depth) != AL_REF_LOCAL){
+        al_object_t *bind = al_find(aenv, object);
+        return !bind || al_type(bind->cdr) != ATTOLISP_TYPE_MACRO;
+    }
+    for(al_object_t *p = params; al_type(p) == ATTOLISP_TYPE_CELL; p = p->cdr){
+        if(p->car == object){ return true; }
+    }
+    if(params == object){ return true; }
+    for(int i=0; i < *count; i++){
+        if((*names)[i] == object){ return true; }
+    }
+    *names = al_grow(*names, capacity, *count, sizeof(al_object_t*));
+    (*names)[(*count)++] = object;
+    return true;
+}
+
+// `list` is (params body...); NULL when it is malformed.
+static al_node_t* al_analyze_lambda(
+    void *root, al_code_t *code, al_object_t **aenv, al_object_t **list
+){
+    if(al_type(*list) != ATTOLISP_TYPE_CELL || !al_is_list((*list)->car) ||
+        al_type((*list)->cdr) != ATTOLISP_TYPE_CELL
+    ){ return NULL; }
+    al_object_t *pointer = (*list)->car;
+    for(; al_type(pointer) == ATTOLISP_TYPE_CELL; pointer = pointer->cdr){
+        if(al_type(pointer->car) != ATTOLISP_TYPE_SYMBOL){ return NULL; }
+    }
+    if(pointer != al_nil && al_type(pointer) != ATTOLISP_TYPE_SYMBOL){
+        return NULL;
+    }
+
+    // The closure captures only the locals its body mentions, unless a
+    // frame in scope may still get new names through define.
+    bool flat = true;
+    for(int i=0; i < code->nframes; i++){
+        flat = flat && !code->frames[i].dynamic;
+    }
+    al_object_t **names = NULL;
+    int count = 0, capacity = 0;
+    flat = flat && al_collect_free(code, aenv, (*list)->cdr, (*list)->car,
+        &names, &count, &capacity);
+    if(!flat){ count = 0; }
+
+    al_node_t *node = al_new_node(code, al_exec_lambda, count);
+    node->index = al_code_constant(code, (*list)->car);
+    al_code_constant(code, (*list)->cdr);
+    for(int i=0; i < count; i++){
+        node->kids[i] = al_analyze_variable(code, names[i]);
+    }
+    free(names);
+    if(!flat){
+        node->lambda = al_code_new_function(
+            (*list)->car, (*list)->cdr, code, NULL);
+        return node;
+    }
+
+    AL_DEFINE1(captured);
+    *captured = al_nil;
+    for(int i=count - 1; 0 <= i; i--){
+        *captured = al_new_cons(root,
+            &code->constants[node->kids[i]->index], captured);
+    }
+    node->depth = code->nframes;
+    node->lambda = al_code_new_function(
+        (*list)->car, (*list)->cdr, code, *captured);
+    return node;
+}
+
+// Special forms and builtins. Returns NULL for anything it does not handle,
+// including malformed forms, which are then left to the primitive itself.
+static al_node_t* al_analyze_special(
+    void *root, al_code_t *code, al_object_t **aenv, al_object_t **expr,
+    al_primitive_t fn
+){
+    AL_DEFINE2(args, sub);
+    *args = (*expr)->cdr;
+    int argc = al_length(*args);
+    al_node_t *node;
+
+    if(fn == al_primitive_quote){
+        if(argc != 1){ return NULL; }
+        return al_analyze_constant(code, (*args)->car);
+    }
+    if(fn == al_primitive_if){
+        if(argc < 2){ return NULL; }
+        node = al_new_node(code, al_exec_if, 3);
+        *sub = (*args)->car;
+        node->kids[0] = al_analyze(root, code, aenv, sub);
+        *sub = (*args)->cdr->car;
+        node->kids[1] = al_analyze(root, code, aenv, sub);
+        *sub = (*args)->cdr->cdr;
+        node->kids[2] = al_analyze_body(root, code, aenv, sub);
+        return node;
+    }
+    if(fn == al_primitive_while){
+        if(argc < 2){ return NULL; }
+        node = al_new_node(code, al_exec_while, argc);
+        al_analyze_list(root, code, aenv, args, node->kids);
+        return node;
+    }
+    if(fn == al_primitive_setq){
+        if(argc != 2 || al_type((*args)->car) != ATTOLISP_TYPE_SYMBOL){
+            return NULL;
+        }
+        node = al_new_node(code, al_exec_setq, 1);
+        al_bind_variable(code, node, (*args)->car);
+        *sub = (*args)->cdr->car;
+        node->kids[0] = al_analyze(root, code, aenv, sub);
+        return node;
+    }
+    if(fn == al_primitive_lambda){
+        return al_analyze_lambda(root, code, aenv, args);
+    }
+    if(fn == al_primitive_defun){
+        if(argc < 2 || al_type((*args)->car) != ATTOLISP_TYPE_SYMBOL){
+            return NULL;
+        }
+        *sub = (*args)->cdr;
+        al_node_t *lambda = al_analyze_lambda(root, code, aenv, sub);
+        if(!lambda){ return NULL; }
+        node = al_new_node(code, al_exec_define, 1);
+        node->index = al_code_constant(code, (*args)->car);
+        node->kids[0] = lambda;
+        code->saw_define = true;
+        return node;
+    }
+    if(fn == al_primitive_define){
+        if(argc != 2 || al_type((*args)->car) != ATTOLISP_TYPE_SYMBOL){
+            return NULL;
+        }
+        node = al_new_node(code, al_exec_define, 1);
+        node->index = al_code_constant(code, (*args)->car);
+        *sub = (*args)->cdr->car;
+        node->kids[0] = al_analyze(root, code, aenv, sub);
+        code->saw_define = true;
+        return node;
+    }
+    if(fn == al_primitive_defmacro || fn == al_primitive_defmemo){
+        // left to the primitive, but it still defines into this frame
+        code->saw_define = true;
+        return NULL;
+    }
+    if(argc < 0){ return NULL; }
+    for(size_t i=0; i < sizeof(al_builtins) / sizeof(al_builtins[0]); i++){
+        if(al_builtins[i].primitive == fn){
+            node = al_new_node(code, al_exec_builtin, argc);
+            node->values = al_builtins[i].values;
+            al_analyze_list(root, code, aenv, args, node->kids);
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// Guards `node` on the head of `expr` still being bound to `value`.
+static al_node_t* al_set_guard(
+    al_code_t *code, al_node_t *node, al_object_t *expr, al_object_t *value
+){
+    node->guard = al_code_cache(code, expr->car);
+    node->expect = al_code_constant(code, value);
+    node->source = al_code_constant(code, expr);
+    return node;
+}
+
+// -------------------------------
+// -------- OPTIMIZER ------------
+// -------------------------------
+// With ATTOLISP_OPTIMIZE set, analysis also folds builtin arithmetic and
+// comparisons on constants, drops the dead branch of an `if` whose condition
+// is known, and inlines calls to small non-recursive global functions. Each
+// rewrite is guarded on the bindings it relied on and undone when one of
+// them is rebound.
+#define AL_INLINE_SIZE      32      // conses in the inlined body
+#define AL_INLINE_DEPTH     4
+
+static bool al_optimizer = false;
+
+// *****
+static al_node_t* al_new_guarded(
+    al_code_t *code, al_node_t *fast, al_node_t *slow, int guard, int expect
+){
+    if(guard < 0){ return fast; }
+    al_node_t *node = al_new_node(code, al_exec_guarded, 2);
+    node->guard = guard;
+    node->expect = expect;
+    node->kids[0] = fast;
+    node->kids[1] = slow;
+    return node;
+}
+
+// The value `node` always produces, if known. `guard` and `expect` receive
+// the binding that has to stay as it is for that to hold, or -1.
+static bool al_known_value(
+    al_code_t *code, al_object_t **aenv, al_node_t *node,
+    al_object_t **value, int *guard, int *expect
+){
+    if(node->exec == al_exec_const){
+        *value = code->constants[node->index];
+        *guard = node->guard;
+        *expect = node->expect;
+        return true;
+    }
+    if(node->exec == al_exec_global){
+        // only the truth constants, so that a global that keeps changing
+        // does not undo the rewrite as soon as it runs
+        al_object_t *bind = al_find(aenv, code->constants[node->index]);
+        if(!bind || (bind->cdr != al_true && bind->cdr != al_nil)){
+            return false;
+        }
+        *value = bind->cdr;
+        *guard = node->cache;
+        *expect = al_code_constant(code, bind->cdr);
+        return true;
+    }
+    return false;
+}
+
+// *****
+static al_node_t* al_fold_builtin(
+    void *root, al_code_t *code, al_object_t **aenv, al_node_t *node
+){
+    al_values_t fn = node->values;
+    if(fn != al_values_plus && fn != al_values_minus && fn != al_values_lt &&
+        fn != al_values_number_eq && fn != al_values_eq
+    ){ return node; }
+    if(fn == al_values_minus && node->count == 0){ return node; }
+    if((fn == al_values_lt || fn == al_values_number_eq ||
+        fn == al_values_eq) && node->count != 2
+    ){ return node; }
+
+    al_object_t **argv = al_root_reserve(root, node->count);
+    root = argv + node->count;
+    int guards[node->count + 1], expects[node->count + 1];
+    for(int i=0; i < node->count; i++){
+        if(!al_known_value(code, aenv, node->kids[i], &argv[i],
+            &guards[i], &expects[i])
+        ){ return node; }
+        if(fn != al_values_eq && al_type(argv[i]) != ATTOLISP_TYPE_INT){
+            return node;
+        }
+    }
+    guards[node->count] = node->guard;
+    expects[node->count] = node->expect;
+
+    al_node_t *result = al_analyze_constant(code,
+        fn(root, argv, node->count));
+    for(int i=0; i <= node->count; i++){
+        result = al_new_guarded(code, result, node, guards[i], expects[i]);
+    }
+    return result;
+}
+
+// *****
+static al_node_t* al_prune_if(
+    al_code_t *code, al_object_t **aenv, al_node_t *node
+){
+    al_object_t *value;
+    int guard, expect;
+    if(!al_known_value(code, aenv, node->kids[0], &value, &guard, &expect)){
+        return node;
+    }
+    al_node_t *result = node->kids[value != al_nil ? 1 : 2];
+    result = al_new_guarded(code, result, node, guard, expect);
+    return al_new_guarded(code, result, node, node->guard, node->expect);
+}
+
+// *****
+static int al_tree_size(al_object_t *object){
+    int size = 0;
+    for(; al_type(object) == ATTOLISP_TYPE_CELL; object = object->cdr){
+        size += 1 + al_tree_size(object->car);
+    }
+    return size;
+}
+
+// *****
+static bool al_tree_mentions(al_object_t *object, al_object_t *symbol){
+    for(; al_type(object) == ATTOLISP_TYPE_CELL; object = object->cdr){
+        if(al_tree_mentions(object->car, symbol)){ return true; }
+    }
+    return object == symbol;
+}
+
+// Skips the empty frames a closure that captured nothing is made with, so
+// two functions defined at top level are seen to share their globals.
+static al_object_t* al_skip_empty(al_object_t *frame){
+    while(frame->vars == al_nil && frame->up != al_nil){ frame = frame->up; }
+    return frame;
+}
+
+// Replaces `call`, a call of the global function in `fn`, by its body.
+// Only done for small one-expression bodies that do not mention the function
+// itself and see nothing from the caller but the globals they share.
+static al_node_t* al_inline_call(
+    void *root, al_code_t *code, al_object_t **aenv, al_object_t **expr,
+    al_object_t **fn, al_node_t *call
+){
+    if(al_skip_empty((*fn)->env) != al_skip_empty(*aenv) || code->inline_depth == AL_INLINE_DEPTH ||
+        al_memo_of(*fn) ||
+        al_type((*fn)->body) != ATTOLISP_TYPE_CELL ||
+        (*fn)->body->cdr != al_nil ||
+        al_length((*fn)->params) != call->count - 1 ||
+        AL_INLINE_SIZE < al_tree_size((*fn)->body) ||
+        al_tree_mentions((*fn)->body, (*expr)->car)
+    ){ return call; }
+
+    AL_DEFINE1(body);
+    int params = al_code_constant(code, (*fn)->params);
+    int nchildren = code->nchildren;
+    int barrier = code->barrier;
+    bool saw_define = code->saw_define;
+    bool failed = code->inline_failed;
+
+    // the callee's parameters become the innermost frame
+    code->frames = realloc(
+        code->frames, (size_t)(code->nframes + 1) * sizeof(al_frame_t));
+    if(!code->frames){ al_error("Cannot allocate code"); }
+    memmove(code->frames + 1, code->frames,
+        (size_t)code->nframes * sizeof(al_frame_t));
+    code->frames[0] = (al_frame_t){ params, false };
+    code->nframes++;
+    code->barrier = 1;
+    code->inline_failed = false;
+    code->saw_define = false;
+    code->inline_depth++;
+
+    *body = (*fn)->body->car;
+    al_node_t *inlined = al_analyze(root, code, aenv, body);
+    // Nested lambdas are analyzed later, without the barrier, and a define
+    // would go into a frame the caller does not know about.
+    bool ok = !code->inline_failed && !code->saw_define &&
+        code->nchildren == nchildren;
 
-    return al_new_env(root, map, env);
+    code->inline_depth--;
+    code->nframes--;
+    memmove(code->frames, code->frames + 1,
+        (size_t)code->nframes * sizeof(al_frame_t));
+    code->barrier = barrier;
+    code->inline_failed = failed;
+    code->saw_define = saw_define;
+    code->nchildren = nchildren;
+    if(!ok){ return call; }
+
+    al_node_t *node = al_new_node(code, al_exec_inline, 2);
+    node->index = params;
+    node->kids[0] = inlined;
+    node->kids[1] = call;
+    return al_set_guard(code, node, *expr, *fn);
 }
 
 // *****
-static al_object_t* al_progn(
-    void *root, al_object_t **env, al_object_t **list
+static al_node_t* al_analyze_call(
+    void *root, al_code_t *code, al_object_t **aenv, al_object_t **expr
 ){
-    AL_DEFINE2(pointer, result);
-    for(*pointer = *list; *pointer != al_nil; *pointer = (*pointer)->cdr){
-        *result = (*pointer)->car;
-        *result = al_eval(root, env, result);
+    AL_DEFINE2(head, args);
+    *args = (*expr)->cdr;
+    int argc = al_length(*args);
+    if(argc < 0){ return al_analyze_generic(code, *expr); }
+    al_node_t *node = al_new_node(code, al_exec_call, argc + 1);
+    node->index = al_code_constant(code, *args);
+    node->source = al_code_constant(code, *expr);
+    *head = (*expr)->car;
+    node->kids[0] = al_analyze(root, code, aenv, head);
+    al_analyze_list(root, code, aenv, args, node->kids + 1);
+    return node;
+}
+
+// *****
+static al_node_t* al_analyze_form(
+    void *root, al_code_t *code, al_object_t **aenv, al_object_t **expr
+){
+    AL_DEFINE3(bind, value, expanded);
+    int depth;
+    if(al_type((*expr)->car) != ATTOLISP_TYPE_SYMBOL ||
+        al_resolve(code, (*expr)->car, &depth) != AL_REF_GLOBAL
+    ){
+        return al_analyze_call(root, code, aenv, expr);
     }
+    *bind = al_find(aenv, (*expr)->car);
+    if(!*bind){ return al_analyze_call(root, code, aenv, expr); }
+    *value = (*bind)->cdr;
 
-    return *result;
+    if(al_type(*value) == ATTOLISP_TYPE_MACRO){
+        al_node_t *node = al_new_node(code, al_exec_expansion, 1);
+        al_set_guard(code, node, *expr, *value);
+        *expanded = (*expr)->cdr;
+        *expanded = al_apply_callback(root, aenv, value, expanded);
+        node->kids[0] = al_analyze(root, code, aenv, expanded);
+        return node;
+    }
+    if(al_type(*value) == ATTOLISP_TYPE_PRIMITIVE){
+        al_node_t *node = al_analyze_special(
+            root, code, aenv, expr, (*value)->fn);
+        if(node){
+            al_set_guard(code, node, *expr, *value);
+            if(al_optimizer && node->exec == al_exec_builtin){
+                return al_fold_builtin(root, code, aenv, node);
+            }
+            if(al_optimizer && node->exec == al_exec_if){
+                return al_prune_if(code, aenv, node);
+            }
+            return node;
+        }
+    }
+    al_node_t *call = al_analyze_call(root, code, aenv, expr);
+    if(al_optimizer && al_type(*value) == ATTOLISP_TYPE_FUNCTION &&
+        call->exec == al_exec_call
+    ){
+        return al_inline_call(root, code, aenv, expr, value, call);
+    }
+    return call;
 }
 
 // *****
-static al_object_t* al_eval_list(
-    void *root, al_object_t **env, al_object_t **list
+static al_node_t* al_analyze(
+    void *root, al_code_t *code, al_object_t **aenv, al_object_t **expr
 ){
-    AL_DEFINE4(head, pointer, expr, result);
-    *head = al_nil;
-    for(pointer = list; *pointer != al_nil; *pointer = (*pointer)->cdr){
-        *expr = (*pointer)->car;
-        *result = al_eval(root, env, expr);
-        *head = al_new_cons(root, result, head);
+    switch(al_type(*expr)){
+    case ATTOLISP_TYPE_SYMBOL:
+        return al_analyze_variable(code, *expr);
+    case ATTOLISP_TYPE_CELL:
+        return al_analyze_form(root, code, aenv, expr);
+    case ATTOLISP_TYPE_INT:
+    case ATTOLISP_TYPE_PRIMITIVE:
+    case ATTOLISP_TYPE_FUNCTION:
+    case ATTOLISP_TYPE_TRUE:
+    case ATTOLISP_TYPE_NIL:
+        return al_analyze_constant(code, *expr);
+    default:
+        // let al_eval report it
+        return al_analyze_generic(code, *expr);
     }
+}
 
-    return al_reverse(*head);
+// Analyzes the body of the unit of `fn`. Globals are resolved against the
+// frame the closure was created in, walked out to the unit's static scope.
+static void al_code_prepare(void *root, al_code_t *code, al_object_t **fn){
+    AL_DEFINE2(aenv, body);
+    *aenv = al_frame_at((*fn)->env, code->nframes - 1);
+    code->active++;
+    code->preparing = true;
+    al_node_t *entry;
+    for(;;){
+        code->saw_define = false;
+        code->nchildren = 0;
+        *body = code->constants[code->body];
+        entry = al_analyze_body(root, code, aenv, body);
+        if(!code->saw_define || code->frames[0].dynamic){ break; }
+        // The body defines into its own frame, so names that are not
+        // parameters cannot be resolved past it after all.
+        code->frames[0].dynamic = true;
+    }
+    code->entry = entry;
+    // A frame can only leak through a closure made in it or a define into
+    // it; everything else that may keep it promotes it first (al_escape).
+    code->stack_frame = al_stack_frames && !code->frames[0].dynamic &&
+        code->nchildren == 0 && 0 <= code->arity;
+    code->preparing = false;
+    code->active--;
 }
 
 // *****
-static bool al_is_list(al_object_t *object){
-    return object == al_nil || object->type == ATTOLISP_TYPE_CELL;
+static al_object_t* al_run_function(
+    void *root, al_object_t **fn, al_object_t **argv, int argc
+){
+    AL_DEFINE3(params, frame, args);
+    if(!(*fn)->code){
+        (*fn)->code = al_code_new_function(
+            (*fn)->params, (*fn)->body, NULL, NULL);
+    }
+    al_code_t *code = (*fn)->code;
+    if(!code->entry && !code->preparing){
+        al_code_prepare(root, code, fn);
+    }
+    if(code->stack_frame && argc == code->arity){
+        uint8_t *mark = al_frame_top;
+        *frame = al_frame_push(frame, (*fn)->params, argv, argc, (*fn)->env);
+        al_object_t *result = al_code_run(root, frame, code);
+        al_frame_top = mark;
+        return result;
+    }
+
+    *args = al_nil;
+    for(int i=argc - 1; 0 <= i; i--){
+        *args = al_new_cons(root, &argv[i], args);
+    }
+    *params = (*fn)->params;
+    *frame = (*fn)->env;
+    *frame = al_push_env(root, frame, params, args);
+    if(!code->entry){
+        // called by a macro while its own body is being analyzed
+        *args = (*fn)->body;
+        return al_progn(root, frame, args);
+    }
+    return al_code_run(root, frame, code);
 }
 
 // *****
-static al_object_t* al_apply_callback(
-    void *root,
-    al_object_t **env,
-    al_object_t **callback,
-    al_object_t **args
+static al_object_t* al_call_function(
+    void *root, al_object_t **fn, al_object_t **argv, int argc
 ){
-    AL_DEFINE3(params, newEnv, body);
-    *params = (*callback)->params;
-    *newEnv = (*callback)->env;
-    *newEnv = al_push_env(root, newEnv, params, args);
-    *body = (*callback)->body;
-
-    return al_progn(root, newEnv, body);
+    al_enter();
+    al_memo_t *memo = al_memo_of(*fn);
+    uint64_t hash;
+    al_object_t *result;
+    if(!memo || !al_memo_hash(argv, argc, &hash)){
+        result = al_run_function(root, fn, argv, argc);
+    }else if(!(result = al_memo_lookup(memo, hash, argv, argc))){
+        result = al_run_function(root, fn, argv, argc);
+        al_memo_store(memo, hash, argv, argc, result);
+    }
+    al_depth_left++;
+    return result;
 }
 
 // *****
-static al_object_t* al_apply(
-    void *root,
-    al_object_t **env,
-    al_object_t **fn,
-    al_object_t **args
+static al_object_t* al_apply_function(
+    void *root, al_object_t **fn, al_object_t **args
 ){
-    if(!al_is_list(*args)){
-        al_error("ERROR: argument must be a list");
+    int argc = al_count_cells(*args);
+    al_object_t **argv = al_root_reserve(root, argc + 1);
+    root = argv + argc + 1;
+    argv[argc] = *args;
+    for(int i=0; i < argc; i++, argv[argc] = argv[argc]->cdr){
+        argv[i] = argv[argc]->car;
     }
-    // if((*fn)->type != ATTOLISP_TYPE_FUNCTION ||
-    //     (*fn)->type != ATTOLISP_TYPE_PRIMITIVE
-    // ){
-    //     al_error("ERROR:: not supported");
-    // }
-    if((*fn)->type == ATTOLISP_TYPE_PRIMITIVE){
-        return (*fn)->fn(root, env, args);
+    if(argv[argc] != al_nil){
+        al_error("ERROR: Cannot apply function: number of argument does "
+            "match");
     }
-    if((*fn)->type == ATTOLISP_TYPE_FUNCTION){
-        AL_DEFINE1(xargs);
-        *xargs = al_eval_list(root, env, args);
-        return al_apply_callback(root, env, fn, xargs);
+    return al_call_function(root, fn, argv, argc);
+}
+
+// Analyzes and runs one top-level form.
+static al_object_t* al_eval_toplevel(
+    void *root, al_object_t **env, al_object_t **expr
+){
+    al_quota_start();
+    al_object_t *result;
+    if(!al_analyzer){
+        result = al_eval(root, env, expr);
+    }else{
+        al_code_t *code = al_code_new();
+        code->active++;
+        code->entry = al_analyze(root, code, env, expr);
+        result = al_code_run(root, env, code);
+        code->active--;
     }
-    al_error("ERROR:: not supported");
-    //return al_nil; // never reached
+    al_quota_end();
+    return result;
 }
 
+
+// ------------------------------------------------------------------
+//                      COMPILER TO C
+// ------------------------------------------------------------------
+// `--compile-c file.alsp` translates each top-level defun, or define of a
+// lambda, into a C function written against al_runtime_t. A compiled
+// function keeps its values in a block of shadow-stack slots R[], computes
+// integer arithmetic and comparisons unboxed, and calls the other functions
+// of the same file directly. Each of those inlined or direct calls first
+// checks that its name is still bound to what it was when the module was
+// loaded, and otherwise calls the new value like the interpreter would.
+// Integer literals stay distinct objects, as they are to eq in the
+// interpreter. A function using something the compiler does not handle
+// (nested lambdas, macros, rest parameters, ...) is left to the
+// interpreter: the module keeps it, like every other top-level form, and
+// evaluates it when it is loaded, so loading the module stands in for
+// loading the file.
+#define AL_CC_MAX_FUNCTIONS 1024
+#define AL_CC_MAX_CONSTANTS 4096
+
+typedef struct al_cc_function_t {
+    al_object_t *form;              // the defun or define
+    al_object_t *name;
+    al_object_t *params;
+    al_object_t *body;
+    int arity;
+    bool failed;
+    char *text;
+    size_t len;
+} al_cc_function_t;
+
+typedef struct al_cc_t {
+    // module
+    al_cc_function_t functions[AL_CC_MAX_FUNCTIONS];
+    int nfunctions;
+    al_object_t *macros[AL_CC_MAX_FUNCTIONS];
+    int nmacros;
+    al_object_t *constants[AL_CC_MAX_CONSTANTS];
+    int nconstants;
+    int globals[AL_CC_MAX_CONSTANTS];   // constant index of each symbol
+    bool guarded[AL_CC_MAX_CONSTANTS];  // value kept in V[] at load time
+    int nglobals;
+    // function being compiled
+    al_cc_function_t *function;
+    FILE *out;
+    int indent;
+    int top;
+    int nslots;
+    int nints;
+    int nconds;
+    const char *error;
+} al_cc_t;
+
+static bool al_cc_expr(al_cc_t *cc, al_object_t *expr, int target);
+static bool al_cc_call(
+    al_cc_t *cc, al_object_t *head, al_object_t *args, int target);
+
 // *****
-static al_object_t* al_find(al_object_t **env, al_object_t *sym){
-    for(al_object_t *pointer = *env; pointer != al_nil; pointer = pointer->up){
-        for(al_object_t *cell=pointer->vars; cell!=al_nil; cell=cell->cdr){
-            al_object_t *bind = cell->car;
-            if(sym == bind->car){ return bind; }
+static void al_cc_emit(al_cc_t *cc, const char *fmt, ...){
+    va_list args;
+    va_start(args, fmt);
+    fprintf(cc->out, "%*s", 4 * cc->indent, "");
+    vfprintf(cc->out, fmt, args);
+    fprintf(cc->out, "\n");
+    va_end(args);
+}
+
+// *****
+static bool al_cc_fail(al_cc_t *cc, const char *why){
+    if(!cc->error){ cc->error = why; }
+    return false;
+}
+
+// *****
+static bool al_cc_is(al_object_t *object, const char *name){
+    return al_type(object) == ATTOLISP_TYPE_SYMBOL &&
+        strcmp(object->name, name) == 0;
+}
+
+// Writes a C identifier for a symbol name.
+static void al_cc_mangle(FILE *out, const char *prefix, al_object_t *symbol){
+    fputs(prefix, out);
+    for(const char *c = symbol->name; *c; c++){
+        if(isalnum((unsigned char)*c)){
+            fputc(*c, out);
+        }else{
+            fprintf(out, "_%02x", (unsigned char)*c);
         }
     }
+}
 
-    return NULL;
+// *****
+static int al_cc_slot(al_cc_t *cc){
+    int slot = cc->top++;
+    if(cc->nslots < cc->top){ cc->nslots = cc->top; }
+    return slot;
 }
 
 // *****
-static al_object_t* al_macroexpand(
-    void *root,
-    al_object_t **env,
-    al_object_t **object
-){
-    if((*object)->type != ATTOLISP_TYPE_CELL ||
-        (*object)->car->type != ATTOLISP_TYPE_SYMBOL
-    ){ return *object; }
-    AL_DEFINE3(bind, macro, args);
-    *bind = al_find(env, (*object)->car);
-    if(!*bind || (*bind)->cdr->type != ATTOLISP_TYPE_MACRO){
-        return *object;
+static int al_cc_param(al_cc_t *cc, al_object_t *symbol){
+    int index = 0;
+    for(al_object_t *pointer = cc->function->params;
+        al_type(pointer) == ATTOLISP_TYPE_CELL; pointer = pointer->cdr, index++
+    ){
+        if(pointer->car == symbol){ return index; }
     }
-    *macro = (*bind)->cdr;
-    *args = (*object)->cdr;
-    return al_apply_callback(root, env, macro, args);
+    return -1;
 }
 
 // *****
-static al_object_t* al_eval(
-    void *root,
-    al_object_t **env, al_object_t **object
-){
-    al_object_t *result;
-    switch((*object)->type){
-    case ATTOLISP_TYPE_INT:
-    case ATTOLISP_TYPE_PRIMITIVE:
-    case ATTOLISP_TYPE_FUNCTION:
-    case ATTOLISP_TYPE_TRUE:
-    case ATTOLISP_TYPE_NIL:
-        //result = 
-        return *object;
-        //break;
-    case ATTOLISP_TYPE_SYMBOL:{
-        al_object_t *bind = al_find(env, *object);
-        if(!bind){
-            al_error("ERROR: Undefined symbol: %s", (*object)->name);
-        }
-        //result = 
-        return bind->cdr;
-        //break;
+static int al_cc_constant(al_cc_t *cc, al_object_t *object){
+    for(int i=0; i < cc->nconstants; i++){
+        al_object_t *constant = cc->constants[i];
+        if(constant == object){ return i; }
     }
-    
-    case ATTOLISP_TYPE_CELL:{
-        AL_DEFINE3(fn, expanded, args);
-        *expanded = al_macroexpand(root, env, object);
-        if(*expanded != *object){
-            return al_eval(root, env, expanded);
-        }
-        *fn = (*object)->car;
-        *fn = al_eval(root, env, fn);
-        *args = (*object)->cdr;
-        if((*fn)->type != ATTOLISP_TYPE_PRIMITIVE &&
-            (*fn)->type != ATTOLISP_TYPE_FUNCTION
-        ){
-            al_error("The of a list must be a function");  
-        }
-        return al_apply(root, env, fn, args);
+    if(cc->nconstants == AL_CC_MAX_CONSTANTS){
+        al_error("compile: too many constants");
     }
-    default:
-        al_error("ERROR:: eval: Unknown tag type: %d\n", (*object)->type);
-    }// end switch
+    cc->constants[cc->nconstants] = object;
+    return cc->nconstants++;
+}
 
-    ///return result; // never reached
+// Index of the cached binding for a global symbol.
+static int al_cc_global(al_cc_t *cc, al_object_t *symbol){
+    int constant = al_cc_constant(cc, symbol);
+    for(int i=0; i < cc->nglobals; i++){
+        if(cc->globals[i] == constant){ return i; }
+    }
+    cc->globals[cc->nglobals] = constant;
+    cc->guarded[cc->nglobals] = false;
+    return cc->nglobals++;
 }
 
+// Opens the branch taken while `symbol` keeps its value from load time;
+// the caller compiles the fast path, then al_cc_otherwise, then closes it.
+static void al_cc_guard(al_cc_t *cc, al_object_t *symbol){
+    int global = al_cc_global(cc, symbol);
+    cc->guarded[global] = true;
+    al_cc_emit(cc, "if(alc_global(%d)->cdr == V[%d]){", global, global);
+    cc->indent++;
+}
 
-// ------------------------------------------------------------------
-//              PRIMITIVE FUNCTIONS AND SPECIAL FORMS
-// ------------------------------------------------------------------
-static al_object_t* al_primitive_quote(
-    void *root, al_object_t **env, al_object_t **list
+// Ends the fast path and calls the rebound function into `target`.
+static bool al_cc_otherwise(
+    al_cc_t *cc, al_object_t *head, al_object_t *args, int target
 ){
-    if(al_length(*list) != 1){ al_error("Malformed quote");}
-    return (*list)->car;
+    cc->indent--;
+    al_cc_emit(cc, "}else{");
+    cc->indent++;
+    return al_cc_call(cc, head, args, target);
 }
 
 // *****
-static al_object_t* al_primitive_cons(
-    void *root, al_object_t **env, al_object_t **list
-){
-    if(al_length(*list) != 2){ al_error("Malformed cons"); }
-    al_object_t *cell = al_eval_list(root, env, list);
-    cell->cdr = cell->cdr->car;
-
-    return cell;
+static al_cc_function_t* al_cc_function(al_cc_t *cc, al_object_t *symbol){
+    for(int i=0; i < cc->nfunctions; i++){
+        if(cc->functions[i].name == symbol && !cc->functions[i].failed){
+            return &cc->functions[i];
+        }
+    }
+    return NULL;
 }
 
 // *****
-static al_object_t* al_primitive_car(
-    void *root, al_object_t **env, al_object_t **list
+static bool al_cc_is_macro(al_cc_t *cc, al_object_t *symbol){
+    for(int i=0; i < cc->nmacros; i++){
+        if(cc->macros[i] == symbol){ return true; }
+    }
+    return false;
+}
+
+// Compiles a body into `target`; returns false if it cannot be compiled.
+static bool al_cc_progn(al_cc_t *cc, al_object_t *body, int target){
+    if(body == al_nil){
+        al_cc_emit(cc, "R[%d] = rt->nil;", target);
+        return true;
+    }
+    for(; al_type(body) == ATTOLISP_TYPE_CELL; body = body->cdr){
+        if(!al_cc_expr(cc, body->car, target)){ return false; }
+    }
+    return true;
+}
+
+static int al_cc_int(al_cc_t *cc, al_object_t *expr);
+
+// Computes (+ ...) or (- x ...) unboxed into the variable `var`.
+static bool al_cc_arith(al_cc_t *cc, al_object_t *expr, int var){
+    if(al_cc_is(expr->car, "+")){
+        al_cc_emit(cc, "i%d = 0;", var);
+        for(al_object_t *args = expr->cdr; args != al_nil; args = args->cdr){
+            int value = al_cc_int(cc, args->car);
+            if(value < 0){ return false; }
+            al_cc_emit(cc, "i%d = (int)((unsigned)i%d + (unsigned)i%d);",
+                var, var, value);
+        }
+        return true;
+    }
+    int value = al_cc_int(cc, expr->cdr->car);
+    if(value < 0){ return false; }
+    if(expr->cdr->cdr == al_nil){
+        al_cc_emit(cc, "i%d = (int)(0u - (unsigned)i%d);", var, value);
+        return true;
+    }
+    al_cc_emit(cc, "i%d = i%d;", var, value);
+    for(al_object_t *args = expr->cdr->cdr; args != al_nil; args = args->cdr){
+        value = al_cc_int(cc, args->car);
+        if(value < 0){ return false; }
+        al_cc_emit(cc, "i%d = (int)((unsigned)i%d - (unsigned)i%d);",
+            var, var, value);
+    }
+    return true;
+}
+
+// Compiles an expression whose value must be an integer into the unboxed
+// variable it returns, or -1.
+static int al_cc_int(al_cc_t *cc, al_object_t *expr){
+    int var = cc->nints++;
+    if(al_type(expr) == ATTOLISP_TYPE_INT){
+        al_cc_emit(cc, "i%d = %d;", var, expr->value);
+        return var;
+    }
+    if(al_type(expr) == ATTOLISP_TYPE_SYMBOL && 0 <= al_cc_param(cc, expr)){
+        al_cc_emit(cc, "i%d = alc_int(R[%d]);", var, al_cc_param(cc, expr));
+        return var;
+    }
+    bool arith = al_type(expr) == ATTOLISP_TYPE_CELL &&
+        (al_cc_is(expr->car, "+") ||
+            (al_cc_is(expr->car, "-") && expr->cdr != al_nil)) &&
+        al_cc_param(cc, expr->car) < 0 && 0 <= al_length(expr->cdr);
+    if(arith){
+        int slot = al_cc_slot(cc);
+        al_cc_guard(cc, expr->car);
+        if(!al_cc_arith(cc, expr, var) ||
+            !al_cc_otherwise(cc, expr->car, expr->cdr, slot)
+        ){ return -1; }
+        al_cc_emit(cc, "i%d = alc_int(R[%d]);", var, slot);
+        cc->indent--;
+        al_cc_emit(cc, "}");
+        cc->top--;
+        return var;
+    }
+    int slot = al_cc_slot(cc);
+    if(!al_cc_expr(cc, expr, slot)){ return -1; }
+    al_cc_emit(cc, "i%d = alc_int(R[%d]);", var, slot);
+    cc->top--;
+    return var;
+}
+
+// Compiles a condition into the C truth value it returns, or -1.
+static int al_cc_test(al_cc_t *cc, al_object_t *expr){
+    int var = cc->nconds++;
+    if(expr == al_nil){
+        al_cc_emit(cc, "c%d = 0;", var);
+        return var;
+    }
+    if(al_type(expr) == ATTOLISP_TYPE_CELL && al_length(expr) == 3 &&
+        al_cc_param(cc, expr->car) < 0
+    ){
+        al_object_t *op = expr->car;
+        al_object_t *x = expr->cdr->car;
+        al_object_t *y = expr->cdr->cdr->car;
+        bool compare = al_cc_is(op, "<") || al_cc_is(op, "=");
+        if(compare || al_cc_is(op, "eq")){
+            int slot = al_cc_slot(cc);
+            al_cc_guard(cc, op);
+            if(compare){
+                int a = al_cc_int(cc, x);
+                int b = a < 0 ? -1 : al_cc_int(cc, y);
+                if(b < 0){ return -1; }
+                al_cc_emit(cc, "c%d = i%d %s i%d;",
+                    var, a, al_cc_is(op, "<") ? "<" : "==", b);
+            }else{
+                int a = al_cc_slot(cc);
+                int b = al_cc_slot(cc);
+                if(!al_cc_expr(cc, x, a) || !al_cc_expr(cc, y, b)){
+                    return -1;
+                }
+                al_cc_emit(cc, "c%d = R[%d] == R[%d];", var, a, b);
+                cc->top -= 2;
+            }
+            if(!al_cc_otherwise(cc, op, expr->cdr, slot)){ return -1; }
+            al_cc_emit(cc, "c%d = R[%d] != rt->nil;", var, slot);
+            cc->indent--;
+            al_cc_emit(cc, "}");
+            cc->top--;
+            return var;
+        }
+    }
+    int slot = al_cc_slot(cc);
+    if(!al_cc_expr(cc, expr, slot)){ return -1; }
+    al_cc_emit(cc, "c%d = R[%d] != rt->nil;", var, slot);
+    cc->top--;
+    return var;
+}
+
+// Calls whatever `head` evaluates to with the runtime's apply.
+static bool al_cc_call(
+    al_cc_t *cc, al_object_t *head, al_object_t *args, int target
 ){
-    al_object_t *args = al_eval_list(root, env, list);
-    if(args->car->type != ATTOLISP_TYPE_CELL || args->cdr != al_nil){
-        al_error("Malformed car");
+    int fn = al_cc_slot(cc);
+    if(!al_cc_expr(cc, head, fn)){ return false; }
+    int base = cc->top;
+    int count = 0;
+    for(; args != al_nil; args = args->cdr, count++){
+        if(!al_cc_expr(cc, args->car, al_cc_slot(cc))){ return false; }
     }
-    return args->car->car;
+    int list = al_cc_slot(cc);
+    al_cc_emit(cc, "R[%d] = rt->nil;", list);
+    for(int i = count - 1; 0 <= i; i--){
+        al_cc_emit(cc, "R[%d] = rt->new_cons(root, &R[%d], &R[%d]);",
+            list, base + i, list);
+    }
+    al_cc_emit(cc, "R[%d] = rt->apply(root, &ENV, &R[%d], &R[%d]);",
+        target, fn, list);
+    cc->top = fn;
+    return true;
 }
 
-static al_object_t* al_primitive_cdr(
-    void *root, al_object_t **env, al_object_t **list
+// Whether a call to `head` with `count` arguments is compiled inline.
+static bool al_cc_builtin(al_object_t *head, int count){
+    return ((al_cc_is(head, "car") || al_cc_is(head, "cdr") ||
+        al_cc_is(head, "println")) && count == 1) ||
+        ((al_cc_is(head, "cons") || al_cc_is(head, "setcar")) && count == 2);
+}
+
+// Compiles an inlined builtin, or a direct call of a compiled function.
+static bool al_cc_direct(
+    al_cc_t *cc, al_object_t *head, al_object_t *args, int target
 ){
-    al_object_t *args = al_eval_list(root, env, list);
-    if(args->car->type != ATTOLISP_TYPE_CELL || args->cdr != al_nil){
-        al_error("Malformed car");
+    if(al_cc_is(head, "car") || al_cc_is(head, "cdr")){
+        if(!al_cc_expr(cc, args->car, target)){ return false; }
+        al_cc_emit(cc, "if(rt->type(R[%d]) != ATTOLISP_TYPE_CELL){ "
+            "rt->error(\"Malformed %s\"); }", target, head->name);
+        al_cc_emit(cc, "R[%d] = R[%d]->%s;", target, target, head->name);
+        return true;
+    }
+    if(al_cc_is(head, "cons") || al_cc_is(head, "setcar")){
+        int a = al_cc_slot(cc);
+        int b = al_cc_slot(cc);
+        if(!al_cc_expr(cc, args->car, a) ||
+            !al_cc_expr(cc, args->cdr->car, b)
+        ){ return false; }
+        if(al_cc_is(head, "cons")){
+            al_cc_emit(cc, "R[%d] = rt->new_cons(root, &R[%d], &R[%d]);",
+                target, a, b);
+        }else{
+            al_cc_emit(cc, "if(rt->type(R[%d]) != ATTOLISP_TYPE_CELL){ "
+                "rt->error(\"Malformed setcar\"); }", a);
+            al_cc_emit(cc, "R[%d]->car = R[%d];", a, b);
+            al_cc_emit(cc, "R[%d] = R[%d];", target, a);
+        }
+        cc->top -= 2;
+        return true;
     }
-    return args->car->cdr;
+    if(al_cc_is(head, "println")){
+        if(!al_cc_expr(cc, args->car, target)){ return false; }
+        al_cc_emit(cc, "rt->print(R[%d]);", target);
+        al_cc_emit(cc, "printf(\"\\n\");");
+        al_cc_emit(cc, "R[%d] = rt->nil;", target);
+        return true;
+    }
+
+    int base = cc->top;
+    for(; args != al_nil; args = args->cdr){
+        if(!al_cc_expr(cc, args->car, al_cc_slot(cc))){ return false; }
+    }
+    fprintf(cc->out, "%*sR[%d] = ", 4 * cc->indent, "", target);
+    al_cc_mangle(cc->out, "alc_f_", head);
+    fprintf(cc->out, "(root, &R[%d]);\n", base);
+    cc->top = base;
+    return true;
 }
 
 // *****
-static al_object_t* al_primitive_setq(
-    void *root, al_object_t **env, al_object_t **list
-){
-    if(al_length(*list) != 2 || (*list)->car->type != ATTOLISP_TYPE_SYMBOL){
-        al_error("Malformed setq");
+static bool al_cc_form(al_cc_t *cc, al_object_t *expr, int target){
+    al_object_t *head = expr->car;
+    al_object_t *args = expr->cdr;
+    int count = al_length(args);
+    if(count < 0){ return al_cc_fail(cc, "dotted argument list"); }
+    if(al_type(head) != ATTOLISP_TYPE_SYMBOL || 0 <= al_cc_param(cc, head)){
+        return al_cc_call(cc, head, args, target);
     }
 
-    AL_DEFINE2(bind, value);
-    *bind = al_find(env, (*list)->car);
-    if(!*bind){
-        al_error("ERROR: Unbound variable %s", (*list)->car->name);
+    if(al_cc_is(head, "quote")){
+        if(count != 1){ return al_cc_fail(cc, "malformed quote"); }
+        al_cc_emit(cc, "R[%d] = K[%d];",
+            target, al_cc_constant(cc, args->car));
+        return true;
+    }
+    if(al_cc_is(head, "if")){
+        if(count < 2){ return al_cc_fail(cc, "malformed if"); }
+        int test = al_cc_test(cc, args->car);
+        if(test < 0){ return false; }
+        al_cc_emit(cc, "if(c%d){", test);
+        cc->indent++;
+        if(!al_cc_expr(cc, args->cdr->car, target)){ return false; }
+        cc->indent--;
+        al_cc_emit(cc, "}else{");
+        cc->indent++;
+        if(!al_cc_progn(cc, args->cdr->cdr, target)){ return false; }
+        cc->indent--;
+        al_cc_emit(cc, "}");
+        return true;
+    }
+    if(al_cc_is(head, "while")){
+        if(count < 2){ return al_cc_fail(cc, "malformed while"); }
+        al_cc_emit(cc, "for(;;){");
+        cc->indent++;
+        al_cc_emit(cc, "alc_step();");
+        int test = al_cc_test(cc, args->car);
+        if(test < 0){ return false; }
+        al_cc_emit(cc, "if(!c%d){ break; }", test);
+        int scratch = al_cc_slot(cc);
+        if(!al_cc_progn(cc, args->cdr, scratch)){ return false; }
+        cc->top--;
+        cc->indent--;
+        al_cc_emit(cc, "}");
+        al_cc_emit(cc, "R[%d] = rt->nil;", target);
+        return true;
+    }
+    if(al_cc_is(head, "setq")){
+        if(count != 2 || al_type(args->car) != ATTOLISP_TYPE_SYMBOL){
+            return al_cc_fail(cc, "malformed setq");
+        }
+        int value = al_cc_slot(cc);
+        if(!al_cc_expr(cc, args->cdr->car, value)){ return false; }
+        int param = al_cc_param(cc, args->car);
+        if(0 <= param){
+            al_cc_emit(cc, "R[%d] = R[%d];", param, value);
+        }else{
+            al_cc_emit(cc, "alc_global(%d)->cdr = R[%d];",
+                al_cc_global(cc, args->car), value);
+        }
+        al_cc_emit(cc, "R[%d] = R[%d];", target, value);
+        cc->top--;
+        return true;
+    }
+    if(al_cc_is(head, "lambda") || al_cc_is(head, "defun") ||
+        al_cc_is(head, "defmacro") || al_cc_is(head, "define") ||
+        al_cc_is(head, "macroexpand")
+    ){
+        return al_cc_fail(cc, "nested definition");
+    }
+    if(al_cc_is_macro(cc, head)){
+        return al_cc_fail(cc, "macro call");
+    }
+    if(al_cc_is(head, "+") || (al_cc_is(head, "-") && 0 < count)){
+        int value = al_cc_int(cc, expr);
+        if(value < 0){ return false; }
+        al_cc_emit(cc, "R[%d] = rt->new_int(root, i%d);", target, value);
+        return true;
+    }
+    if((al_cc_is(head, "<") || al_cc_is(head, "=") || al_cc_is(head, "eq"))
+        && count == 2
+    ){
+        int test = al_cc_test(cc, expr);
+        if(test < 0){ return false; }
+        al_cc_emit(cc, "R[%d] = c%d ? rt->true_ : rt->nil;", target, test);
+        return true;
     }
-    *value = (*list)->cdr->car;
-    *value = al_eval(root, env, value);
-    (*bind)->cdr = *value;
 
-    return *value;
+    al_cc_function_t *callee = al_cc_function(cc, head);
+    if(callee && callee->arity != count){
+        return al_cc_fail(cc, "wrong number of arguments in a call");
+    }
+    if(!callee && !al_cc_builtin(head, count)){
+        return al_cc_call(cc, head, args, target);
+    }
+    al_cc_guard(cc, head);
+    if(!al_cc_direct(cc, head, args, target) ||
+        !al_cc_otherwise(cc, head, args, target)
+    ){ return false; }
+    cc->indent--;
+    al_cc_emit(cc, "}");
+    return true;
 }
 
 // *****
-static al_object_t* al_primitive_setcar(
-    void *root, al_object_t **env, al_object_t **list
-){
-    AL_DEFINE1(args);
-    *args = al_eval_list(root, env, list);
-    if(al_length(*args) != 2 || (*args)->car->type != ATTOLISP_TYPE_CELL){
-        al_error("Malformed setcar");
+static bool al_cc_expr(al_cc_t *cc, al_object_t *expr, int target){
+    switch(al_type(expr)){
+    case ATTOLISP_TYPE_INT:
+        al_cc_emit(cc, "R[%d] = K[%d];", target, al_cc_constant(cc, expr));
+        return true;
+    case ATTOLISP_TYPE_NIL:
+        al_cc_emit(cc, "R[%d] = rt->nil;", target);
+        return true;
+    case ATTOLISP_TYPE_SYMBOL:{
+        int param = al_cc_param(cc, expr);
+        if(0 <= param){
+            al_cc_emit(cc, "R[%d] = R[%d];", target, param);
+        }else{
+            al_cc_emit(cc, "R[%d] = alc_global(%d)->cdr;",
+                target, al_cc_global(cc, expr));
+        }
+        return true;
+    }
+    case ATTOLISP_TYPE_CELL:
+        if(al_cc_is_macro(cc, expr->car)){
+            return al_cc_fail(cc, "macro call");
+        }
+        return al_cc_form(cc, expr, target);
+    default:
+        return al_cc_fail(cc, "unsupported literal");
     }
-    (*args)->car->car = (*args)->cdr->car;
-
-    return (*args)->car;
 }
 
-// *****
-static al_object_t* al_primitive_while(
-    void *root, al_object_t **env, al_object_t **list
-){
-    if(al_length(*list) < 2){
-        al_error("ERROR: Malformed while");
+// Generates the direct entry point of one function.
+static bool al_cc_function_body(al_cc_t *cc, al_cc_function_t *function){
+    char *body;
+    size_t len;
+    cc->function = function;
+    cc->out = open_memstream(&body, &len);
+    cc->indent = 1;
+    cc->top = cc->nslots = function->arity;
+    cc->nints = cc->nconds = 0;
+    cc->error = NULL;
+    int result = al_cc_slot(cc);
+    bool ok = al_cc_progn(cc, function->body, result);
+    al_cc_emit(cc, "++*rt->depth_left;");
+    al_cc_emit(cc, "return R[%d];", result);
+    fclose(cc->out);
+    if(!ok){
+        free(body);
+        return false;
     }
-    AL_DEFINE2(cond, exprs);
-    *cond = (*list)->car;
-    while(al_eval(root, env, cond) != al_nil){
-        *exprs = (*list)->cdr;
-        al_eval_list(root, env, exprs);
+
+    FILE *out = open_memstream(&function->text, &function->len);
+    fprintf(out, "// %s\n", function->name->name);
+    fprintf(out, "static al_object_t* ");
+    al_cc_mangle(out, "alc_f_", function->name);
+    fprintf(out, "(void *root, al_object_t **args){\n");
+    fprintf(out, "    al_object_t **R = rt->reserve(root, %d);\n", cc->nslots);
+    fprintf(out, "    root = R + %d;\n", cc->nslots);
+    fprintf(out, "    alc_enter();\n");
+    for(int i=0; i < cc->nints; i++){
+        fprintf(out, "%si%d%s", i % 8 ? " " : "    int ", i,
+            i % 8 == 7 || i + 1 == cc->nints ? ";\n" : ",");
+    }
+    for(int i=0; i < cc->nconds; i++){
+        fprintf(out, "%sc%d%s", i % 8 ? " " : "    int ", i,
+            i % 8 == 7 || i + 1 == cc->nconds ? ";\n" : ",");
     }
+    for(int i=0; i < function->arity; i++){
+        fprintf(out, "    R[%d] = args[%d];\n", i, i);
+    }
+    fwrite(body, 1, len, out);
+    fprintf(out, "}\n\n");
 
-    return al_nil;
+    // Primitive entry point: evaluates the arguments in the caller's env.
+    int arity = function->arity;
+    fprintf(out, "static al_object_t* ");
+    al_cc_mangle(out, "alc_p_", function->name);
+    fprintf(out, "(void *root, al_object_t **env, al_object_t **list){\n");
+    fprintf(out, "    al_object_t **R = rt->reserve(root, %d);\n", arity + 1);
+    fprintf(out, "    root = R + %d;\n", arity + 1);
+    fprintf(out, "    int i = 0;\n");
+    fprintf(out, "    for(R[%d] = *list; i < %d && "
+        "rt->type(R[%d]) == ATTOLISP_TYPE_CELL; i++){\n", arity, arity, arity);
+    fprintf(out, "        R[i] = R[%d]->car;\n", arity);
+    fprintf(out, "        R[i] = rt->eval(root, env, &R[i]);\n");
+    fprintf(out, "        R[%d] = R[%d]->cdr;\n", arity, arity);
+    fprintf(out, "    }\n");
+    fprintf(out, "    if(i != %d || R[%d] != rt->nil){\n", arity, arity);
+    fprintf(out, "        rt->error(\"ERROR: Cannot apply function: number "
+        "of argument does match\");\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    return ");
+    al_cc_mangle(out, "alc_f_", function->name);
+    fprintf(out, "(root, R);\n}\n\n");
+    fclose(out);
+    free(body);
+    return true;
 }
 
-// *****
-static al_object_t* al_primitive_gensym(
-    void *root, al_object_t **env, al_object_t **list
-){
-    static int count = 0;
-    char buffer[10];
-    snprintf(buffer, sizeof(buffer), "G__%d", count++);
-    return al_new_symbol(root, buffer);
+// Whether compiled code inlines calls to the builtin `name`.
+static bool al_cc_inlined(al_object_t *name){
+    static const char *names[] = {
+        "+", "-", "<", "=", "eq", "car", "cdr", "cons", "setcar", "println",
+    };
+    for(size_t i=0; i < sizeof(names) / sizeof(names[0]); i++){
+        if(al_cc_is(name, names[i])){ return true; }
+    }
+    return false;
 }
 
-// *****
-static al_object_t* al_primitive_plus(
-    void *root, al_object_t **env, al_object_t **list
-){
-    int result = 0;
-    for(al_object_t *args = al_eval_list(root, env, list);
-        args != al_nil; args = args->cdr
-    ){
-        if(args->car->type != ATTOLISP_TYPE_INT){
-            al_error("+ takes only numbers");
+// Collects the defuns and macro names of a file. A name defined twice keeps
+// its last definition, which is the one the interpreter would call.
+static void al_cc_collect(al_cc_t *cc, al_object_t *forms){
+    for(; forms != al_nil; forms = forms->cdr){
+        al_object_t *form = forms->car;
+        if(al_type(form) != ATTOLISP_TYPE_CELL || al_length(form) < 3 ||
+            al_type(form->cdr->car) != ATTOLISP_TYPE_SYMBOL
+        ){ continue; }
+        al_object_t *name = form->cdr->car;
+        al_object_t *params = NULL;
+        al_object_t *body = NULL;
+        if(al_cc_is(form->car, "defmacro")){
+            if(cc->nmacros < AL_CC_MAX_FUNCTIONS){
+                cc->macros[cc->nmacros++] = name;
+            }
+            continue;
+        }
+        if(al_cc_is(form->car, "defun")){
+            params = form->cdr->cdr->car;
+            body = form->cdr->cdr->cdr;
+        }
+        al_object_t *value = form->cdr->cdr->car;
+        if(al_cc_is(form->car, "define") && al_length(form) == 3 &&
+            al_type(value) == ATTOLISP_TYPE_CELL && al_length(value) >= 3 &&
+            al_cc_is(value->car, "lambda")
+        ){
+            params = value->cdr->car;
+            body = value->cdr->cdr;
+        }
+        if(!params){ continue; }
+        al_cc_function_t *function = NULL;
+        for(int i=0; i < cc->nfunctions; i++){
+            if(cc->functions[i].name == name){ function = &cc->functions[i]; }
+        }
+        if(!function){
+            if(cc->nfunctions == AL_CC_MAX_FUNCTIONS){
+                al_error("compile: too many functions");
+            }
+            function = &cc->functions[cc->nfunctions++];
+        }
+        function->form = form;
+        function->name = name;
+        function->failed = false;
+        function->params = params;
+        function->body = body;
+        function->arity = al_length(params);
+        if(function->arity < 0){
+            function->failed = true;
+            fprintf(stderr, "attolisp: %s left to the interpreter: "
+                "rest parameters\n", name->name);
+        }
+        for(al_object_t *p = params; al_type(p) == ATTOLISP_TYPE_CELL;
+            p = p->cdr
+        ){
+            if(al_type(p->car) != ATTOLISP_TYPE_SYMBOL){
+                function->failed = true;
+            }
+        }
+        // calls to these are inlined, so their own definition is not
+        if(!function->failed && al_cc_inlined(name)){
+            function->failed = true;
+            fprintf(stderr, "attolisp: %s left to the interpreter: "
+                "redefines a builtin\n", name->name);
         }
-        result += args->car->value;
     }
+}
 
-    return al_new_int(root, result);
+// *****
+// Index of the guarded global holding `name`, or -1.
+static int al_cc_guarded(al_cc_t *cc, al_object_t *name){
+    for(int i=0; i < cc->nglobals; i++){
+        if(cc->guarded[i] && cc->constants[cc->globals[i]] == name){
+            return i;
+        }
+    }
+    return -1;
 }
 
-static al_object_t* al_primitive_minus(
-    void *root, al_object_t **env, al_object_t **list
+// *****
+static void al_cc_write(
+    al_cc_t *cc, FILE *out, const char *source, al_object_t *forms
 ){
-    al_object_t *args = al_eval_list(root, env, list);
-    for(al_object_t *pointer = args; pointer != al_nil; pointer = pointer->cdr){
-        if(pointer->car->type != ATTOLISP_TYPE_INT){
-            al_error("- takes only numbers");
+    // the forms that did not compile are kept as constants and evaluated
+    // when the module is loaded, each in its place among the others
+    int count = al_length(forms);
+    int *init = malloc((size_t)(count + 1) * sizeof(int));
+    if(!init){ al_error("Memory exhausted"); }
+    for(int i=0; i < count; i++, forms = forms->cdr){
+        init[i] = -1;
+        for(int j=0; j < cc->nfunctions; j++){
+            if(cc->functions[j].form == forms->car &&
+                !cc->functions[j].failed
+            ){
+                init[i] = -2 - j;
+            }
         }
-    }
-    if(args->cdr == al_nil){
-        return al_new_int(root, -args->car->value);
-    }
-    int result = args->car->value;
-    for(al_object_t *pointer=args->cdr; pointer!=al_nil; pointer=pointer->cdr){
-        result -= pointer->car->value;
+        if(init[i] == -1){ init[i] = al_cc_constant(cc, forms->car); }
     }
 
-    return al_new_int(root, result);
-}
+    fprintf(out, "// Generated by attolisp --compile-c from %s\n", source);
+    fprintf(out, "#include<stdio.h>\n#include \"attolisp.h\"\n\n");
+    fprintf(out, "static const al_runtime_t *rt;\n");
+    fprintf(out, "static al_object_t *ENV;\n");
+    fprintf(out, "static al_object_t *K[%d];\n", cc->nconstants + 1);
+    fprintf(out, "static al_object_t *G[%d];\n", cc->nglobals + 1);
+    fprintf(out, "static unsigned E[%d];\n", cc->nglobals + 1);
+    fprintf(out, "static al_object_t *V[%d];\n", cc->nglobals + 1);
+    fprintf(out, "static const int S[%d] = {", cc->nglobals + 1);
+    for(int i=0; i < cc->nglobals; i++){ fprintf(out, "%d, ", cc->globals[i]); }
+    fprintf(out, "0};\n\n");
 
+    fprintf(out,
+        "static int alc_int(al_object_t *object){\n"
+        "    if(rt->type(object) != ATTOLISP_TYPE_INT){\n"
+        "        rt->error(\"ERROR: number expected\");\n"
+        "    }\n"
+        "    return object->value;\n"
+        "}\n\n"
+        "static al_object_t* alc_global(int index){\n"
+        "    if(!G[index] || E[index] != *rt->define_epoch){\n"
+        "        G[index] = rt->find(&ENV, K[S[index]]);\n"
+        "        if(!G[index]){\n"
+        "            rt->error(\"ERROR: Undefined symbol: %%s\",\n"
+        "                K[S[index]]->name);\n"
+        "        }\n"
+        "        E[index] = *rt->define_epoch;\n"
+        "    }\n"
+        "    return G[index];\n"
+        "}\n\n"
+        "static void alc_step(void){\n"
+        "    if(--*rt->fuel < 0){ rt->out_of_fuel(); }\n"
+        "}\n\n"
+        "// the caller gives the depth back when it returns\n"
+        "static void alc_enter(void){\n"
+        "    alc_step();\n"
+        "    if(--*rt->depth_left < 0){ rt->too_deep(); }\n"
+        "}\n\n");
 
-// *****
-static al_object_t* al_primitive_lt(
-    void *root, al_object_t **env, al_object_t **list
-){
-    al_object_t *args = al_eval_list(root, env, list);
-    if(al_length(args) != 2){al_error("Malformed <"); }
-    al_object_t *x = args->car;
-    al_object_t *y = args->cdr->car;
-    if(x->type != ATTOLISP_TYPE_INT || y->type != ATTOLISP_TYPE_INT){
-        al_error("< takes only numbers");
+    for(int i=0; i < cc->nfunctions; i++){
+        if(cc->functions[i].failed){ continue; }
+        fprintf(out, "static al_object_t* ");
+        al_cc_mangle(out, "alc_f_", cc->functions[i].name);
+        fprintf(out, "(void *root, al_object_t **args);\n");
     }
+    fprintf(out, "\n");
+    for(int i=0; i < cc->nfunctions; i++){
+        if(cc->functions[i].failed){ continue; }
+        fwrite(cc->functions[i].text, 1, cc->functions[i].len, out);
+    }
+
+    al_preform_t data = { NULL, 0, 0 };
+    for(int i=0; i < cc->nconstants; i++){
+        if(!al_pre_encode(&data, cc->constants[i])){
+            al_error("compile: constant cannot be encoded");
+        }
+    }
+    fprintf(out, "static const unsigned char D[] = {");
+    for(size_t i=0; i < data.len; i++){
+        fprintf(out, "%s%u,", i % 16 ? " " : "\n    ", data.data[i]);
+    }
+    fprintf(out, "\n    0\n};\n\n");
+    free(data.data);
 
-    return x->value < y->value ? al_true : al_nil;
+    fprintf(out,
+        "int attolisp_module_init(\n"
+        "    const al_runtime_t *runtime, void *root, al_object_t **env\n"
+        "){\n"
+        "    if(runtime->version != ATTOLISP_RUNTIME_VERSION){ return -1; }\n"
+        "    rt = runtime;\n"
+        "    rt->add_roots(&ENV, 1);\n"
+        "    rt->add_roots(K, %d);\n"
+        "    rt->add_roots(G, %d);\n"
+        "    rt->add_roots(V, %d);\n"
+        "    ENV = *env;\n"
+        "    const unsigned char *cursor = D;\n"
+        "    for(int i=0; i < %d; i++){\n"
+        "        K[i] = rt->materialize(root, &cursor);\n"
+        "    }\n",
+        cc->nconstants + 1, cc->nglobals + 1, cc->nglobals + 1,
+        cc->nconstants);
+    // builtins are taken as they are before the file runs, each compiled
+    // function as it is when it is added
+    for(int i=0; i < cc->nglobals; i++){
+        if(cc->guarded[i] &&
+            !al_cc_function(cc, cc->constants[cc->globals[i]])
+        ){
+            fprintf(out, "    V[%d] = alc_global(%d)->cdr;\n", i, i);
+        }
+    }
+    for(int i=0; i < count; i++){
+        if(0 <= init[i]){
+            fprintf(out, "    rt->eval(root, env, &K[%d]);\n", init[i]);
+            continue;
+        }
+        al_cc_function_t *function = &cc->functions[-2 - init[i]];
+        fprintf(out, "    rt->add_primitive(root, env, \"");
+        for(const char *c = function->name->name; *c; c++){
+            fprintf(out, *c == '?' ? "\\?" : "%c", *c);
+        }
+        fprintf(out, "\", ");
+        al_cc_mangle(out, "alc_p_", function->name);
+        fprintf(out, ");\n");
+        int global = al_cc_guarded(cc, function->name);
+        if(0 <= global){
+            fprintf(out, "    V[%d] = alc_global(%d)->cdr;\n",
+                global, global);
+        }
+    }
+    fprintf(out, "    return 0;\n}\n");
+    free(init);
 }
 
 // *****
-static al_object_t* al_handle_function(
-    void *root, al_object_t **env, al_object_t **list, int type
-){
-    if((*list)->type != ATTOLISP_TYPE_CELL ||
-        !al_is_list((*list)->car) ||
-        (*list)->cdr->type != ATTOLISP_TYPE_CELL
-    ){
-        al_error("Malformed lambda");
+static void al_compile_file(void *root, const char *source, const char *target){
+    if(!freopen(source, "r", stdin)){
+        al_error("ERROR: cannot open %s", source);
     }
-    al_object_t *pointer = (*list)->car;
-    for(; pointer->type == ATTOLISP_TYPE_CELL; pointer = pointer->cdr){
-        if(pointer->car->type != ATTOLISP_TYPE_SYMBOL){
-            al_error("Parameter must be a symbol");
+    AL_DEFINE2(forms, expr);
+    *forms = al_nil;
+    while((*expr = al_read_expr(root))){
+        if(*expr == al_cparen || *expr == al_dot){
+            al_error("Stray %s", *expr == al_dot ? "dot" : "close parenthesis");
         }
+        *forms = al_new_cons(root, expr, forms);
     }
-    if(pointer != al_nil && pointer->type != ATTOLISP_TYPE_SYMBOL){
-        al_error("Parameter must be a symbol");
+    *forms = al_reverse(*forms);
+
+    // Nothing below allocates, so plain pointers into the heap stay valid.
+    al_cc_t *cc = calloc(1, sizeof(al_cc_t));
+    if(!cc){ al_error("Memory exhausted"); }
+    al_cc_collect(cc, *forms);
+    // A function that cannot be compiled changes how the others call it,
+    // so start over until every remaining function compiles.
+    for(bool again = true; again; ){
+        again = false;
+        cc->nconstants = cc->nglobals = 0;
+        for(int i=0; i < cc->nfunctions; i++){
+            al_cc_function_t *function = &cc->functions[i];
+            free(function->text);
+            function->text = NULL;
+            if(function->failed){ continue; }
+            if(!al_cc_function_body(cc, function)){
+                fprintf(stderr, "attolisp: %s left to the interpreter: %s\n",
+                    function->name->name, cc->error);
+                function->failed = again = true;
+                break;
+            }
+        }
     }
-    AL_DEFINE2(params, body);
-    *params = (*list)->car;
-    *body = (*list)->cdr;
-    return al_new_function(root, env, type, params, body);
-}
 
-static al_object_t* al_primitive_lambda(
-    void *root, al_object_t **env, al_object_t **list
-){
-    return al_handle_function(root, env, list, ATTOLISP_TYPE_FUNCTION);
+    FILE *out = fopen(target, "w");
+    if(!out){ al_error("ERROR: cannot write %s", target); }
+    al_cc_write(cc, out, source, *forms);
+    fclose(out);
+    int compiled = 0;
+    for(int i=0; i < cc->nfunctions; i++){
+        compiled += !cc->functions[i].failed;
+        free(cc->functions[i].text);
+    }
+    fprintf(stderr, "attolisp: %d of %d functions compiled into %s\n"
+        "build it with: cc -O2 -shared -fPIC -I<attolisp src dir> %s -o "
+        "module.so\n", compiled, cc->nfunctions, target, target);
+    free(cc);
 }
 
-static al_object_t* al_handle_defun(
-    void *root, al_object_t **env, al_object_t **list, int type
+// -------------------------------
+// ------ NATIVE MODULES ---------
+// -------------------------------
+// Applies `fn` to arguments that have already been evaluated.
+static al_object_t* al_apply_values(
+    void *root, al_object_t **env, al_object_t **fn, al_object_t **args
 ){
-    if((*list)->car->type != ATTOLISP_TYPE_SYMBOL ||
-        (*list)->cdr->type != ATTOLISP_TYPE_CELL
-    ){
-        al_error("Malformed defun");
+    if(al_type(*fn) == ATTOLISP_TYPE_FUNCTION){
+        return al_apply_callback(root, env, fn, args);
     }
-
-    AL_DEFINE3(fn, symbol, rest);
-    *symbol = (*list)->car;
-    *rest = (*list)->cdr;
-    *fn = al_handle_function(root, env, rest, type);
-    al_add_variable(root, env, symbol, fn);
-
-    return *fn;
+    if(al_type(*fn) != ATTOLISP_TYPE_PRIMITIVE){
+        al_error("ERROR:: not supported");
+    }
+    // primitives evaluate their own arguments, so hand them quoted values
+    AL_DEFINE4(quote, head, pointer, tmp);
+    *quote = al_intern(root, "quote");
+    *head = al_nil;
+    for(*pointer = *args; *pointer != al_nil; *pointer = (*pointer)->cdr){
+        *tmp = (*pointer)->car;
+        *tmp = al_new_cons(root, tmp, &al_nil);
+        *tmp = al_new_cons(root, quote, tmp);
+        *head = al_new_cons(root, tmp, head);
+    }
+    *head = al_reverse(*head);
+    return (*fn)->fn(root, env, head);
 }
 
-static al_object_t* al_primitive_defun(
-    void *root, al_object_t **env, al_object_t **list
-){
-    return al_handle_defun(root, env, list, ATTOLISP_TYPE_FUNCTION);
+// *****
+static al_object_t** al_rt_reserve(void *root, size_t size){
+    return al_root_reserve(root, size);
 }
 
-static al_object_t* al_primitive_define(
-    void *root, al_object_t **env, al_object_t **list
+// *****
+static void al_rt_add_primitive(
+    void *root, al_object_t **env, const char *name, al_primitive_t fn
 ){
-    if(al_length(*list) != 2 || (*list)->car->type != ATTOLISP_TYPE_SYMBOL){
-        al_error("Malformed define");
-    }
-    AL_DEFINE2(symbol, value);
-    *symbol = (*list)->car;
-    *value = (*list)->cdr->car;
-    *value = al_eval(root, env, value);
-    al_add_variable(root, env, symbol, value);
-
-    return *value;
+    al_add_primitive(root, env, (char*)name, fn);
 }
 
-static al_object_t* al_primitive_defmacro(
-    void *root, al_object_t **env, al_object_t **list
-){
-    return al_handle_defun(root, env, list, ATTOLISP_TYPE_MACRO);
+// *****
+static void al_rt_out_of_fuel(void){
+    al_quota_exceeded("step", al_fuel_limit);
 }
 
+// *****
+static void al_rt_too_deep(void){
+    al_quota_exceeded("depth", al_depth_limit);
+}
 
-static al_object_t* al_primitive_macroexpand(
-    void *root, al_object_t **env, al_object_t **list
-){
-    if(al_length(*list) != 1){
-        al_error("Malformed macroexpand");
+// *****
+static void al_load_native(void *root, al_object_t **env, const char *path){
+    static al_runtime_t runtime;
+    runtime = (al_runtime_t){
+        .version = ATTOLISP_RUNTIME_VERSION,
+        .nil = al_nil,
+        .true_ = al_true,
+        .define_epoch = &al_define_epoch,
+        .new_int = al_new_int,
+        .new_cons = al_new_cons,
+        .materialize = al_materialize,
+        .eval = al_eval,
+        .apply = al_apply_values,
+        .find = al_find,
+        .reserve = al_rt_reserve,
+        .add_roots = al_add_static_roots,
+        .add_primitive = al_rt_add_primitive,
+        .print = al_print,
+        .error = al_error,
+        .type = al_type,
+        .fuel = &al_fuel,
+        .depth_left = &al_depth_left,
+        .out_of_fuel = al_rt_out_of_fuel,
+        .too_deep = al_rt_too_deep,
+    };
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(!handle){
+        al_error("ERROR: cannot load %s: %s", path, dlerror());
+    }
+    al_module_init_t init;
+    *(void**)&init = dlsym(handle, ATTOLISP_MODULE_INIT);
+    if(!init){
+        al_error("ERROR: %s has no %s", path, ATTOLISP_MODULE_INIT);
+    }
+    if(init(&runtime, root, env) != 0){
+        al_error("ERROR: %s: module initialisation failed", path);
     }
-    AL_DEFINE1(body);
-    *body = (*list)->car;
-    return al_macroexpand(root, env, body);
 }
 
+// ------------------------------------------------------------------
+//                      EVALUATION SERVER
+// ------------------------------------------------------------------
+// `--serve socket` keeps one warm interpreter behind a Unix domain socket.
+// Each connection is one request: the client sends forms and shuts down its
+// side, and gets back the printed value of each form, one per line. The
+// forms are evaluated in a fresh environment over the globals, so their
+// defines do not outlive the request, and the values of the globals are put
+// back when it ends, so neither does a setq on them. Objects the globals
+// refer to are not copied: changing one in place with setcar or
+// buffer-set is seen by later requests. An error ends the request with its
+// message and leaves the server running.
 
-static al_object_t* al_primitive_println(
-    void *root, al_object_t **env, al_object_t **list
-){
-    AL_DEFINE1(tmp);
-    *tmp = (*list)->car;
-    al_print(al_eval(root, env, tmp));
-    printf("\n");
-    return al_nil;
+// Evaluates the forms of `path` into `env` without printing them.
+static void al_load_file(void *root, al_object_t **env, const char *path){
+    FILE *in = fopen(path, "r");
+    if(!in){ al_error("ERROR: cannot open %s", path); }
+    al_input = in;
+    AL_DEFINE1(expr);
+    while((*expr = al_read_expr(root))){
+        if(*expr == al_cparen){ al_error("Stray close parenthesis"); }
+        if(*expr == al_dot){ al_error("Stray dot"); }
+        al_eval_toplevel(root, env, expr);
+    }
+    al_input = stdin;
+    fclose(in);
 }
 
-static al_object_t* al_primitive_if(
-    void *root, al_object_t **env, al_object_t **list
-){
-    if(al_length(*list) < 2){
-        al_error("Malformed if");
+// Puts the interpreter back in the state it had at the start of a request
+// that was cut short by an error. The tasks it started are dropped. No
+// function runs between requests, so no unit is active.
+static void al_recover(uint8_t *frame_top, size_t site_depth){
+    al_task_kill_all();
+    al_frame_top = frame_top;
+    al_site_depth = site_depth;
+    al_quota_end();
+    for(al_code_t *code = al_codes; code; code = code->next){
+        code->active = 0;
     }
-    AL_DEFINE3(cond, here, there);
-    *cond = (*list)->car;
-    *cond = al_eval(root, env, cond);
-    if(*cond != al_nil){
-        *here = (*list)->cdr->car;
-        return al_eval(root, env, here);
-    }
-    *there = (*list)->cdr->cdr;
-    return *there == al_nil ? al_nil : al_progn(root, env, there);
+    al_abandon_analysis();
 }
 
-static al_object_t* al_primitive_number_eq(
-    void *root, al_object_t **env, al_object_t **list
-){
-    if(al_length(*list) != 2){
-        al_error("Malformed =");
+// Pairs each binding of `env` with its current value.
+static al_object_t* al_serve_snapshot(void *root, al_object_t **env){
+    AL_DEFINE4(vars, binding, value, saved);
+    *saved = al_nil;
+    for(*vars = (*env)->vars; *vars != al_nil; *vars = (*vars)->cdr){
+        *binding = (*vars)->car;
+        *value = (*binding)->cdr;
+        *saved = al_acons(root, binding, value, saved);
     }
-    al_object_t *values = al_eval_list(root, env, list);
-    al_object_t *x = values->car;
-    al_object_t *y = values->cdr->car;
-    if(x->type != ATTOLISP_TYPE_NIL || y->type != ATTOLISP_TYPE_INT){
-        al_error("= only takes numbers");
-    }
-    return x->value == y->value ? al_true : al_nil;
+    return *saved;
 }
 
-static al_object_t* al_primitive_eq(
-    void *root, al_object_t **env, al_object_t **list
-){
-    if(al_length(*list) != 2){
-        al_error("Malformed eq");
+// *****
+static void al_serve_restore(al_object_t *saved){
+    for(; saved != al_nil; saved = saved->cdr){
+        saved->car->car->cdr = saved->car->cdr;
     }
-    al_object_t *values = al_eval_list(root, env, list);
-    return values->car == values->cdr->car ? al_true : al_nil;
 }
 
-static void al_add_primitive(
-    void *root, al_object_t **env, char *name, al_primitive_t fn
-){
-    AL_DEFINE2(symbol, primitive);
-    *symbol = al_intern(root, name);
-    *primitive = al_new_primitive(root, fn);
-    al_add_variable(root, env, symbol, primitive);
+// Reads and prints the forms of the current input in a child of `env`.
+// Returns false if an error cut the request short.
+static bool al_serve_forms(void *root, al_object_t **env){
+    AL_DEFINE3(local, expr, saved);
+    *local = al_new_env(root, &al_nil, env);
+    *saved = al_nil;
+    uint8_t *frame_top = al_frame_top;
+    size_t site_depth = al_site_depth;
+    jmp_buf handler;
+    if(setjmp(handler)){
+        al_error_handler = NULL;
+        al_recover(frame_top, site_depth);
+        al_serve_restore(*saved);
+        return false;
+    }
+    al_error_handler = &handler;
+    *saved = al_serve_snapshot(root, env);
+    while((*expr = al_read_expr(root))){
+        if(*expr == al_cparen){ al_error("Stray close parenthesis"); }
+        if(*expr == al_dot){ al_error("Stray dot"); }
+        al_print(al_eval_toplevel(root, local, expr));
+        printf("\n");
+    }
+    // the tasks of a request end with it
+    al_task_drain(root);
+    al_task_kill_all();
+    al_error_handler = NULL;
+    al_serve_restore(*saved);
+    return true;
 }
 
-static void al_define_constants(void *root, al_object_t **env){
-    AL_DEFINE1(symbol);
-    *symbol = al_intern(root, "t");
-    al_add_variable(root, env, symbol, &al_true);
+// Reads the whole request, then runs it with the standard output and error
+// going to the client.
+static void al_serve_request(void *root, al_object_t **env, int client){
+    size_t len = 0, capacity = 4096;
+    char *text = malloc(capacity);
+    for(;;){
+        if(!text){ al_error("ERROR: out of memory for request"); }
+        ssize_t got = read(client, text + len, capacity - len);
+        if(got < 0 && errno == EINTR){ continue; }
+        if(got <= 0){ break; }
+        len += (size_t)got;
+        if(len == capacity){ text = realloc(text, capacity *= 2); }
+    }
+    FILE *in = len ? fmemopen(text, len, "r") : NULL;
+    if(in){
+        fflush(stdout);
+        fflush(stderr);
+        int out = dup(STDOUT_FILENO), err = dup(STDERR_FILENO);
+        dup2(client, STDOUT_FILENO);
+        dup2(client, STDERR_FILENO);
+        al_input = in;
+        al_serve_forms(root, env);
+        al_input = stdin;
+        fflush(stdout);
+        fflush(stderr);
+        dup2(out, STDOUT_FILENO);
+        dup2(err, STDERR_FILENO);
+        close(out);
+        close(err);
+        fclose(in);
+    }
+    free(text);
 }
 
-static void al_define_primitives(void *root, al_object_t **env){
-    al_add_primitive(root, env, "quote", al_primitive_quote);
-    al_add_primitive(root, env, "cons", al_primitive_cons);
-    al_add_primitive(root, env, "car", al_primitive_car);
-    al_add_primitive(root, env, "cdr", al_primitive_cdr);
-    al_add_primitive(root, env, "setq", al_primitive_setq);
-    al_add_primitive(root, env, "setcar", al_primitive_setcar);
-    al_add_primitive(root, env, "while", al_primitive_while);
-    al_add_primitive(root, env, "gensym", al_primitive_gensym);
-    al_add_primitive(root, env, "+", al_primitive_plus);
-    al_add_primitive(root, env, "-", al_primitive_minus);
-    al_add_primitive(root, env, "<", al_primitive_lt);
-    al_add_primitive(root, env, "define", al_primitive_define);
-    al_add_primitive(root, env, "defun", al_primitive_defun);
-    al_add_primitive(root, env, "defmacro", al_primitive_defmacro);
-    al_add_primitive(root, env, "macroexpand", al_primitive_macroexpand);
-    al_add_primitive(root, env, "lambda", al_primitive_lambda);
-    al_add_primitive(root, env, "if", al_primitive_if);
-    al_add_primitive(root, env, "=", al_primitive_number_eq);
-    al_add_primitive(root, env, "eq", al_primitive_eq);
-    al_add_primitive(root, env, "println", al_primitive_println);
+// *****
+static void al_serve(void *root, al_object_t **env, const char *path){
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(sizeof(address.sun_path) <= strlen(path)){
+        al_error("ERROR: socket path too long: %s", path);
+    }
+    strcpy(address.sun_path, path);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0){ al_error("ERROR: cannot create socket"); }
+    unlink(path);
+    if(bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(server, 64) != 0
+    ){
+        al_error("ERROR: cannot listen on %s: %s", path, strerror(errno));
+    }
+    // a client that goes away must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "attolisp: serving on %s\n", path);
+    for(;;){
+        int client = accept(server, NULL, NULL);
+        if(client < 0){
+            if(errno == EINTR || errno == ECONNABORTED){ continue; }
+            al_error("ERROR: accept: %s", strerror(errno));
+        }
+        al_serve_request(root, env, client);
+        close(client);
+    }
 }
 
-
 // --------------------------
 //          ENTRY POINT
 // --------------------------
@@ -1058,38 +7788,155 @@ static bool al_getenv_flag(char *name){
     return value && value[0];
 }
 
+// Reads a byte count such as "512M"; returns `fallback` when unset.
+static size_t al_getenv_size(char *name, size_t fallback){
+    char *value = getenv(name);
+    if(!value || !value[0]){ return fallback; }
+    char *end;
+    unsigned long long size = strtoull(value, &end, 10);
+    switch(toupper((unsigned char)*end)){
+    case 'G': size <<= 10; // fall through
+    case 'M': size <<= 10; // fall through
+    case 'K': size <<= 10; break;
+    case '\0': break;
+    default:
+        al_error("ERROR: %s: bad size '%s'", name, value);
+    }
+    return (size_t)size;
+}
+
+static void al_usage(const char *program){
+    fprintf(stderr,
+        "usage: %s [--load-native module.so]... [--load file.alsp]...\n"
+        "          [--serve socket]\n"
+        "       %s --compile-c file.alsp [-o file.c]\n", program, program);
+    exit(EXIT_FAILURE);
+}
+
 // *********************************
 // ---- M A I N    D R I V E R -----
 // *********************************
 int main(int argc, char **argv){
+    // Command line
+    const char *compile_source = NULL;
+    const char *compile_target = NULL;
+    const char *serve_path = NULL;
+    for(int i=1; i < argc; i++){
+        if(strcmp(argv[i], "--compile-c") == 0 && i + 1 < argc){
+            compile_source = argv[++i];
+        }else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+            compile_target = argv[++i];
+        }else if(strcmp(argv[i], "--load-native") == 0 && i + 1 < argc){
+            i++;
+        }else if(strcmp(argv[i], "--load") == 0 && i + 1 < argc){
+            i++;
+        }else if(strcmp(argv[i], "--serve") == 0 && i + 1 < argc){
+            serve_path = argv[++i];
+        }else{
+            al_usage(argv[0]);
+        }
+    }
+    al_input = stdin;
     // Debug flag
     al_gc_debug = al_getenv_flag("ATTOLISP_GC_DEBUG");
     al_gc_always = al_getenv_flag("ATTOLISP_GC_ALWAYS");
+    al_pipeline = al_getenv_flag("ATTOLISP_PIPELINE");
+    al_analyzer = !al_getenv_flag("ATTOLISP_INTERPRET");
+    al_optimizer = al_analyzer && al_getenv_flag("ATTOLISP_OPTIMIZE");
+    al_stack_frames = !al_getenv_flag("ATTOLISP_HEAP_FRAMES");
+    if(al_getenv_flag("ATTOLISP_HUGE_PAGES")){
+        al_huge_pages = strcmp(getenv("ATTOLISP_HUGE_PAGES"), "explicit") ?
+            AL_HUGE_TRANSPARENT : AL_HUGE_EXPLICIT;
+    }
+    al_prefault = al_getenv_flag("ATTOLISP_PREFAULT");
+    al_weak_symbols = al_getenv_flag("ATTOLISP_WEAK_SYMBOLS");
+    al_memsize = al_round_up(
+        al_getenv_size("ATTOLISP_HEAP_SIZE", ATTOLISP_MEMSIZE),
+        al_huge_pages == AL_HUGE_NONE ? AL_PAGE_SIZE : AL_HUGE_PAGE_SIZE);
+    char *threads = getenv("ATTOLISP_GC_THREADS");
+    if(threads && threads[0]){
+        char *end;
+        long count = strtol(threads, &end, 10);
+        al_gc_threads = *end || count < 1 || AL_GC_MAX_THREADS < count ?
+            0 : (int)count;
+    }
+    if(al_gc_threads < 1 || AL_GC_MAX_THREADS < al_gc_threads){
+        al_error("ERROR: ATTOLISP_GC_THREADS must be in 1..%d",
+            AL_GC_MAX_THREADS);
+    }
+    al_los_threshold = al_getenv_size(
+        "ATTOLISP_LOS_THRESHOLD", ATTOLISP_LOS_THRESHOLD);
+    al_memo_size = al_getenv_size("ATTOLISP_MEMO_SIZE", ATTOLISP_MEMO_SIZE);
+    al_task_stack = al_round_up(al_getenv_size(
+        "ATTOLISP_TASK_STACK", ATTOLISP_TASK_STACK), AL_PAGE_SIZE);
+    al_fuel_limit = (int64_t)al_getenv_size("ATTOLISP_FUEL", INT64_MAX);
+    al_alloc_limit = (int64_t)al_getenv_size(
+        "ATTOLISP_ALLOC_LIMIT", INT64_MAX);
+    al_depth_limit = (int64_t)al_getenv_size("ATTOLISP_DEPTH_LIMIT", INT64_MAX);
+    if(al_getenv_flag("ATTOLISP_TRACE")){
+        al_trace_init(getenv("ATTOLISP_TRACE"), al_getenv_size(
+            "ATTOLISP_TRACE_EVENTS", ATTOLISP_TRACE_EVENTS));
+    }
+    if(al_getenv_flag("ATTOLISP_ALLOC_PROFILE")){
+        al_profile_init(getenv("ATTOLISP_ALLOC_PROFILE"));
+    }
+    al_hooks = al_tracing || al_profiling;
+    al_gc_init();
+    al_los_init();
+    al_frame_init();
     // Memory allocation
-    al_memory = al_alloc_semispace();
+    al_heap_init();
     // Constants and primitives
     al_symbols = al_nil;
-    void *root = NULL;
+    void *root = al_root_init();
     AL_DEFINE2(env, expr);
     *env = al_new_env(root, &al_nil, &al_nil);
     al_define_constants(root, env);
     al_define_primitives(root, env);
 
+    if(compile_source){
+        char buffer[4096];
+        if(!compile_target){
+            const char *dot = strrchr(compile_source, '.');
+            int len = dot ? (int)(dot - compile_source) :
+                (int)strlen(compile_source);
+            snprintf(buffer, sizeof(buffer), "%.*s.c", len, compile_source);
+            compile_target = buffer;
+        }
+        al_compile_file(root, compile_source, compile_target);
+        return EXIT_SUCCESS;
+    }
+    for(int i=1; i < argc; i++){
+        if(strcmp(argv[i], "--load-native") == 0){
+            al_load_native(root, env, argv[++i]);
+        }else if(strcmp(argv[i], "--load") == 0){
+            al_load_file(root, env, argv[++i]);
+        }
+    }
+    if(serve_path){
+        al_serve(root, env, serve_path);
+    }
+
+    if(al_pipeline){ al_pipe_start(); }
+
     // main loop
     while(1){
         printf("%s--->>%s Waiting for input ...\n", "\x1b[34m", "\x1b[0m");
         printf("%salisp%s>>%s ", "\x1b[32m", "\x1b[1;33m", "\x1b[0m");
-        *expr = al_read_expr(root);
+        *expr = al_pipeline ? al_pipe_read_expr(root) : al_read_expr(root);
+        if(!*expr){
+            al_task_drain(root);
+            return 0;
+        }
         printf("%s--->>%s Input is: ", "\x1b[34m", "\x1b[0m");
         al_print(*expr);
-        if(!*expr){ return 0; }
         if(*expr == al_cparen){
             al_error("Stray close parenthesis");
         }
         if(*expr == al_dot){
             al_error("Stray dot");
         }
-        al_print(al_eval(root, env, expr));
+        al_print(al_eval_toplevel(root, env, expr));
         printf("\n");
     }
 
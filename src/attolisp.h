@@ -1,5 +1,6 @@
 #ifndef __ATTOLISP_H_
 #define __ATTOLISP_H_
+#include<stdint.h>
 enum{
     ATTOLISP_TYPE_INT=1,
     ATTOLISP_TYPE_CELL,
@@ -12,7 +13,12 @@ enum{
     ATTOLISP_TYPE_TRUE,
     ATTOLISP_TYPE_NIL,
     ATTOLISP_TYPE_DOT,
-    ATTOLISP_TYPE_CPAREN 
+    ATTOLISP_TYPE_CPAREN,
+    ATTOLISP_TYPE_BUFFER,
+    ATTOLISP_TYPE_WEAK,
+    ATTOLISP_TYPE_TABLE,
+    ATTOLISP_TYPE_CHANNEL,
+    ATTOLISP_TYPE_COPYING
 };
 
 struct al_object_t;
@@ -20,13 +26,16 @@ typedef struct al_object_t* (*al_primitive_t)(
     void *root, struct al_object_t **env, struct al_object_t **args
 );
 
+// Conses, integers, primitives, closures and environments allocated in the
+// heap have no header: `type` and `size` are only present on symbols and
+// other objects outside the typed pages.
 typedef struct al_object_t {
     int type;   /* object type */
     int size;   /* total size  */
     union{
         // integer
         int value;
-        // cell
+        // cell, or channel: values not received yet and the last cell
         struct{
             struct al_object_t *car;
             struct al_object_t *cdr;
@@ -40,15 +49,69 @@ typedef struct al_object_t {
             struct al_object_t *params;
             struct al_object_t *body;
             struct al_object_t *env;
+            void *code;     /* analyzed body, filled in on first call */
         };
         // environment frame
         struct {
             struct al_object_t *vars;
             struct al_object_t *up;
         };
+        // byte buffer: its own bytes, which follow and never move, or
+        // memory owned by C
+        struct {
+            size_t length;
+            void *address;
+        };
+        // weak reference or weak-keyed table, chained through `weak_next`
+        // while a collection runs
+        struct {
+            union {
+                struct al_object_t *referent;
+                struct al_table_t *table;
+            };
+            struct al_object_t *weak_next;
+        };
         // forwarding pointer
         void *moved;
     };
 } al_object_t;
 
+// Interface handed to native modules built with `--compile-c`. A module
+// exports ATTOLISP_MODULE_INIT and registers its functions through it.
+typedef struct al_runtime_t {
+    int version;
+    al_object_t *nil;
+    al_object_t *true_;
+    const unsigned *define_epoch;   // bumped whenever a binding is added
+    al_object_t* (*new_int)(void *root, int value);
+    al_object_t* (*new_cons)(
+        void *root, al_object_t **car, al_object_t **cdr);
+    al_object_t* (*materialize)(void *root, const unsigned char **cursor);
+    al_object_t* (*eval)(void *root, al_object_t **env, al_object_t **object);
+    // applies `fn` to a list of already evaluated arguments
+    al_object_t* (*apply)(
+        void *root, al_object_t **env, al_object_t **fn, al_object_t **args);
+    al_object_t* (*find)(al_object_t **env, al_object_t *symbol);
+    al_object_t** (*reserve)(void *root, size_t size);
+    void (*add_roots)(al_object_t **slots, size_t count);
+    void (*add_primitive)(
+        void *root, al_object_t **env, const char *name, al_primitive_t fn);
+    void (*print)(al_object_t *object);
+    void (*error)(const char *fmt, ...);
+    // heap objects may have no header, so their type is read through this
+    int (*type)(const al_object_t *object);
+    // quotas: a loop iteration takes one from *fuel and a call one from
+    // each counter, handing back the depth when it returns; the hooks
+    // raise the error once a counter goes below zero
+    int64_t *fuel;
+    int64_t *depth_left;
+    void (*out_of_fuel)(void);
+    void (*too_deep)(void);
+} al_runtime_t;
+
+#define ATTOLISP_RUNTIME_VERSION    3
+#define ATTOLISP_MODULE_INIT        "attolisp_module_init"
+typedef int (*al_module_init_t)(
+    const al_runtime_t *rt, void *root, al_object_t **env);
+
 #endif
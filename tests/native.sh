@@ -0,0 +1,40 @@
+#!/bin/sh
+# Compiles tests/native.alsp to C, builds and loads it, and checks that the
+# forms below give what the interpreter gives with the same file loaded:
+# duplicate definitions, functions left to the interpreter, and calls whose
+# builtin or callee is redefined or set after the module is loaded. The
+# last form runs into the step quota.
+# Run from the repository root:  sh tests/native.sh _gate_build/AttoLisp
+AL=${1:-AttoLisp}
+DIR=${TMPDIR:-/tmp}/attolisp-native-$$
+mkdir -p "$DIR" || exit 1
+trap 'rm -rf "$DIR"' EXIT
+cat > "$DIR/main.alsp" <<'END'
+(thrice 2)
+(top 1)
+(guarded 5)
+((adder 3) 4)
+added
+(car 7)
+(pair 1 2)
+(count-up 3)
+(defun twice (x) (- x 1))
+(thrice 5)
+(setq base 1)
+(top 1)
+(setq cons (lambda (a b) a))
+(pair 1 2)
+(define < (lambda (a b) (= a 3)))
+(count-up 3)
+(define + -)
+(top 5)
+(thrice 5)
+(spin 0)
+END
+"$AL" --compile-c tests/native.alsp -o "$DIR/native.c" &&
+    ${CC:-cc} -O2 -shared -fPIC -Isrc "$DIR/native.c" -o "$DIR/native.so" ||
+    exit 1
+export ATTOLISP_FUEL=1M
+"$AL" --load tests/native.alsp < "$DIR/main.alsp" > "$DIR/expected" 2>&1
+"$AL" --load-native "$DIR/native.so" < "$DIR/main.alsp" > "$DIR/actual" 2>&1
+diff "$DIR/expected" "$DIR/actual" && echo "native: ok"